@@ -0,0 +1,353 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "account.h"
+#include "account_ext.h"
+#include "trader.h"
+#include "trader_ext.h"
+#include "exchange.h"
+#include "exchange_ext.h"
+#include "config.h"
+#include "stubs.h"
+
+/*
+ * In-process benchmark of the matching engine.
+ *
+ * Drives the exchange directly from one thread, with the packet layer
+ * stubbed out (see stubs.c), so that the cost of matching can be measured
+ * without sockets.  With -S, each trader is instead connected through a
+ * socketpair whose other end a thread keeps reading, so that the cost of
+ * sending the notifications is included.  The matchmaker and publisher
+ * threads run as they do in the server.  The synthetic order flow is a mix of:
+ *
+ *   post    a passive order within <depth> ticks of the middle price, on
+ *           the side where it rests
+ *   cross   an order that crosses the middle price by up to <depth> ticks,
+ *           and so trades against resting orders
+ *   cancel  a cancel of a random earlier passive order (which may already
+ *           have been filled, in which case the cancel fails)
+ *
+ * each placed by a random trader for a random instrument.  Throughput and
+ * the latency distribution of each kind of operation are reported.
+ *
+ * Usage: bourse_bench [-n <ops>] [-t <traders>] [-d <depth>] [-q <quantity>]
+ *                     [-m <post>:<cross>:<cancel>] [-I <instruments>] [-A] [-S] [-s <seed>]
+ *
+ *   -n <ops>       Number of operations to time (default 1000000).
+ *   -t <traders>   Number of traders placing orders (default 16).
+ *   -d <depth>     Price levels on each side of the middle price (default 50).
+ *   -q <quantity>  Largest quantity of an order (default 10).
+ *   -m <mix>       Relative weights of post, cross and cancel (default 60:20:20).
+ *   -I <instruments>  Number of instruments traded (default 1).
+ *   -A             Leave all matching to the matchmaker threads.
+ *   -S             Send the notifications through sockets.
+ *   -s <seed>      Seed for the order flow (default 1).
+ */
+
+#define MID_PRICE 10000
+
+typedef enum { OP_POST, OP_CROSS, OP_CANCEL, NOPS } OP_TYPE;
+
+static const char *op_names[NOPS] = { "post", "cross", "cancel" };
+
+/*
+ * A passive order that may still be resting, and so may be canceled.
+ */
+struct live_order {
+    TRADER *trader;
+    instrument_t instrument;
+    orderid_t id;
+};
+
+static struct {
+    uint32_t *ns;                   // latency of each operation of the type
+    size_t count;
+    size_t failed;                  // rejected orders or cancels of filled orders
+} ops[NOPS];
+
+static bool bench_sockets;          // connect the traders through socketpairs
+
+/*
+ * The client ends of the traders' socketpairs, drained by drain_clients().
+ */
+static int *client_fds;
+static size_t nclients;
+static atomic_bool draining = true;
+
+static void *drain_clients(void *arg) {
+    struct pollfd *fds = calloc(nclients, sizeof(struct pollfd));
+    char buf[65536];
+
+    for (size_t i = 0; i < nclients; i++) {
+        fds[i].fd = client_fds[i];
+        fds[i].events = POLLIN;
+    }
+    while (atomic_load(&draining)) {
+        if (poll(fds, nclients, 100) <= 0) {
+            continue;
+        }
+        for (size_t i = 0; i < nclients; i++) {
+            if (fds[i].revents & POLLIN) {
+                while (recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+                    continue;
+                }
+            }
+        }
+    }
+    free(fds);
+    return NULL;
+}
+
+static uint64_t rng_state = 1;
+
+static inline uint64_t rng(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(uint32_t *sorted, size_t n, double q) {
+    return n ? sorted[(size_t)(q * (n - 1))] / 1000.0 : 0;
+}
+
+static void report_line(const char *name, uint32_t *ns, size_t n, size_t failed) {
+    qsort(ns, n, sizeof(uint32_t), compare_u32);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += ns[i];
+    }
+    printf("%-8s %10zu %8zu %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, n, failed,
+           n ? sum / n / 1000.0 : 0, percentile(ns, n, 0.5), percentile(ns, n, 0.99),
+           percentile(ns, n, 0.999), n ? ns[n - 1] / 1000.0 : 0);
+}
+
+int main(int argc, char *argv[]) {
+    size_t nops = 1000000, ntraders = 16, depth = 50, max_qty = 10;
+    unsigned weights[NOPS] = { 60, 20, 20 };
+    int c;
+
+    config.instruments = 1;
+    while ((c = getopt(argc, argv, "n:t:d:q:m:I:ASs:")) != -1) {
+        switch (c) {
+        case 'n':
+            nops = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            ntraders = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            depth = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            max_qty = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%u:%u:%u", &weights[OP_POST], &weights[OP_CROSS], &weights[OP_CANCEL]) != 3) {
+                fprintf(stderr, "Mix must be given as <post>:<cross>:<cancel>.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'I':
+            config.instruments = strtoul(optarg, NULL, 10);
+            break;
+        case 'A':
+            config.match_inline = false;
+            break;
+        case 'S':
+            bench_sockets = true;
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 10) | 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n <ops>] [-t <traders>] [-d <depth>] [-q <quantity>]\n"
+                            "       [-m <post>:<cross>:<cancel>] [-I <instruments>] [-A] [-S] [-s <seed>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned total_weight = weights[OP_POST] + weights[OP_CROSS] + weights[OP_CANCEL];
+    if (nops == 0 || ntraders == 0 || depth == 0 || depth >= MID_PRICE
+        || max_qty == 0 || total_weight == 0 || config.instruments == 0 || config.instruments > MAX_INSTRUMENTS) {
+        fprintf(stderr, "Invalid parameters.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    config.max_traders = ntraders;
+    accounts_init();
+    traders_init();
+    EXCHANGE *xchg = exchange_init();
+    if (!xchg) {
+        fprintf(stderr, "Failed to initialize the exchange.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every trader can afford anything the flow asks of it
+    TRADER **traders = calloc(ntraders, sizeof(TRADER *));
+    client_fds = calloc(ntraders, sizeof(int));
+    nclients = bench_sockets ? ntraders : 0;
+    for (size_t i = 0; i < ntraders; i++) {
+        char name[32];
+        int sv[2] = { BENCH_FAKE_FD + i, -1 };  // without -S, the fd only reaches the stubs
+        snprintf(name, sizeof(name), "bench%zu", i);
+        if (bench_sockets && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        client_fds[i] = sv[1];
+        traders[i] = trader_login(sv[0], name);
+        if (!traders[i]) {
+            fprintf(stderr, "Failed to log in trader %s.\n", name);
+            exit(EXIT_FAILURE);
+        }
+        ACCOUNT *acc = trader_get_account(traders[i]);
+        account_increase_balance(acc, 2000000000);
+        for (size_t inst = 0; inst < config.instruments; inst++) {
+            account_increase_inventory_of(acc, inst, 200000000);
+        }
+    }
+
+    pthread_t drainer;
+    if (bench_sockets && pthread_create(&drainer, NULL, drain_clients, NULL) != 0) {
+        fprintf(stderr, "Failed to start the client thread.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int t = 0; t < NOPS; t++) {
+        ops[t].ns = malloc(nops * sizeof(uint32_t));
+        if (!ops[t].ns) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct live_order *live = malloc(nops * sizeof(struct live_order));
+    size_t nlive = 0;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < nops; i++) {
+        unsigned pick = rng() % total_weight;
+        OP_TYPE type = (pick < weights[OP_POST]) ? OP_POST
+                     : (pick < weights[OP_POST] + weights[OP_CROSS]) ? OP_CROSS : OP_CANCEL;
+        if (type == OP_CANCEL && nlive == 0) {
+            type = OP_POST;
+        }
+
+        TRADER *trader = traders[rng() % ntraders];
+        instrument_t inst = rng() % config.instruments;
+        BOOK_SIDE side = (rng() & 1) ? BOOK_BUY : BOOK_SELL;
+        quantity_t qty = 1 + rng() % max_qty;
+        funds_t offset = 1 + rng() % depth;
+        bool ok;
+        uint64_t t0, t1;
+
+        switch (type) {
+        case OP_POST: {
+            funds_t price = (side == BOOK_BUY) ? MID_PRICE - offset : MID_PRICE + offset;
+            t0 = now_ns();
+            orderid_t id = exchange_post_order(xchg, inst, trader, side, qty, price);
+            t1 = now_ns();
+            if ((ok = (id != 0))) {
+                live[nlive++] = (struct live_order){ trader, inst, id };
+            }
+            break;
+        }
+        case OP_CROSS: {
+            funds_t price = (side == BOOK_BUY) ? MID_PRICE + offset : MID_PRICE - offset;
+            t0 = now_ns();
+            ok = exchange_post_order(xchg, inst, trader, side, qty, price) != 0;
+            t1 = now_ns();
+            break;
+        }
+        default: {
+            size_t k = rng() % nlive;
+            struct live_order lo = live[k];
+            live[k] = live[--nlive];
+            quantity_t canceled;
+            t0 = now_ns();
+            ok = exchange_cancel_order(xchg, lo.instrument, lo.trader, lo.id, &canceled) == 0;
+            t1 = now_ns();
+            break;
+        }
+        }
+
+        uint64_t ns = t1 - t0;
+        ops[type].ns[ops[type].count++] = (ns > UINT32_MAX) ? UINT32_MAX : ns;
+        if (!ok) {
+            ops[type].failed++;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    // Let the matchmakers and the publisher finish before counting packets
+    exchange_fini(xchg);
+    unsigned long packets = 0, bytes = 0, writes = 0;
+    size_t high_water = 0;
+    for (size_t i = 0; i < ntraders; i++) {
+        struct trader_stats st;
+        trader_get_stats(traders[i], &st);
+        packets += st.packets;
+        bytes += st.bytes;
+        writes += st.writes;
+        high_water = (st.high_water > high_water) ? st.high_water : high_water;
+    }
+
+    printf("%zu operations in %.3fs: %.0f ops/s, %lu packets sent to %zu traders\n",
+           nops, elapsed / 1e9, nops / (elapsed / 1e9), packets, ntraders);
+    printf("%lu writes: %.3f per packet, %.1f bytes each; largest output queue %zu bytes\n",
+           writes, packets ? (double)writes / packets : 0, writes ? (double)bytes / writes : 0, high_water);
+    printf("%-8s %10s %8s %9s %9s %9s %9s %9s\n", "op", "count", "failed",
+           "mean(us)", "p50", "p99", "p99.9", "max");
+
+    uint32_t *all = malloc(nops * sizeof(uint32_t));
+    size_t nall = 0, failed = 0;
+    for (int t = 0; t < NOPS; t++) {
+        memcpy(all + nall, ops[t].ns, ops[t].count * sizeof(uint32_t));
+        nall += ops[t].count;
+        failed += ops[t].failed;
+        report_line(op_names[t], ops[t].ns, ops[t].count, ops[t].failed);
+        free(ops[t].ns);
+    }
+    report_line("all", all, nall, failed);
+    free(all);
+    free(live);
+
+    // Orders still resting were released by exchange_fini()
+    for (size_t i = 0; i < ntraders; i++) {
+        trader_logout(traders[i]);
+    }
+    if (bench_sockets) {
+        atomic_store(&draining, false);
+        pthread_join(drainer, NULL);
+        for (size_t i = 0; i < ntraders; i++) {
+            close(client_fds[i]);
+        }
+    }
+    free(client_fds);
+    free(traders);
+    traders_fini();
+    accounts_fini();
+    return 0;
+}
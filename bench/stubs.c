@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "stubs.h"
+
+/*
+ * Stand-ins for the packet layer (protocol.c), so that the benchmark can
+ * drive the exchange without any sockets.  Traders write their packets
+ * with sendmsg(), which is replaced here: writes to descriptors from
+ * BENCH_FAKE_FD up are dropped, and the rest are passed on, so that real
+ * sockets in the same process still work.
+ */
+
+void (*bench_capture)(int fd, const BRS_PACKET_HEADER *hdr, size_t len);
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    if (fd < BENCH_FAKE_FD) {
+        return syscall(SYS_sendmsg, fd, msg, flags);
+    }
+    // A trader queues each packet whole, and here every write is taken in
+    // full, so the write starts at a packet header.  A header and its payload
+    // may be in separate iovecs, and one iovec may hold several packets.
+    BRS_PACKET_HEADER hdr;
+    size_t have = 0;                // bytes of the current header seen
+    size_t skip = 0;                // bytes of the current payload still to come
+    size_t n = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        const char *p = msg->msg_iov[i].iov_base;
+        size_t len = msg->msg_iov[i].iov_len;
+        n += len;
+        while (len > 0) {
+            if (skip > 0) {
+                size_t k = (len < skip) ? len : skip;
+                p += k;
+                len -= k;
+                skip -= k;
+                continue;
+            }
+            size_t k = sizeof(hdr) - have;
+            if (k > len) {
+                k = len;
+            }
+            memcpy((char *)&hdr + have, p, k);
+            p += k;
+            len -= k;
+            if ((have += k) == sizeof(hdr)) {
+                skip = ntohs(hdr.size);
+                have = 0;
+                if (bench_capture) {
+                    bench_capture(fd, &hdr, sizeof(hdr) + skip);
+                }
+            }
+        }
+    }
+    return n;
+}
+
+int proto_send_packet(int fd, BRS_PACKET_HEADER *hdr, void *payload) {
+    return 0;
+}
+
+int proto_recv_packet(int fd, BRS_PACKET_HEADER *hdr, void **payloadp) {
+    errno = ENOTSUP;
+    return -1;
+}
@@ -0,0 +1,26 @@
+#ifndef STUBS_H
+#define STUBS_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Stand-ins for the packet layer (see stubs.c), for driving the exchange
+ * without any sockets.
+ */
+
+/*
+ * Traders logged in with descriptors from this one up have no socket:
+ * what is written to them is dropped.  Lower descriptors are real.
+ */
+#define BENCH_FAKE_FD 0x10000
+
+/*
+ * If set, called once for each whole packet written to a trader that has no
+ * socket, from whichever thread wrote it, with the packet's header and its
+ * length including the payload.
+ */
+extern void (*bench_capture)(int fd, const BRS_PACKET_HEADER *hdr, size_t len);
+
+#endif
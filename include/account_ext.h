@@ -0,0 +1,176 @@
+#ifndef ACCOUNT_EXT_H
+#define ACCOUNT_EXT_H
+
+/*
+ * Additional account functions, beyond the interface in account.h.
+ *
+ * An account has one balance, shared by all instruments, and a separate
+ * inventory for each instrument.  The inventory functions in account.h
+ * refer to instrument 0.
+ */
+
+#include <stdint.h>
+
+#include "account.h"
+#include "protocol_ext.h"
+
+struct snapshot_writer;
+struct order;
+
+/*
+ * Get the head of the list of an account's open orders in one instrument.
+ * The list is linked through the orders themselves (see struct order) and
+ * belongs to the exchange, which must hold the instrument's lock to use it.
+ * Keeping it here lets all of an account's orders be found without a
+ * search of the book, whichever trader posted them.
+ *
+ * @param account  The account.
+ * @param instrument  The instrument, which must be less than MAX_INSTRUMENTS.
+ * @return  A pointer to the head of the list (NULL if there are no orders).
+ */
+struct order **account_open_orders(ACCOUNT *account, instrument_t instrument);
+
+/*
+ * Increase the inventory of an account in one instrument.
+ *
+ * @param account  The account whose inventory is to be increased.
+ * @param instrument  The instrument, which must be less than MAX_INSTRUMENTS.
+ * @param quantity  The amount by which the inventory is to be increased.
+ */
+void account_increase_inventory_of(ACCOUNT *account, instrument_t instrument,
+                                   quantity_t quantity);
+
+/*
+ * Attempt to decrease the inventory of an account in one instrument.
+ *
+ * @param account  The account whose inventory is to be decreased.
+ * @param instrument  The instrument, which must be less than MAX_INSTRUMENTS.
+ * @param quantity  The amount by which the inventory is to be decreased.
+ * @return 0 if the original inventory is at least as great as the
+ * amount of decrease, -1 otherwise.  In case -1 is returned, there
+ * is no change to the inventory.
+ */
+int account_decrease_inventory_of(ACCOUNT *account, instrument_t instrument,
+                                  quantity_t quantity);
+
+/*
+ * Get the current balance of an account and its inventory in one instrument,
+ * as a consistent snapshot.
+ *
+ * @param account  The account whose balance and inventory is to be queried.
+ * @param instrument  The instrument, which must be less than MAX_INSTRUMENTS.
+ * @param infop  Pointer to structure to receive the status information,
+ * with multibyte fields in network byte order.
+ */
+void account_get_status_of(ACCOUNT *account, instrument_t instrument,
+                           BRS_STATUS_INFO *infop);
+
+/*
+ * Get the number identifying an account in the journal.  Accounts are
+ * numbered from 0 in the order they were created.
+ */
+uint32_t account_get_id(ACCOUNT *account);
+
+/*
+ * Get the name of an account.
+ */
+const char *account_get_name(ACCOUNT *account);
+
+/*
+ * Find an account by the number returned by account_get_id().
+ *
+ * @return  The account, or NULL if there is no account with that number.
+ */
+ACCOUNT *account_get_by_id(uint32_t id);
+
+/*
+ * Add amounts, which may be negative, to the balance of an account and its
+ * inventory in one instrument, without any checks and without journaling.
+ * Used to replay the journal, in which a credit may be recorded after a
+ * debit that depended on it; the arithmetic wraps, so the end result is
+ * right whatever order the changes are applied in.
+ */
+void account_adjust(ACCOUNT *account, instrument_t instrument, int64_t balance, int64_t inventory);
+
+/*
+ * Set the balance and inventories of an account from a snapshot, creating
+ * the account if it does not exist.
+ *
+ * @param id  The number the account had when the snapshot was taken.
+ * @param name  The name of the account.
+ * @param balance  The balance.
+ * @param inventory  Inventories of the first ninstruments instruments.
+ * @param ninstruments  The number of inventories.
+ * @return 0 if successful, -1 if the account could not be created with that number.
+ */
+int account_restore(uint32_t id, const char *name, funds_t balance,
+                    const quantity_t *inventory, size_t ninstruments);
+
+/*
+ * Acquire (release) the lock on the account table and on every account,
+ * so that a consistent snapshot can be taken.
+ */
+void accounts_lock_all(void);
+void accounts_unlock_all(void);
+
+/*
+ * Write every account to a snapshot.  The caller must hold all the account
+ * locks, or be a child forked while they were held.
+ *
+ * @param w  The snapshot being written.
+ * @param ninstruments  The number of inventories to write for each account.
+ * @return 0 if successful, -1 otherwise.
+ */
+int accounts_write_snapshot(struct snapshot_writer *w, size_t ninstruments);
+
+/*
+ * Get the number of accounts that exist.  The caller must hold all the
+ * account locks, as for accounts_write_snapshot().
+ */
+uint32_t accounts_count(void);
+
+/*
+ * Deposit funds into an account on behalf of its trader, recording the
+ * deposit in the journal.  The balance is changed and the record appended
+ * under the account's lock, so the journal sees changes to an account in the
+ * order they were made.
+ *
+ * @param account  The account.
+ * @param amount  The amount to be deposited.
+ */
+void account_deposit(ACCOUNT *account, funds_t amount);
+
+/*
+ * Withdraw funds from an account on behalf of its trader, recording the
+ * withdrawal in the journal.
+ *
+ * @param account  The account.
+ * @param amount  The amount to be withdrawn.
+ * @return 0 if successful, -1 if the balance is insufficient (in which
+ * case nothing is changed or recorded).
+ */
+int account_withdraw(ACCOUNT *account, funds_t amount);
+
+/*
+ * Place inventory of an instrument in escrow on behalf of a trader,
+ * recording it in the journal.
+ *
+ * @param account  The account.
+ * @param instrument  The instrument, which must be less than MAX_INSTRUMENTS.
+ * @param quantity  The quantity to be placed in escrow.
+ */
+void account_escrow(ACCOUNT *account, instrument_t instrument, quantity_t quantity);
+
+/*
+ * Release inventory of an instrument from escrow on behalf of a trader,
+ * recording it in the journal.
+ *
+ * @param account  The account.
+ * @param instrument  The instrument, which must be less than MAX_INSTRUMENTS.
+ * @param quantity  The quantity to be released.
+ * @return 0 if successful, -1 if the inventory is insufficient (in which
+ * case nothing is changed or recorded).
+ */
+int account_release(ACCOUNT *account, instrument_t instrument, quantity_t quantity);
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef BOOK_H
+#define BOOK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "trader.h"
+
+/*
+ * A price-level order book.
+ *
+ * Each side of the book keeps its price levels in an array sorted so that
+ * the best price is always the last element (highest bid, lowest ask), and
+ * caches a pointer to that level.  Locating the level for a given price is
+ * a binary search, and adding or removing a level near the top of the book
+ * only moves a handful of pointers.  Orders resting at the same price are
+ * kept in a FIFO queue, oldest at the head, so matching is strictly by price
+ * and then by time of arrival, and the next order to be matched on a side
+ * is always best->head.
+ *
+ * The book does no locking of its own; the caller (the exchange) must
+ * serialize all access.
+ */
+
+typedef enum {
+    BOOK_BUY,
+    BOOK_SELL
+} BOOK_SIDE;
+
+struct price_level;
+
+/*
+ * A resting order.  The book links the order into its price level,
+ * but storage for the order itself is owned by the caller.
+ */
+struct order {
+    struct order *next;             // next (younger) order at this level
+    struct order *prev;             // previous (older) order at this level
+    struct price_level *level;      // level the order is queued on
+    struct order *owner_next;       // links in the owning account's list of
+    struct order *owner_prev;       // open orders, kept by the exchange
+    TRADER *trader;
+    funds_t price;
+    quantity_t quantity;
+    orderid_t order_id;
+    BOOK_SIDE side;
+};
+
+/*
+ * All orders resting at one price on one side of the book.
+ */
+struct price_level {
+    funds_t price;
+    uint64_t total;                 // sum of the quantities of the queued orders
+    size_t count;                   // number of queued orders
+    struct order *head;             // oldest order, first to be matched
+    struct order *tail;             // youngest order
+    struct price_level *next_spare; // link in the book's list of spare levels
+};
+
+struct book_side {
+    struct price_level **levels;    // sorted, best price last
+    struct price_level *best;       // levels[nlevels - 1], or NULL if empty
+    size_t nlevels;
+    size_t cap;
+    size_t norders;
+};
+
+/*
+ * Index from order ID to resting order.  Open addressing with linear
+ * probing; because order IDs are handed out sequentially, the slot is just
+ * the ID masked to the table size, so live orders rarely collide.
+ */
+struct order_index {
+    struct order **slots;
+    size_t mask;                    // table size - 1 (size is a power of two)
+    size_t count;
+};
+
+struct book {
+    struct book_side sides[2];
+    struct order_index index;
+    struct price_level *spare;      // emptied levels kept for reuse
+};
+
+/*
+ * Initialize an empty book.
+ *
+ * @param bk  The book to be initialized.
+ * @return 0 if initialization succeeds, -1 otherwise.
+ */
+int book_init(struct book *bk);
+
+/*
+ * Finalize a book, freeing its price levels.  Any orders still resting
+ * are not touched; the caller should remove them first.
+ *
+ * @param bk  The book to be finalized.
+ */
+void book_fini(struct book *bk);
+
+/*
+ * Queue an order at the tail of the level for its price and side,
+ * creating the level if necessary, and index it by its order ID.
+ *
+ * @param bk  The book.
+ * @param ordp  The order, whose side, price and order ID must already be set.
+ * @return 0 if the order was added, -1 if memory could not be allocated.
+ */
+int book_insert(struct book *bk, struct order *ordp);
+
+/*
+ * Unlink an order from its level and from the order ID index,
+ * removing the level if it becomes empty.
+ *
+ * @param bk  The book.
+ * @param ordp  An order currently resting in the book.
+ */
+void book_remove(struct book *bk, struct order *ordp);
+
+/*
+ * Record that the quantity of a resting order has decreased, keeping the
+ * aggregate for its level up to date.  The order keeps its queue position.
+ * An order that is not in the book just has its quantity reduced.
+ *
+ * @param ordp  The order.
+ * @param filled  The amount by which the quantity is to be reduced.
+ */
+void book_reduce(struct order *ordp, quantity_t filled);
+
+/*
+ * Change the quantity and price of a resting order.  If the price is
+ * unchanged and the quantity is not increased, the order keeps its queue
+ * position; otherwise it is queued at the tail of the level for its new price.
+ *
+ * @param bk  The book.
+ * @param ordp  An order currently resting in the book.
+ * @param quantity  The new quantity (nonzero).
+ * @param price  The new price.
+ * @return 0 if successful, -1 if memory could not be allocated for a new
+ * level, in which case the order keeps its old quantity and price but is
+ * queued at the tail of its level.
+ */
+int book_amend(struct book *bk, struct order *ordp, quantity_t quantity, funds_t price);
+
+/*
+ * Find a resting order by its order ID.  This is a hash lookup and
+ * does not depend on the size of the book.
+ *
+ * @param bk  The book.
+ * @param order_id  The ID of the order to look for.
+ * @return  The order, or NULL if no order with that ID is resting in the book.
+ */
+struct order *book_find(struct book *bk, orderid_t order_id);
+
+/*
+ * Determine how much could be bought (sold) immediately from the orders
+ * resting on one side of the book by an order with a given limit price.
+ * Only the levels that would be needed are visited.
+ *
+ * @param bk  The book.
+ * @param side  The side whose orders would be matched.
+ * @param limit  The limit price of the incoming order: its maximum price if
+ * it is a buy order (side is BOOK_SELL), its minimum price if a sell order.
+ * @param want  The quantity wanted; counting stops once it has been reached.
+ * @return  The quantity available, up to at least want if there is that much.
+ */
+uint64_t book_available(struct book *bk, BOOK_SIDE side, funds_t limit, uint64_t want);
+
+/*
+ * Get the best price level on one side of the book.
+ *
+ * @return  The best level, or NULL if that side is empty.
+ */
+static inline struct price_level *book_best_level(struct book *bk, BOOK_SIDE side) {
+    return bk->sides[side].best;
+}
+
+/*
+ * Get a price level by its rank on one side of the book.  Each level keeps
+ * the total quantity and number of its orders up to date, so reading the
+ * top N levels costs O(N) whatever the number of orders.
+ *
+ * @param i  The rank of the level, 0 being the best.
+ * @return  The level, or NULL if that side has no more than i levels.
+ */
+static inline struct price_level *book_level(struct book *bk, BOOK_SIDE side, size_t i) {
+    struct book_side *bs = &bk->sides[side];
+    return (i < bs->nlevels) ? bs->levels[bs->nlevels - 1 - i] : NULL;
+}
+
+/*
+ * Get the order with the highest priority on one side of the book.
+ *
+ * @return  The oldest order at the best price, or NULL if that side is empty.
+ */
+static inline struct order *book_best(struct book *bk, BOOK_SIDE side) {
+    struct price_level *lvl = book_best_level(bk, side);
+    return lvl ? lvl->head : NULL;
+}
+
+/*
+ * Get the number of orders resting on one side of the book.
+ */
+static inline size_t book_count(struct book *bk, BOOK_SIDE side) {
+    return bk->sides[side].norders;
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Run-time configuration of the Bourse server.
+ *
+ * The values are set from command-line options in main() before any of
+ * the modules are initialized, and are only read after that.
+ */
+struct bourse_config {
+    size_t order_pool_size;         // orders preallocated by the exchange
+    size_t order_pool_chunk;        // orders added each time the pool grows
+    size_t order_limit;             // most orders resting at once, 0 for no limit
+    bool order_pool_hugepages;      // back the order pool with huge pages
+    bool match_inline;              // match incoming orders in the posting thread
+    size_t match_batch;             // most trades the matchmaker makes per hold of the lock
+    size_t md_ring_size;            // market-data events queued per instrument (a power of two)
+    const char *journal_dir;        // directory for the journal, NULL to disable it
+    size_t journal_segment_size;    // bytes preallocated for each journal file
+    unsigned long journal_interval_us;  // longest time a record waits to be synced
+    size_t journal_batch;           // records that trigger a sync before the interval is up
+    unsigned snapshot_interval;     // seconds between snapshots, 0 for only at shutdown
+    bool cancel_on_disconnect;      // cancel a trader's open orders when it disconnects
+    size_t out_queue_size;          // most bytes queued for a client before it is cut off
+    size_t conflate_backlog;        // queued bytes that switch a client to conflated market data, 0 never
+    size_t conflate_levels;         // levels per side in the books sent to a conflated client
+    size_t max_traders;             // most traders logged in at once
+    const char *md_group;           // multicast group for market data, NULL to send it over TCP
+    unsigned md_port;               // port of the multicast group
+    const char *md_interface;       // address of the interface to send from, NULL for the default
+    size_t md_history;              // datagrams kept for resending (a power of two)
+    size_t instruments;             // number of instruments traded (pool sizes are per instrument)
+};
+
+extern struct bourse_config config;
+
+#endif
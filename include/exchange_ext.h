@@ -0,0 +1,240 @@
+#ifndef EXCHANGE_EXT_H
+#define EXCHANGE_EXT_H
+
+/*
+ * Additional exchange functions, beyond the interface in exchange.h.
+ *
+ * An exchange trades a fixed number of instruments (config.instruments),
+ * each with its own order book and matchmaker thread.  The functions in
+ * exchange.h refer to instrument 0.  Order IDs are unique across all
+ * instruments.
+ */
+
+#include "exchange.h"
+#include "protocol_ext.h"
+#include "order_pool.h"
+#include "book.h"
+
+struct snapshot_writer;
+
+/*
+ * Get the number of instruments traded by an exchange.
+ */
+size_t exchange_instruments(EXCHANGE *xchg);
+
+/*
+ * Get the current status of one instrument of the exchange, as
+ * exchange_get_status() does for instrument 0.
+ *
+ * @param xchg  The exchange.
+ * @param instrument  The instrument to be queried.
+ * @param account  Account for which balance and inventory are to be
+ * reported, or NULL for none.
+ * @param infop  Pointer to structure to receive the status information,
+ * with multibyte fields in network byte order.
+ * @return 0 if successful, -1 if the exchange does not trade the instrument.
+ */
+int exchange_get_instrument_status(EXCHANGE *xchg, instrument_t instrument, ACCOUNT *account,
+                                   BRS_STATUS_INFO *infop);
+
+/*
+ * Get the best price levels of each side of an instrument's book, with
+ * the total quantity and number of orders at each.  The time taken depends
+ * on the number of levels returned, not on the number of orders.
+ *
+ * @param xchg  The exchange.
+ * @param instrument  The instrument to be queried.
+ * @param levels  The most levels to be returned for each side.
+ * @param infop  Pointer to a structure to receive the levels, with room for
+ * 2 * levels entries, filled in with multibyte fields in network byte order.
+ * @return  The size of the information filled in, in bytes, or 0 if the
+ * exchange does not trade the instrument.
+ */
+size_t exchange_get_depth(EXCHANGE *xchg, instrument_t instrument, size_t levels, BRS_DEPTH_INFO *infop);
+
+/*
+ * Post an order for one instrument, as exchange_post_buy() and
+ * exchange_post_sell() do for instrument 0.
+ *
+ * @param xchg  The exchange.
+ * @param instrument  The instrument to be traded.
+ * @param trader  The trader posting the order.
+ * @param side  BOOK_BUY or BOOK_SELL.
+ * @param quantity  The quantity to be bought or sold.
+ * @param price  The maximum price of a buy order, or the minimum price of a sell order.
+ * @return  The order ID assigned to the new order, if successfully posted,
+ * otherwise 0.
+ */
+orderid_t exchange_post_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader,
+                              BOOK_SIDE side, quantity_t quantity, funds_t price);
+
+/*
+ * Match an order against the book as soon as it arrives, without it ever
+ * resting there.  Whatever is not filled is returned to the trader before
+ * this function returns.  Neither a POSTED nor a CANCELED event is
+ * published for the order; its fills are published as usual.  The trader
+ * must be able to cover the whole order, even a fill-or-kill order that is
+ * then killed; a killed order is accepted, with nothing filled, and its
+ * order ID is used up like any other.
+ *
+ * @param xchg  The exchange.
+ * @param instrument  The instrument to be traded.
+ * @param trader  The trader placing the order.
+ * @param side  BOOK_BUY or BOOK_SELL.
+ * @param quantity  The quantity to be bought or sold.
+ * @param price  The maximum price of a buy order, or the minimum price of a sell order.
+ * @param flags  BRS_ORDER_IOC to fill as much as possible, or BRS_ORDER_FOK
+ * to fill either the whole quantity or nothing.
+ * @param remaining  Pointer to a variable to receive the quantity that was
+ * not filled.
+ * @return  The order ID assigned to the order, by which its fills are
+ * reported, if it was accepted, otherwise 0 (as when the trader cannot
+ * cover it).
+ */
+orderid_t exchange_take_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader, BOOK_SIDE side,
+                              quantity_t quantity, funds_t price, int flags, quantity_t *remaining);
+
+/*
+ * Attempt to cancel a pending order for one instrument, as exchange_cancel()
+ * does for instrument 0.
+ *
+ * @param xchg  The exchange.
+ * @param instrument  The instrument the order was posted for.
+ * @param trader  The trader attempting to cancel the order.
+ * @param order  The ID of the order to be canceled.
+ * @param quantity  Pointer to a variable to receive the quantity of the
+ * order that was canceled.
+ * @return 0 if the order was successfully canceled, -1 otherwise.
+ */
+int exchange_cancel_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader,
+                          orderid_t order, quantity_t *quantity);
+
+/*
+ * Cancel all of the pending orders of a trader's account for one
+ * instrument, as exchange_cancel_order() would one by one.  The time taken
+ * depends on the number of orders canceled, not on the size of the book.
+ *
+ * @param xchg  The exchange.
+ * @param instrument  The instrument.
+ * @param trader  The trader whose account's orders are to be canceled.
+ * @param count  Pointer to a variable to receive the number of orders canceled.
+ * @return 0 if successful, -1 if the exchange does not trade the instrument.
+ */
+int exchange_cancel_all(EXCHANGE *xchg, instrument_t instrument, TRADER *trader, size_t *count);
+
+/*
+ * Change the quantity and price of a pending order in one step, keeping
+ * its order ID.  Only the difference in funds or inventory is encumbered
+ * or released.  The order keeps its queue position if only its quantity is
+ * reduced; otherwise it is queued behind the orders already at its new price,
+ * and it is matched straight away if that price crosses the book.
+ *
+ * @param xchg  The exchange.
+ * @param instrument  The instrument the order was posted for.
+ * @param trader  The trader attempting to amend the order.
+ * @param order  The ID of the order to be amended.
+ * @param quantity  The new quantity, which must be nonzero.
+ * @param price  The new price.
+ * @param remaining  Pointer to a variable to receive the quantity still
+ * resting once any matching at the new price is done, which is 0 if the
+ * order was filled.
+ * @return 0 if the order was amended, -1 if there is no such order of the
+ * trader's, or the trader cannot cover the increase.
+ */
+int exchange_amend_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader,
+                         orderid_t order, quantity_t quantity, funds_t price,
+                         quantity_t *remaining);
+
+/*
+ * Get the occupancy of the pool from which an instrument allocates orders.
+ *
+ * @param xchg  The exchange.
+ * @param instrument  The instrument.
+ * @param stats  Pointer to a structure to receive the statistics.
+ * @return 0 if successful, -1 if the exchange does not trade the instrument.
+ */
+int exchange_get_pool_stats(EXCHANGE *xchg, instrument_t instrument, struct order_pool_stats *stats);
+
+/*
+ * Acquire (release) the lock on every instrument, so that a consistent
+ * snapshot can be taken.  Instrument locks must be acquired before account locks.
+ */
+void exchange_lock_all(EXCHANGE *xchg);
+void exchange_unlock_all(EXCHANGE *xchg);
+
+/*
+ * Get the ID that will be given to the next order posted.
+ */
+orderid_t exchange_next_order_id(EXCHANGE *xchg);
+
+/*
+ * Write, for each instrument, the last trade price and the resting orders
+ * in priority order to a snapshot.  The caller must hold all the instrument
+ * locks, or be a child forked while they were held.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int exchange_write_snapshot(EXCHANGE *xchg, struct snapshot_writer *w);
+
+/*
+ * Functions used to rebuild the state of the exchange from a snapshot and
+ * the journal.  They change the books only: no matching is done, no
+ * notifications are sent, and accounts are left for the caller to adjust.
+ */
+
+/*
+ * Queue an order at the back of its price level.
+ *
+ * @param trader  The trader that is to own the order.  A reference is taken.
+ * @return 0 if successful, -1 otherwise.
+ */
+int exchange_restore_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader,
+                           BOOK_SIDE side, orderid_t order, quantity_t quantity, funds_t price);
+
+/*
+ * Remove a canceled order.
+ *
+ * @param quantity  Pointer to a variable to receive the quantity the order
+ * had left.
+ * @return 0 if successful, -1 if there is no such order.
+ */
+int exchange_restore_cancel(EXCHANGE *xchg, instrument_t instrument, orderid_t order,
+                            quantity_t *quantity);
+
+/*
+ * Change the quantity and price of an order, as exchange_amend_order() does.
+ *
+ * @param side  Pointer to a variable to receive the side of the order.
+ * @param old_quantity  Pointer to a variable to receive its previous quantity.
+ * @param old_price  Pointer to a variable to receive its previous price.
+ * @return 0 if successful, -1 if there is no such order.
+ */
+int exchange_restore_amend(EXCHANGE *xchg, instrument_t instrument, orderid_t order,
+                           quantity_t quantity, funds_t price,
+                           quantity_t *old_quantity, funds_t *old_price);
+
+/*
+ * Apply a trade between two resting orders: reduce them, remove those that
+ * are completed, and set the last trade price.
+ *
+ * @param buy_price  Pointer to a variable to receive the price of the buy
+ * order, from which the buyer's refund is calculated.
+ * @return 0 if successful, -1 if either order does not exist.
+ */
+int exchange_restore_trade(EXCHANGE *xchg, instrument_t instrument, orderid_t buy, orderid_t sell,
+                           quantity_t quantity, funds_t price, funds_t *buy_price);
+
+/*
+ * Set the last trade price of an instrument.
+ */
+void exchange_restore_last_trade(EXCHANGE *xchg, instrument_t instrument, funds_t price);
+
+/*
+ * Finish restoring: make sure new order IDs follow those already used, and
+ * let the matchmakers deal with any books left crossed.
+ *
+ * @param next_order_id  The lowest order ID that may be given to a new order.
+ */
+void exchange_restore_done(EXCHANGE *xchg, orderid_t next_order_id);
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Write-ahead journal of every change to the state of the exchange.
+ *
+ * Each change is appended as a binary record carrying a sequence number
+ * that increases by one from record to record.  The journal is a series of
+ * segment files (journal-NNNNNN.log in the configured directory), each
+ * preallocated to a fixed size and mapped into memory, so appending a record
+ * is a copy into the mapping under a short lock and never a system call.
+ *
+ * A flusher thread makes the records durable in groups: it syncs whatever
+ * has been appended when a configured number of records is pending or a
+ * configured interval has passed, whichever comes first.  A record is
+ * therefore durable at most one interval after it was appended.  It also
+ * creates each segment before it is needed: an append that finds the
+ * current segment full waits briefly for the next one rather than creating
+ * it under the caller's locks, and only creates it itself if it is not
+ * ready in time.
+ *
+ * If no directory has been configured, the journal is disabled and
+ * journal_append() does nothing.
+ */
+
+#define JOURNAL_MAGIC "BRSJRNL2"
+
+/*
+ * Types of journal records.
+ */
+typedef enum {
+    JOURNAL_NONE,                   // marks the unused tail of a segment
+    JOURNAL_ACCOUNT,                // account created; name follows the record
+    JOURNAL_DEPOSIT, JOURNAL_WITHDRAW,
+    JOURNAL_ESCROW, JOURNAL_RELEASE,
+    JOURNAL_POST, JOURNAL_CANCEL, JOURNAL_TRADE,
+    JOURNAL_AMEND
+} JOURNAL_TYPE;
+
+/*
+ * A journal record.  Fields are in host byte order.  The size, sequence
+ * number and CRC are set for every record; the other fields used depend on
+ * the type:
+ *
+ *   ACCOUNT:   account, and the account name (size - sizeof(record) bytes,
+ *              NUL-padded)
+ *   DEPOSIT, WITHDRAW:  account, amount (in price)
+ *   ESCROW, RELEASE:    account, instrument, quantity
+ *   POST:      account, instrument, side, order, quantity, price, and
+ *              flags (BRS_ORDER_IOC or BRS_ORDER_FOK if the order was only
+ *              to be matched immediately and never rest in the book)
+ *   CANCEL:    account, instrument, side, order, quantity (that was
+ *              canceled), price (of the order, to work out the refund)
+ *   TRADE:     account (buyer), account2 (seller), instrument,
+ *              order (buy order), order2 (sell order), quantity, price
+ *   AMEND:     account, instrument, side, order, quantity, price (new values)
+ */
+struct journal_record {
+    uint32_t size;                  // size of the record, a multiple of 8
+    uint8_t type;
+    uint8_t side;                   // BOOK_SIDE, for POST, CANCEL and AMEND
+    uint16_t instrument;
+    uint64_t seq;                   // assigned by journal_append()
+    uint32_t account;
+    union {
+        uint32_t account2;
+        uint32_t flags;
+    };
+    orderid_t order;
+    orderid_t order2;
+    quantity_t quantity;
+    funds_t price;
+    uint32_t crc;                   // CRC-32C of all size bytes, taken with this field zero
+    uint32_t reserved;
+};
+
+/*
+ * Header at the start of each segment file.  Records follow it.
+ */
+struct journal_segment_header {
+    char magic[8];                  // JOURNAL_MAGIC
+    uint64_t segment;               // number of the segment, from 1
+    uint64_t first_seq;             // sequence number of the first record
+    uint64_t size;                  // size of the file
+    uint8_t reserved[32];
+};
+
+/*
+ * Counters describing the work done by the journal since it was initialized.
+ */
+struct journal_stats {
+    uint64_t records;               // records appended
+    uint64_t bytes;                 // bytes appended
+    uint64_t syncs;                 // group commits carried out
+    uint64_t sync_ns;               // total time spent syncing
+    uint64_t max_group;             // most records made durable by one sync
+    uint64_t segments;              // segment files created
+    uint64_t last_seq;              // sequence number of the last record appended
+    uint64_t durable_seq;           // every record up to this one is on disk
+    uint64_t elapsed_ns;            // time since the journal was initialized
+};
+
+/*
+ * Initialize the journal, creating the first segment in config.journal_dir.
+ * Does nothing if no directory has been configured.
+ *
+ * @param first_seq  Sequence number to give the first record appended.
+ * @return 0 if successful, -1 if the journal could not be set up.
+ */
+int journal_init(uint64_t first_seq);
+
+/*
+ * Finalize the journal: stop the flusher, sync everything that has been
+ * appended and close the segment files.
+ */
+void journal_fini(void);
+
+/*
+ * Determine whether the journal is enabled.
+ */
+int journal_enabled(void);
+
+/*
+ * Append a record to the journal.  The sequence number is assigned here.
+ * Callers append while holding the lock that serializes the change being
+ * recorded, so that records of dependent changes appear in the order the
+ * changes were made.
+ *
+ * A record of a size that fits in a segment is always written: if no new
+ * segment can be created when one is needed, the process is stopped rather
+ * than let the change go unrecorded.
+ *
+ * @param rec  The record, whose size and type must be set.  If size is
+ * larger than sizeof(struct journal_record), the extra bytes follow rec.
+ * @return  The sequence number of the record, or 0 if the journal is disabled
+ * or the record is too large for a segment.
+ */
+uint64_t journal_append(struct journal_record *rec);
+
+/*
+ * Function called for each record by journal_replay().
+ *
+ * @return 0 to continue, -1 to abandon the replay.
+ */
+typedef int (*journal_replay_fn)(const struct journal_record *rec, void *arg);
+
+/*
+ * Read the segments in the journal directory in order and pass every record
+ * with a sequence number greater than `after` to a function.  Reading stops
+ * at the first unused or incomplete record, or the first whose CRC does not
+ * match its contents.  Used on startup, before journal_init().
+ *
+ * @param after  Sequence number of the last record already reflected in the state.
+ * @param fn  The function to be called for each record.
+ * @param arg  Argument to be passed to the function.
+ * @param last  Pointer to a variable to receive the sequence number of the
+ * last record found (or `after`, if there is none).
+ * @return 0 if successful, -1 if the journal could not be read, records
+ * following `after` are missing, or fn abandoned the replay.
+ */
+int journal_replay(uint64_t after, journal_replay_fn fn, void *arg, uint64_t *last);
+
+/*
+ * Delete the segment files whose records all have sequence numbers no
+ * greater than a given one, because a snapshot now reflects them.
+ *
+ * @param seq  Sequence number of the last record reflected in the snapshot.
+ */
+void journal_prune(uint64_t seq);
+
+/*
+ * Get the journal's counters.
+ *
+ * @param stats  Pointer to a structure to receive the counters.
+ */
+void journal_get_stats(struct journal_stats *stats);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef MD_FEED_H
+#define MD_FEED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "trader.h"
+
+/*
+ * Market data published as UDP multicast datagrams.
+ *
+ * When a multicast group has been configured, the publisher thread sends
+ * each POSTED, CANCELED, AMENDED and TRADED notification to the group once,
+ * instead of to every trader's connection.  Each datagram carries a sequence
+ * number (see BRS_MD_HEADER in protocol_ext.h), and the last
+ * config.md_history datagrams are kept, so that a client that has missed
+ * some can ask for them again over its connection.
+ *
+ * If no group has been configured, the feed is disabled and market data is
+ * broadcast over the traders' connections as before.
+ */
+
+/*
+ * Initialize the feed: open the socket that sends to the configured group,
+ * through the configured interface.  Does nothing if no group has been
+ * configured.
+ *
+ * @return 0 if successful, -1 if the feed could not be set up.
+ */
+int md_feed_init(void);
+
+/*
+ * Finalize the feed, closing its socket.
+ */
+void md_feed_fini(void);
+
+/*
+ * Determine whether the feed is enabled.
+ */
+bool md_feed_enabled(void);
+
+/*
+ * Publish a notification: give it the next sequence number, keep it for
+ * resending, and send it to the group.  A datagram the socket could not
+ * take is still kept, so that clients can ask for it again.
+ *
+ * @param hdr  The packet header, with multibyte fields in network byte order.
+ * @param payload  The payload, of the size given in the header.
+ * @return  The sequence number given to the datagram, or 0 if the packet is
+ * too large to be published.
+ */
+uint64_t md_feed_publish(BRS_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Send datagrams that are still kept to a trader again, each as the payload
+ * of a RESENT notification, in order.
+ *
+ * @param trader  The trader that asked for them.
+ * @param req  The request, with multibyte fields in network byte order.
+ * @return  The number of datagrams sent, or -1 if the request is invalid or
+ * the first datagram asked for is not kept.
+ */
+int md_feed_resend(TRADER *trader, BRS_RESEND_REQUEST *req);
+
+#endif
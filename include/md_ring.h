@@ -0,0 +1,135 @@
+#ifndef MD_RING_H
+#define MD_RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "trader.h"
+
+/*
+ * Single-producer, single-consumer ring of market-data events.
+ *
+ * The exchange pushes an event for every order posted or canceled and every
+ * trade made, and a publisher thread pops them and sends the notifications.
+ * Neither side takes a lock: the producer publishes a slot by advancing
+ * `head` and the consumer frees it by advancing `tail`.  Several threads may
+ * act as the producer, provided that something else (the instrument mutex)
+ * ensures only one of them does so at a time.
+ *
+ * Slots are filled in place: md_ring_reserve() returns the next free slot
+ * and md_ring_commit() makes it visible to the consumer.
+ */
+
+#define MD_RING_ALIGN 64
+
+/*
+ * One market-data event.  `type` is BRS_POSTED_PKT, BRS_CANCELED_PKT or
+ * BRS_TRADED_PKT; a TRADED event also produces the BOUGHT and SOLD
+ * notifications, and holds a reference on the buyer and the seller.
+ */
+struct md_event {
+    TRADER *buyer;                  // TRADED only
+    TRADER *seller;                 // TRADED only
+    orderid_t buy_id;               // 0 for a sell order
+    orderid_t sell_id;              // 0 for a buy order
+    quantity_t quantity;
+    funds_t price;
+    uint8_t type;
+};
+
+struct md_ring {
+    struct md_event *slots;
+    size_t mask;                    // number of slots - 1 (a power of two)
+    _Atomic size_t head __attribute__((aligned(MD_RING_ALIGN)));  // next slot to fill
+    _Atomic size_t tail __attribute__((aligned(MD_RING_ALIGN)));  // next slot to drain
+};
+
+/*
+ * Trades of one instrument summed up for a conflated trader.
+ */
+struct md_trades {
+    uint32_t count;
+    uint64_t quantity;
+    funds_t first, high, low, last;
+};
+
+/*
+ * What a trader whose client has fallen behind has missed of the market
+ * data.  While `active`, the trader is sent no POSTED, CANCELED, AMENDED or
+ * TRADED notifications; the books they changed are noted, and the trades
+ * summed up, until the client has caught up and can be sent the result.
+ * Each trader has one of these, and only the publisher thread touches it.
+ */
+struct md_conflation {
+    bool active;
+    uint64_t changed;               // instruments whose book changed (one bit each)
+    uint64_t traded;                // instruments with trades in `trades`
+    struct md_trades trades[MAX_INSTRUMENTS];
+    size_t resume[MAX_INSTRUMENTS]; // ring position of the first event not in the last book sent
+};
+
+_Static_assert(MAX_INSTRUMENTS <= 64, "md_conflation keeps one bit per instrument");
+
+/*
+ * Initialize an empty ring.
+ *
+ * @param ring  The ring to be initialized.
+ * @param size  The number of slots, which must be a power of two.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int md_ring_init(struct md_ring *ring, size_t size);
+
+/*
+ * Free the slots of a ring.  Any events still in it are discarded.
+ */
+void md_ring_fini(struct md_ring *ring);
+
+/*
+ * Get the next free slot, for the producer to fill in.
+ *
+ * @return  The slot, or NULL if the ring is full.
+ */
+static inline struct md_event *md_ring_reserve(struct md_ring *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail > ring->mask) {
+        return NULL;
+    }
+    return &ring->slots[head & ring->mask];
+}
+
+/*
+ * Hand the slot returned by md_ring_reserve() over to the consumer.
+ */
+static inline void md_ring_commit(struct md_ring *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Get the oldest event in the ring, for the consumer to process.
+ *
+ * @return  The event, or NULL if the ring is empty.
+ */
+static inline struct md_event *md_ring_peek(struct md_ring *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) {
+        return NULL;
+    }
+    return &ring->slots[tail & ring->mask];
+}
+
+/*
+ * Release the event returned by md_ring_peek(), so that its slot can be reused.
+ */
+static inline void md_ring_consume(struct md_ring *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef ORDER_POOL_H
+#define ORDER_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "book.h"
+
+/*
+ * A pool of order structures, allocated in chunks.
+ *
+ * Storage is obtained a chunk at a time and carved into cache-line-aligned
+ * slots.  Free slots are chained through the order's own `next` field, so
+ * taking and returning an order is a couple of pointer moves and never
+ * calls into the heap allocator.  Chunks are only released when the pool
+ * is finalized, so an order never moves once it has been handed out.
+ *
+ * Like the book, the pool does no locking; it is protected by the
+ * exchange mutex.  Allocating a new chunk is split into two steps so that
+ * the expensive part (order_pool_chunk_alloc) can be done without holding
+ * that mutex, and only the constant-time order_pool_add_chunk needs it.
+ */
+
+#define ORDER_POOL_ALIGN 64         // cache line size
+
+struct order_pool_chunk;
+
+struct order_pool {
+    struct order *free_list;        // chained through order->next
+    struct order_pool_chunk *chunks;
+    size_t nchunks;
+    size_t chunk_size;              // slots per chunk after the first
+    bool hugepages;                 // try to map chunks with huge pages
+    size_t limit;                   // soft limit on slots in use, 0 for none
+    size_t capacity;                // total number of slots
+    size_t in_use;                  // slots currently handed out
+    size_t high_water;              // most slots ever handed out at once
+};
+
+/*
+ * Occupancy of an order pool at some point in time.
+ */
+struct order_pool_stats {
+    size_t capacity;
+    size_t in_use;
+    size_t high_water;
+    size_t limit;
+    size_t nchunks;
+};
+
+/*
+ * Initialize an order pool.
+ *
+ * @param pool  The pool to be initialized.
+ * @param initial  The number of orders to preallocate.
+ * @param chunk_size  The number of orders to add each time the pool grows.
+ * @param limit  The most orders that may be in use at once, or 0 for no limit.
+ * @param hugepages  Whether to try to back the pool with huge pages.
+ * If no huge pages are available, ordinary pages are used instead.
+ * @return 0 if initialization succeeds, -1 otherwise.
+ */
+int order_pool_init(struct order_pool *pool, size_t initial, size_t chunk_size,
+                    size_t limit, bool hugepages);
+
+/*
+ * Finalize an order pool, releasing all of its chunks.  Any orders still
+ * handed out become invalid.
+ *
+ * @param pool  The pool to be finalized.
+ */
+void order_pool_fini(struct order_pool *pool);
+
+/*
+ * Allocate and format a new chunk for a pool.  This does not modify the
+ * pool, and may be called without holding the lock that protects it.
+ *
+ * @param pool  The pool the chunk is intended for.
+ * @return  The new chunk, or NULL if it could not be allocated.
+ */
+struct order_pool_chunk *order_pool_chunk_alloc(struct order_pool *pool);
+
+/*
+ * Add a chunk obtained from order_pool_chunk_alloc() to a pool,
+ * making its slots available.  This takes constant time.
+ *
+ * @param pool  The pool.
+ * @param chunk  The chunk, which is owned by the pool from now on.
+ */
+void order_pool_add_chunk(struct order_pool *pool, struct order_pool_chunk *chunk);
+
+/*
+ * Take an order from the pool.
+ *
+ * @param pool  The pool.
+ * @return  An uninitialized order, or NULL if there is no free slot or
+ * the soft limit has been reached.
+ */
+static inline struct order *order_pool_get(struct order_pool *pool) {
+    struct order *ordp = pool->free_list;
+    if (!ordp || (pool->limit && pool->in_use >= pool->limit)) {
+        return NULL;
+    }
+    pool->free_list = ordp->next;
+    if (++pool->in_use > pool->high_water) {
+        pool->high_water = pool->in_use;
+    }
+    return ordp;
+}
+
+/*
+ * Return an order to the pool.
+ *
+ * @param pool  The pool the order was taken from.
+ * @param ordp  The order, which must not be referenced again.
+ */
+static inline void order_pool_put(struct order_pool *pool, struct order *ordp) {
+    ordp->next = pool->free_list;
+    pool->free_list = ordp;
+    pool->in_use--;
+}
+
+/*
+ * Determine whether the pool could usefully grow: it is running low on
+ * free slots (less than 1/8 of a chunk left) and is still under its limit.
+ */
+static inline bool order_pool_wants_chunk(struct order_pool *pool) {
+    return (pool->capacity - pool->in_use < pool->chunk_size / 8 + 1)
+        && (!pool->limit || pool->capacity < pool->limit);
+}
+
+/*
+ * Get the current occupancy of an order pool.
+ *
+ * @param pool  The pool.
+ * @param stats  Pointer to a structure to receive the statistics.
+ */
+void order_pool_get_stats(struct order_pool *pool, struct order_pool_stats *stats);
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include "protocol.h"
+
+/*
+ * Extensions to the "Bourse" protocol.
+ *
+ * The packets in protocol.h all refer to a single, implicit instrument.
+ * The exchange can trade several instruments, identified by small integers.
+ * Instrument 0 is the one the original packets refer to, so existing
+ * clients keep working unchanged.  The packets below name the instrument
+ * explicitly.  Their types are numbered from 32, to stay clear of the
+ * original packet types.
+ *
+ * Client-to-server requests:
+ *   STATUS_INST:   Request balance/inventory and bid/ask/last for an instrument
+ *                  Payload: instrument
+ *   ESCROW_INST:   Increase inventory of an instrument in escrow
+ *                  Payload: instrument, quantity
+ *   RELEASE_INST:  Release inventory of an instrument from escrow
+ *                  Payload: instrument, quantity
+ *   BUY_INST:      Post a buy order for an instrument
+ *                  Payload: instrument, flags, quantity, max price
+ *   SELL_INST:     Post a sell order for an instrument
+ *                  Payload: instrument, flags, quantity, min price
+ *   CANCEL_INST:   Attempt to cancel a pending order for an instrument
+ *                  Payload: instrument, order id
+ *   AMEND_INST:    Change the quantity and price of a pending order
+ *                  Payload: instrument, order id, new quantity, new price
+ *   CANCEL_ALL_INST:  Cancel all of the trader's pending orders for an
+ *                  instrument, or for every instrument
+ *                  Payload: instrument, or BRS_ALL_INSTRUMENTS
+ *   DEPTH_INST:    Request the best price levels of each side of the book
+ *                  Payload: instrument, number of levels
+ *   RESEND:        Request market-data datagrams again (see below)
+ *                  Payload: first sequence number, number of datagrams
+ *
+ * These are answered with ACK or NACK exactly as their counterparts are;
+ * the inventory in the ACK is that of the named instrument.
+ *
+ * A BUY_INST or SELL_INST order with the IOC or FOK flag never rests in the
+ * book: it is matched against the orders already there as soon as it
+ * arrives, and whatever cannot be matched is returned to the trader at once.
+ * No POSTED or CANCELED notification is sent for it, only the BOUGHT, SOLD
+ * and TRADED notifications of its fills.  The quantity in the ACK is the
+ * part of the order that was not filled.
+ *
+ * AMEND_INST replaces an order in place: it keeps its order ID, and the
+ * funds or inventory encumbered for it are adjusted by the difference.  If
+ * only its quantity is reduced, the order keeps its place in the queue at
+ * its price; otherwise it goes to the back of the queue at its new price.
+ * The ACK carries the order ID and the new quantity.
+ *
+ * CANCEL_ALL_INST cancels every order pending for the trader's account,
+ * including any posted before a restart, with a CANCELED notification for
+ * each.  The quantity in the ACK is the number of orders canceled, and the
+ * inventory is that of the named instrument (instrument 0 for all).
+ *
+ * DEPTH_INST is answered with an ACK whose payload is a BRS_DEPTH_INFO
+ * rather than a BRS_STATUS_INFO: up to the requested number of levels
+ * (at most BRS_DEPTH_MAX_LEVELS) of bids, best first, then of asks, best
+ * first, each with its price, total quantity and number of orders.
+ *
+ * Server-to-client notifications:
+ *   BOUGHT_INST, SOLD_INST, POSTED_INST, CANCELED_INST, TRADED_INST
+ *                  As BOUGHT, SOLD, POSTED, CANCELED and TRADED, with the
+ *                  instrument added.  These are sent for every instrument
+ *                  other than 0, for which the original notifications are sent.
+ *   AMENDED_INST:  Broadcast when an order has been amended, for every
+ *                  instrument including 0.  The buyer or seller order ID
+ *                  (according to the side of the order), the new quantity
+ *                  and the new price are given.
+ *   BOOK_INST:     Sent to a conflated client (see below) in place of the
+ *                  POSTED, CANCELED and AMENDED notifications it missed.
+ *                  Payload: a BRS_DEPTH_INFO, as in the ACK to DEPTH_INST
+ *   TRADES_INST:   Sent to a conflated client in place of the TRADED
+ *                  notifications it missed.
+ *                  Payload: instrument, number of trades, total quantity,
+ *                  and first, highest, lowest and last price
+ *   RESENT:        A market-data datagram sent again in answer to RESEND.
+ *                  Payload: the datagram, sequence number and packet
+ *
+ * A server may be run with a limit on the backlog of each client: the bytes
+ * waiting to be sent to it because it has not read what was sent before.  A client that exceeds the limit is
+ * switched to conflated market data.  It is no longer sent the POSTED,
+ * CANCELED, AMENDED and TRADED notifications (or their per-instrument
+ * variants); the server only notes which books changed and sums up the
+ * trades.  Replies and the BOUGHT and SOLD notifications are still sent in
+ * full.  Once the backlog has fallen to a quarter of the limit, the client
+ * is sent a TRADES_INST for each instrument traded in the meantime, then a
+ * BOOK_INST with the best levels of each book that changed, after which it
+ * gets full detail again.  A BOOK_INST may already reflect notifications
+ * that would have followed it: those are not sent, and the trades among
+ * them are counted in the TRADES_INST sent before it.
+ *
+ * A server may instead publish market data as UDP multicast datagrams to a
+ * configured group.  The POSTED, CANCELED, AMENDED and TRADED notifications
+ * (and their per-instrument variants) are then sent once, to the group, and
+ * no longer over any client's connection, which carries only replies and
+ * the BOUGHT and SOLD notifications meant for that client.  Each datagram
+ * holds one notification: a BRS_MD_HEADER with a sequence number, which
+ * starts at 1 and goes up by one from datagram to datagram, followed by the
+ * packet exactly as it would have been sent over a connection.
+ *
+ * A client that finds a gap in the sequence numbers asks for the datagrams
+ * it missed with RESEND.  The server sends each of them that it still holds,
+ * in order, as the payload of a RESENT notification, up to BRS_RESEND_MAX of
+ * them, and then an ACK with no payload.  If it no longer holds the first
+ * one asked for, or has not sent it yet, it sends a NACK and nothing else;
+ * the client must then start again from the books, with DEPTH_INST.
+ */
+
+/*
+ * The most instruments an exchange can be configured to trade.
+ */
+#define MAX_INSTRUMENTS 64
+
+typedef uint16_t instrument_t;
+
+/*
+ * Instrument named in CANCEL_ALL_INST to cancel orders for every instrument.
+ */
+#define BRS_ALL_INSTRUMENTS 0xffff
+
+/*
+ * Most price levels per side returned for DEPTH_INST.
+ */
+#define BRS_DEPTH_MAX_LEVELS 256
+
+/*
+ * Most datagrams sent again in answer to one RESEND.
+ */
+#define BRS_RESEND_MAX 1024
+
+/*
+ * Flags of BUY_INST and SELL_INST orders.  An order with neither rests in
+ * the book until it has been filled or canceled.
+ */
+#define BRS_ORDER_IOC 0x1               // Immediate-or-cancel: fill what can be filled now
+#define BRS_ORDER_FOK 0x2               // Fill-or-kill: fill all of it now, or none of it
+
+/*
+ * Extended packet types.
+ */
+typedef enum {
+    /* Client-to-server */
+    BRS_STATUS_INST_PKT = 32,
+    BRS_ESCROW_INST_PKT, BRS_RELEASE_INST_PKT,
+    BRS_BUY_INST_PKT, BRS_SELL_INST_PKT, BRS_CANCEL_INST_PKT,
+    BRS_AMEND_INST_PKT, BRS_CANCEL_ALL_INST_PKT, BRS_DEPTH_INST_PKT,
+    BRS_RESEND_PKT,
+    /* Server-to-client notifications (asynchronous), same order as the originals */
+    BRS_BOUGHT_INST_PKT = 48, BRS_SOLD_INST_PKT,
+    BRS_POSTED_INST_PKT, BRS_CANCELED_INST_PKT, BRS_TRADED_INST_PKT,
+    BRS_AMENDED_INST_PKT, BRS_BOOK_INST_PKT, BRS_TRADES_INST_PKT,
+    BRS_RESENT_PKT
+} BRS_EXT_PACKET_TYPE;
+
+/*
+ * Map one of the original notification types to its per-instrument variant.
+ */
+#define BRS_INST_NOTIFY_TYPE(type) ((type) - BRS_BOUGHT_PKT + BRS_BOUGHT_INST_PKT)
+
+/*
+ * Payload structures.  As with the original packets, all multibyte fields
+ * are in network byte order.
+ */
+typedef struct brs_instrument_info {    // For STATUS_INST, CANCEL_ALL_INST
+    instrument_t instrument;
+    uint16_t reserved;                  // Must be zero
+} BRS_INSTRUMENT_INFO;
+
+typedef struct brs_inst_escrow_info {   // For ESCROW_INST, RELEASE_INST
+    instrument_t instrument;
+    uint16_t reserved;                  // Must be zero
+    quantity_t quantity;                // Quantity to escrow/release
+} BRS_INST_ESCROW_INFO;
+
+typedef struct brs_inst_order_info {    // For BUY_INST, SELL_INST
+    instrument_t instrument;
+    uint16_t flags;                     // BRS_ORDER_* flags
+    quantity_t quantity;                // Quantity to buy/sell
+    funds_t price;                      // Price
+} BRS_INST_ORDER_INFO;
+
+typedef struct brs_inst_cancel_info {   // For CANCEL_INST
+    instrument_t instrument;
+    uint16_t reserved;                  // Must be zero
+    orderid_t order;                    // Order to cancel
+} BRS_INST_CANCEL_INFO;
+
+typedef struct brs_inst_amend_info {   // For AMEND_INST
+    instrument_t instrument;
+    uint16_t reserved;                  // Must be zero
+    orderid_t order;                    // Order to amend
+    quantity_t quantity;                // New quantity (nonzero)
+    funds_t price;                      // New price
+} BRS_INST_AMEND_INFO;
+
+typedef struct brs_depth_request {     // For DEPTH_INST
+    instrument_t instrument;
+    uint16_t levels;                    // Levels wanted on each side
+} BRS_DEPTH_REQUEST;
+
+typedef struct brs_depth_level {
+    funds_t price;
+    quantity_t quantity;                // Total of the orders at this price
+    uint32_t orders;                    // Number of orders at this price
+} BRS_DEPTH_LEVEL;
+
+typedef struct brs_depth_info {         // Payload of the ACK to DEPTH_INST, and of BOOK_INST
+    instrument_t instrument;
+    uint16_t nbids;                     // Levels of bids that follow
+    uint16_t nasks;                     // Levels of asks that follow the bids
+    uint16_t reserved;
+    BRS_DEPTH_LEVEL levels[];           // nbids bids, then nasks asks, best first
+} BRS_DEPTH_INFO;
+
+typedef struct brs_trades_info {        // For TRADES_INST
+    instrument_t instrument;
+    uint16_t reserved;
+    uint32_t trades;                    // Number of trades
+    quantity_t quantity;                // Total quantity traded
+    funds_t first;                      // Price of the first trade
+    funds_t high;                       // Highest price
+    funds_t low;                        // Lowest price
+    funds_t last;                       // Price of the last trade
+} BRS_TRADES_INFO;
+
+typedef struct brs_md_header {          // Start of each market-data datagram
+    uint64_t seq;                       // Sequence number
+} BRS_MD_HEADER;                        // The packet follows: header, then payload
+
+typedef struct brs_resend_request {     // For RESEND
+    uint64_t first;                     // Sequence number of the first datagram wanted
+    uint32_t count;                     // Number of datagrams wanted
+    uint32_t reserved;                  // Must be zero
+} BRS_RESEND_REQUEST;
+
+typedef struct brs_inst_notify_info {   // For BOUGHT_INST ... TRADED_INST
+    instrument_t instrument;
+    uint16_t reserved;
+    orderid_t buyer;                    // Buy order ID
+    orderid_t seller;                   // Sell order ID
+    quantity_t quantity;                // Quantity bought/sold/traded/canceled/amended
+    funds_t price;                      // Price
+} BRS_INST_NOTIFY_INFO;
+
+#endif
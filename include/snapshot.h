@@ -0,0 +1,122 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "exchange.h"
+
+/*
+ * Point-in-time snapshots of the exchange, and recovery on startup.
+ *
+ * A snapshot holds every account (balance and inventories) and every
+ * resting order of every instrument, in priority order, together with the
+ * sequence number of the last journal record it reflects.  To take one, all
+ * the book and account locks are acquired just long enough to fork; the child
+ * process writes its copy-on-write image of the state to
+ * snapshot-<seq>.snap in the journal directory while the parent carries on
+ * trading.  Snapshots are taken periodically by a background thread, and
+ * once more at shutdown.  After a snapshot has been written, older snapshots
+ * and the journal segments it covers are deleted.
+ *
+ * On startup, the latest complete snapshot is loaded and only the journal
+ * records that follow it are replayed, so the time taken to restart depends
+ * on the size of the state rather than the length of its history.
+ */
+
+#define SNAPSHOT_MAGIC "BRSSNAP1"
+#define SNAPSHOT_END_MAGIC "BRSSNAPE"
+
+/*
+ * Layout of a snapshot file: a header, naccounts account records (each
+ * followed by its inventories and name), then for each instrument an
+ * instrument record followed by its orders, then the end marker.
+ * All fields are in host byte order.
+ */
+struct snapshot_header {
+    char magic[8];                  // SNAPSHOT_MAGIC
+    uint64_t seq;                   // last journal record reflected in the snapshot
+    uint32_t naccounts;
+    uint16_t ninstruments;
+    uint16_t reserved;
+    orderid_t next_order_id;
+    uint32_t reserved2;
+};
+
+struct snapshot_account {
+    uint32_t id;
+    funds_t balance;
+    uint32_t name_len;              // name follows the inventories, not NUL-terminated
+    // followed by quantity_t inventory[ninstruments] and the name
+};
+
+struct snapshot_instrument {
+    uint16_t id;
+    uint8_t last_trade_set;
+    uint8_t reserved;
+    funds_t last_trade_price;
+    uint32_t norders;               // orders that follow
+};
+
+struct snapshot_order {
+    orderid_t order_id;
+    uint32_t account;
+    quantity_t quantity;
+    funds_t price;
+    uint8_t side;                   // BOOK_SIDE
+    uint8_t reserved[3];
+};
+
+/*
+ * Buffered output for writing a snapshot.  It only uses write(), so that
+ * it is safe in a child forked from a multithreaded process.
+ */
+struct snapshot_writer {
+    int fd;
+    int err;                        // set once a write has failed
+    size_t len;
+    char buf[1 << 16];
+};
+
+/*
+ * Append data to a snapshot.
+ *
+ * @return 0 if successful, -1 if this or an earlier write has failed.
+ */
+int snapshot_write(struct snapshot_writer *w, const void *data, size_t size);
+
+/*
+ * Restore the state of the exchange from the latest snapshot in the journal
+ * directory and replay the journal records that follow it.  Must be called
+ * after the accounts, traders and exchange have been initialized and before
+ * the journal is; does nothing if no journal directory is configured.
+ *
+ * @param xchg  The exchange.
+ * @param last_seq  Pointer to a variable to receive the sequence number of
+ * the last journal record recovered (0 if none).
+ * @return 0 if successful, -1 if the state could not be recovered.
+ */
+int snapshot_recover(EXCHANGE *xchg, uint64_t *last_seq);
+
+/*
+ * Start taking snapshots every config.snapshot_interval seconds.
+ * Does nothing if the journal or periodic snapshots are disabled.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int snapshot_init(EXCHANGE *xchg);
+
+/*
+ * Stop taking periodic snapshots, and take a final one.
+ */
+void snapshot_fini(void);
+
+/*
+ * Take a snapshot now, and wait for it to be written.
+ *
+ * @return 0 if successful (or there was nothing new to record), -1 otherwise.
+ */
+int snapshot_take(EXCHANGE *xchg);
+
+#endif
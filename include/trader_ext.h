@@ -0,0 +1,83 @@
+#ifndef TRADER_EXT_H
+#define TRADER_EXT_H
+
+/*
+ * Additional trader functions, beyond the interface in trader.h.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "trader.h"
+#include "account.h"
+
+struct md_conflation;
+
+/*
+ * Create a TRADER that is not logged in, to own orders recovered from a
+ * snapshot or the journal for an account whose trader is not connected.
+ * Packets sent to a detached trader go to whichever trader is logged in
+ * to the same account at the time, if any.
+ *
+ * @param account  The account.
+ * @return  The trader, with a reference count of one, or NULL if memory
+ * could not be allocated.
+ */
+TRADER *trader_detached(ACCOUNT *account);
+
+/*
+ * Counters kept for each trader of what has been sent to its client.
+ */
+struct trader_stats {
+    size_t queued;                  // bytes waiting for the socket to take them
+    size_t high_water;              // most bytes that have ever been waiting
+    uint64_t packets;               // packets sent or queued
+    uint64_t bytes;                 // bytes in those packets
+    uint64_t writes;                // system calls made to send them
+};
+
+/*
+ * Get the number of bytes queued for a trader's client that its socket has
+ * not yet taken.  Packets that the socket takes at once are never queued;
+ * the rest wait, up to config.out_queue_size bytes, for the writer thread.
+ *
+ * @param trader  The trader.
+ * @return  The backlog, which is 0 for a trader that is not connected.
+ */
+size_t trader_backlog(TRADER *trader);
+
+/*
+ * Get a copy of a trader's counters.
+ *
+ * @param trader  The trader.
+ * @param stats  Where to put them.
+ */
+void trader_get_stats(TRADER *trader, struct trader_stats *stats);
+
+/*
+ * Get a trader's market-data conflation state, for the publisher thread.
+ */
+struct md_conflation *trader_conflation(TRADER *trader);
+
+/*
+ * Broadcast a packet to the logged-in traders that a function admits.
+ *
+ * @param pkt  The header of the packet to be sent.
+ * @param data  The payload, or NULL if there is none.
+ * @param admit  Function called for each trader, which returns true if the
+ * packet is to be sent to it.  If NULL, it is sent to every trader.
+ * @param arg  Passed on to `admit`.
+ * @return 0 if the packet was sent to every trader admitted, -1 otherwise.
+ */
+int trader_broadcast_packet_if(BRS_PACKET_HEADER *pkt, void *data,
+                               bool (*admit)(TRADER *trader, void *arg), void *arg);
+
+/*
+ * Call a function for every logged-in trader.  The trader cannot be released
+ * during the call, and the function may send it packets, but it must not
+ * log anyone in or out.
+ */
+void trader_foreach(void (*fn)(TRADER *trader, void *arg), void *arg);
+
+#endif
@@ -4,19 +4,78 @@
 #include <pthread.h>
 
 #include "account.h"
+#include "account_ext.h"
 #include "protocol.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "config.h"
 
 struct account {
     char *user;
-    funds_t balance;
-    quantity_t inventory;
+    uint32_t id;                            // index in account_arr, used in the journal
+    funds_t balance;                        // shared by all instruments
+    quantity_t inventory[MAX_INSTRUMENTS];  // one per instrument
+    struct order *open[MAX_INSTRUMENTS];    // open orders; see account_open_orders()
     pthread_mutex_t mutex;
 };
 
 static pthread_mutex_t global_mutex;
-static ACCOUNT *account_arr[MAX_ACCOUNTS];
+static ACCOUNT **account_arr;               // grown as accounts are created
+static int account_cap = 0;                 // slots in account_arr
 static int curr_index = 0;
 
+/*
+ * Most accounts that can be created: enough for every trader that may be
+ * logged in at once to have its own.
+ */
+static int account_limit(void) {
+    return (config.max_traders > MAX_ACCOUNTS) ? (int)config.max_traders : MAX_ACCOUNTS;
+}
+
+/*
+ * Record the creation of an account in the journal, so that the account
+ * numbers used by later records can be mapped back to names.
+ *
+ * @return 0 if successful (or the journal is disabled), -1 otherwise.
+ */
+static int journal_account(ACCOUNT *account) {
+    if (!journal_enabled()) {
+        return 0;
+    }
+
+    size_t len = strlen(account->user);
+    size_t size = sizeof(struct journal_record) + ((len + 8) & ~(size_t)7);   // NUL-padded
+    struct journal_record *rec = calloc(1, size);
+    if (!rec) {
+        return -1;
+    }
+    rec->size = size;
+    rec->type = JOURNAL_ACCOUNT;
+    rec->account = account->id;
+    memcpy(rec + 1, account->user, len);
+
+    uint64_t seq = journal_append(rec);
+    free(rec);
+    return seq ? 0 : -1;
+}
+
+/*
+ * Record a change made on behalf of the trader in the journal.
+ * Called with the account mutex held.
+ */
+static void journal_change(ACCOUNT *account, JOURNAL_TYPE type, instrument_t instrument,
+                           quantity_t quantity, funds_t amount) {
+    struct journal_record rec = {
+        .size = sizeof(struct journal_record),
+        .type = type,
+        .instrument = instrument,
+        .account = account->id,
+        .quantity = quantity,
+        .price = amount
+    };
+    journal_append(&rec);
+}
+
 int accounts_init() {
     // pthread_mutex_init returns non-zero on failure
     if (pthread_mutex_init(&global_mutex, NULL)) { 
@@ -27,13 +86,14 @@ int accounts_init() {
 
 void accounts_fini() {
     pthread_mutex_lock(&global_mutex);
-    for (int i = 0; i < MAX_ACCOUNTS; i++) {
-        if (account_arr[i]) {
-            pthread_mutex_destroy(&(account_arr[i]->mutex));
-            free(account_arr[i]->user);
-            free(account_arr[i]);
-        }
+    for (int i = 0; i < curr_index; i++) {
+        pthread_mutex_destroy(&(account_arr[i]->mutex));
+        free(account_arr[i]->user);
+        free(account_arr[i]);
     }
+    free(account_arr);
+    account_arr = NULL;
+    account_cap = curr_index = 0;
     pthread_mutex_unlock(&global_mutex);
     pthread_mutex_destroy(&global_mutex);
 }
@@ -41,22 +101,31 @@ void accounts_fini() {
 ACCOUNT *account_lookup(char *name) {
     pthread_mutex_lock(&global_mutex);
     // Search for existing account
-    for (int i = 0; i < MAX_ACCOUNTS; i++) {
-        if (account_arr[i]) {
-            // Account exists, is it the user we are looking for?
-            if (strcmp(name, account_arr[i]->user) == 0) {
-                pthread_mutex_unlock(&global_mutex);
-                return account_arr[i];
-            }
+    for (int i = 0; i < curr_index; i++) {
+        // Account exists, is it the user we are looking for?
+        if (strcmp(name, account_arr[i]->user) == 0) {
+            pthread_mutex_unlock(&global_mutex);
+            return account_arr[i];
         }
     }
 
     // Max # of accounts reached
-    if (curr_index >= MAX_ACCOUNTS) {
+    if (curr_index >= account_limit()) {
         pthread_mutex_unlock(&global_mutex);
         return NULL;
     }
 
+    if (curr_index == account_cap) {
+        int cap = account_cap ? 2 * account_cap : MAX_ACCOUNTS;
+        ACCOUNT **arr = realloc(account_arr, cap * sizeof(ACCOUNT *));
+        if (!arr) {
+            pthread_mutex_unlock(&global_mutex);
+            return NULL;
+        }
+        account_arr = arr;
+        account_cap = cap;
+    }
+
     ACCOUNT *new_acc = malloc(sizeof(struct account));
     if (!new_acc) {
         pthread_mutex_unlock(&global_mutex);
@@ -68,10 +137,20 @@ ACCOUNT *account_lookup(char *name) {
         pthread_mutex_unlock(&global_mutex);
         return NULL;
     }
+    new_acc->id = curr_index;
     new_acc->balance = 0;
-    new_acc->inventory = 0;
+    memset(new_acc->inventory, 0, sizeof(new_acc->inventory));
+    memset(new_acc->open, 0, sizeof(new_acc->open));
     pthread_mutex_init(&new_acc->mutex, NULL);
 
+    if (journal_account(new_acc) == -1) {
+        pthread_mutex_destroy(&new_acc->mutex);
+        free(new_acc->user);
+        free(new_acc);
+        pthread_mutex_unlock(&global_mutex);
+        return NULL;
+    }
+
     account_arr[curr_index++] = new_acc;
     pthread_mutex_unlock(&global_mutex);
     return new_acc;
@@ -95,25 +174,148 @@ int account_decrease_balance(ACCOUNT *account, funds_t amount) {
 }
 
 void account_increase_inventory(ACCOUNT *account, quantity_t quantity) {
+    account_increase_inventory_of(account, 0, quantity);
+}
+
+int account_decrease_inventory(ACCOUNT *account, quantity_t quantity) {
+    return account_decrease_inventory_of(account, 0, quantity);
+}
+
+void account_get_status(ACCOUNT *account, BRS_STATUS_INFO *infop) {
+    account_get_status_of(account, 0, infop);
+}
+
+void account_increase_inventory_of(ACCOUNT *account, instrument_t instrument, quantity_t quantity) {
     pthread_mutex_lock(&account->mutex);
-    account->inventory += quantity;
+    account->inventory[instrument] += quantity;
     pthread_mutex_unlock(&account->mutex);
 }
 
-int account_decrease_inventory(ACCOUNT *account, quantity_t quantity) {
+int account_decrease_inventory_of(ACCOUNT *account, instrument_t instrument, quantity_t quantity) {
     pthread_mutex_lock(&account->mutex);
-    if (account->inventory < quantity) {
+    if (account->inventory[instrument] < quantity) {
         pthread_mutex_unlock(&account->mutex);
         return -1;
     }
-    account->inventory -= quantity;
+    account->inventory[instrument] -= quantity;
     pthread_mutex_unlock(&account->mutex);
     return 0;
 }
 
-void account_get_status(ACCOUNT *account, BRS_STATUS_INFO *infop) {
+void account_get_status_of(ACCOUNT *account, instrument_t instrument, BRS_STATUS_INFO *infop) {
     pthread_mutex_lock(&account->mutex);
     infop->balance = htonl(account->balance);
-    infop->inventory = htonl(account->inventory);
+    infop->inventory = htonl(account->inventory[instrument]);
     pthread_mutex_unlock(&account->mutex);
-}
\ No newline at end of file
+}
+
+uint32_t account_get_id(ACCOUNT *account) {
+    return account->id;
+}
+
+struct order **account_open_orders(ACCOUNT *account, instrument_t instrument) {
+    return &account->open[instrument];
+}
+
+void account_deposit(ACCOUNT *account, funds_t amount) {
+    pthread_mutex_lock(&account->mutex);
+    account->balance += amount;
+    journal_change(account, JOURNAL_DEPOSIT, 0, 0, amount);
+    pthread_mutex_unlock(&account->mutex);
+}
+
+int account_withdraw(ACCOUNT *account, funds_t amount) {
+    pthread_mutex_lock(&account->mutex);
+    if (account->balance < amount) {
+        pthread_mutex_unlock(&account->mutex);
+        return -1;
+    }
+    account->balance -= amount;
+    journal_change(account, JOURNAL_WITHDRAW, 0, 0, amount);
+    pthread_mutex_unlock(&account->mutex);
+    return 0;
+}
+
+void account_escrow(ACCOUNT *account, instrument_t instrument, quantity_t quantity) {
+    pthread_mutex_lock(&account->mutex);
+    account->inventory[instrument] += quantity;
+    journal_change(account, JOURNAL_ESCROW, instrument, quantity, 0);
+    pthread_mutex_unlock(&account->mutex);
+}
+
+int account_release(ACCOUNT *account, instrument_t instrument, quantity_t quantity) {
+    pthread_mutex_lock(&account->mutex);
+    if (account->inventory[instrument] < quantity) {
+        pthread_mutex_unlock(&account->mutex);
+        return -1;
+    }
+    account->inventory[instrument] -= quantity;
+    journal_change(account, JOURNAL_RELEASE, instrument, quantity, 0);
+    pthread_mutex_unlock(&account->mutex);
+    return 0;
+}
+
+const char *account_get_name(ACCOUNT *account) {
+    return account->user;
+}
+
+ACCOUNT *account_get_by_id(uint32_t id) {
+    pthread_mutex_lock(&global_mutex);
+    ACCOUNT *account = (id < (uint32_t)curr_index) ? account_arr[id] : NULL;
+    pthread_mutex_unlock(&global_mutex);
+    return account;
+}
+
+void account_adjust(ACCOUNT *account, instrument_t instrument, int64_t balance, int64_t inventory) {
+    pthread_mutex_lock(&account->mutex);
+    account->balance += (funds_t)balance;
+    account->inventory[instrument] += (quantity_t)inventory;
+    pthread_mutex_unlock(&account->mutex);
+}
+
+int account_restore(uint32_t id, const char *name, funds_t balance,
+                    const quantity_t *inventory, size_t ninstruments) {
+    ACCOUNT *account = account_lookup((char *)name);
+    if (!account || account->id != id) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&account->mutex);
+    account->balance = balance;
+    memcpy(account->inventory, inventory, ninstruments * sizeof(quantity_t));
+    pthread_mutex_unlock(&account->mutex);
+    return 0;
+}
+
+void accounts_lock_all(void) {
+    pthread_mutex_lock(&global_mutex);
+    for (int i = 0; i < curr_index; i++) {
+        pthread_mutex_lock(&account_arr[i]->mutex);
+    }
+}
+
+void accounts_unlock_all(void) {
+    for (int i = curr_index - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&account_arr[i]->mutex);
+    }
+    pthread_mutex_unlock(&global_mutex);
+}
+
+uint32_t accounts_count(void) {
+    return curr_index;
+}
+
+int accounts_write_snapshot(struct snapshot_writer *w, size_t ninstruments) {
+    for (int i = 0; i < curr_index; i++) {
+        ACCOUNT *account = account_arr[i];
+        struct snapshot_account rec = {
+            .id = account->id,
+            .balance = account->balance,
+            .name_len = strlen(account->user)
+        };
+        snapshot_write(w, &rec, sizeof(rec));
+        snapshot_write(w, account->inventory, ninstruments * sizeof(quantity_t));
+        snapshot_write(w, account->user, rec.name_len);
+    }
+    return w->err ? -1 : 0;
+}
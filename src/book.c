@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "book.h"
+
+#define BOOK_INITIAL_LEVELS 64
+#define BOOK_INITIAL_INDEX 1024     // must be a power of two
+
+/*
+ * Levels on both sides are kept in ascending order of "rank", where a
+ * higher rank is a better price for that side.  For bids the rank is the
+ * price itself; for asks it is the complement, so the lowest ask ranks highest.
+ */
+static inline funds_t rank(BOOK_SIDE side, funds_t price) {
+    return (side == BOOK_BUY) ? price : ~price;
+}
+
+/*
+ * Binary search for the position of a price within one side of the book.
+ *
+ * @param bs  The side to be searched.
+ * @param side  Which side it is (determines the ordering).
+ * @param price  The price to look for.
+ * @return  The index of the first level whose rank is not less than that
+ * of the price.  This is either the level for the price or the position
+ * at which such a level should be inserted.
+ */
+static size_t level_search(struct book_side *bs, BOOK_SIDE side, funds_t price) {
+    funds_t key = rank(side, price);
+    size_t lo = 0, hi = bs->nlevels;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rank(side, bs->levels[mid]->price) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int index_init(struct order_index *idx, size_t size) {
+    idx->slots = calloc(size, sizeof(struct order *));
+    if (!idx->slots) {
+        return -1;
+    }
+    idx->mask = size - 1;
+    idx->count = 0;
+    return 0;
+}
+
+/*
+ * Place an order in the first free slot at or after its home slot.
+ * The caller guarantees that there is a free slot.
+ */
+static void index_place(struct order_index *idx, struct order *ordp) {
+    size_t i = ordp->order_id & idx->mask;
+    while (idx->slots[i]) {
+        i = (i + 1) & idx->mask;
+    }
+    idx->slots[i] = ordp;
+}
+
+/*
+ * Double the size of the index and rehash every entry.
+ *
+ * @return 0 if successful, -1 if the new table could not be allocated
+ * (the index is left unchanged in that case).
+ */
+static int index_grow(struct order_index *idx) {
+    struct order_index bigger;
+    if (index_init(&bigger, 2 * (idx->mask + 1)) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i <= idx->mask; i++) {
+        if (idx->slots[i]) {
+            index_place(&bigger, idx->slots[i]);
+        }
+    }
+    bigger.count = idx->count;
+    free(idx->slots);
+    *idx = bigger;
+    return 0;
+}
+
+static int index_add(struct order_index *idx, struct order *ordp) {
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    if (2 * (idx->count + 1) > idx->mask + 1) {
+        if (index_grow(idx) == -1) {
+            return -1;
+        }
+    }
+    index_place(idx, ordp);
+    idx->count++;
+    return 0;
+}
+
+static void index_del(struct order_index *idx, struct order *ordp) {
+    size_t i = ordp->order_id & idx->mask;
+    while (idx->slots[i] != ordp) {
+        i = (i + 1) & idx->mask;
+    }
+    idx->slots[i] = NULL;
+    idx->count--;
+
+    // Backward-shift deletion: pull later entries of the probe run into the
+    // hole if that brings them closer to home, so lookups never need tombstones.
+    size_t hole = i;
+    for (size_t j = (i + 1) & idx->mask; idx->slots[j]; j = (j + 1) & idx->mask) {
+        size_t home = idx->slots[j]->order_id & idx->mask;
+        // Entry at j may move to the hole only if its home is not in (hole, j]
+        if (((j - home) & idx->mask) >= ((j - hole) & idx->mask)) {
+            idx->slots[hole] = idx->slots[j];
+            idx->slots[j] = NULL;
+            hole = j;
+        }
+    }
+}
+
+int book_init(struct book *bk) {
+    memset(bk, 0, sizeof(struct book));
+    for (int s = 0; s < 2; s++) {
+        bk->sides[s].levels = malloc(BOOK_INITIAL_LEVELS * sizeof(struct price_level *));
+        if (!bk->sides[s].levels) {
+            free(bk->sides[0].levels);
+            return -1;
+        }
+        bk->sides[s].cap = BOOK_INITIAL_LEVELS;
+    }
+    if (index_init(&bk->index, BOOK_INITIAL_INDEX) == -1) {
+        free(bk->sides[0].levels);
+        free(bk->sides[1].levels);
+        return -1;
+    }
+    return 0;
+}
+
+void book_fini(struct book *bk) {
+    for (int s = 0; s < 2; s++) {
+        struct book_side *bs = &bk->sides[s];
+        for (size_t i = 0; i < bs->nlevels; i++) {
+            free(bs->levels[i]);
+        }
+        free(bs->levels);
+        bs->levels = NULL;
+        bs->nlevels = bs->cap = bs->norders = 0;
+        bs->best = NULL;
+    }
+    while (bk->spare) {
+        struct price_level *lvl = bk->spare;
+        bk->spare = lvl->next_spare;
+        free(lvl);
+    }
+    free(bk->index.slots);
+    bk->index.slots = NULL;
+}
+
+int book_insert(struct book *bk, struct order *ordp) {
+    struct book_side *bs = &bk->sides[ordp->side];
+    size_t i = level_search(bs, ordp->side, ordp->price);
+    struct price_level *lvl;
+
+    if (index_add(&bk->index, ordp) == -1) {
+        return -1;
+    }
+
+    if (i < bs->nlevels && bs->levels[i]->price == ordp->price) {
+        lvl = bs->levels[i];
+    } else {
+        // No orders at this price yet, so a level has to be created
+        if (bs->nlevels == bs->cap) {
+            struct price_level **tmp = realloc(bs->levels, 2 * bs->cap * sizeof(struct price_level *));
+            if (!tmp) {
+                index_del(&bk->index, ordp);
+                return -1;
+            }
+            bs->levels = tmp;
+            bs->cap *= 2;
+        }
+
+        // Reuse a level that has emptied before; a book that has warmed up
+        // does not touch the heap allocator at all
+        if (bk->spare) {
+            lvl = bk->spare;
+            bk->spare = lvl->next_spare;
+        } else if (!(lvl = malloc(sizeof(struct price_level)))) {
+            index_del(&bk->index, ordp);
+            return -1;
+        }
+        lvl->price = ordp->price;
+        lvl->total = 0;
+        lvl->count = 0;
+        lvl->head = lvl->tail = NULL;
+
+        // Shift the better levels up one slot (usually only a few near the top)
+        memmove(&bs->levels[i + 1], &bs->levels[i], (bs->nlevels - i) * sizeof(struct price_level *));
+        bs->levels[i] = lvl;
+        bs->nlevels++;
+        if (i == bs->nlevels - 1) {
+            bs->best = lvl;         // new best price
+        }
+    }
+
+    // Append to the tail of the FIFO
+    ordp->level = lvl;
+    ordp->next = NULL;
+    ordp->prev = lvl->tail;
+    if (lvl->tail) {
+        lvl->tail->next = ordp;
+    } else {
+        lvl->head = ordp;
+    }
+    lvl->tail = ordp;
+    lvl->total += ordp->quantity;
+    lvl->count++;
+    bs->norders++;
+
+    return 0;
+}
+
+void book_remove(struct book *bk, struct order *ordp) {
+    struct book_side *bs = &bk->sides[ordp->side];
+    struct price_level *lvl = ordp->level;
+
+    index_del(&bk->index, ordp);
+
+    if (ordp->prev) {
+        ordp->prev->next = ordp->next;
+    } else {
+        lvl->head = ordp->next;
+    }
+    if (ordp->next) {
+        ordp->next->prev = ordp->prev;
+    } else {
+        lvl->tail = ordp->prev;
+    }
+    lvl->total -= ordp->quantity;
+    lvl->count--;
+    bs->norders--;
+
+    ordp->next = ordp->prev = NULL;
+    ordp->level = NULL;
+
+    if (lvl->count > 0) {
+        return;
+    }
+
+    // Level is now empty: drop it.  The best level is the last one, so the
+    // common case of trading out the top of the book moves nothing.
+    size_t i = level_search(bs, ordp->side, lvl->price);
+    memmove(&bs->levels[i], &bs->levels[i + 1], (bs->nlevels - i - 1) * sizeof(struct price_level *));
+    bs->nlevels--;
+    bs->best = bs->nlevels ? bs->levels[bs->nlevels - 1] : NULL;
+    lvl->next_spare = bk->spare;
+    bk->spare = lvl;
+}
+
+void book_reduce(struct order *ordp, quantity_t filled) {
+    ordp->quantity -= filled;
+    if (ordp->level) {
+        ordp->level->total -= filled;
+    }
+}
+
+int book_amend(struct book *bk, struct order *ordp, quantity_t quantity, funds_t price) {
+    if (price == ordp->price && quantity <= ordp->quantity) {
+        book_reduce(ordp, ordp->quantity - quantity);
+        return 0;
+    }
+
+    quantity_t old_quantity = ordp->quantity;
+    funds_t old_price = ordp->price;
+    book_remove(bk, ordp);
+    ordp->quantity = quantity;
+    ordp->price = price;
+    if (book_insert(bk, ordp) == 0) {
+        return 0;
+    }
+
+    // Only a new level can have failed to be allocated.  The old one is
+    // either still there or on the spare list, so this cannot fail.
+    ordp->quantity = old_quantity;
+    ordp->price = old_price;
+    book_insert(bk, ordp);
+    return -1;
+}
+
+uint64_t book_available(struct book *bk, BOOK_SIDE side, funds_t limit, uint64_t want) {
+    struct book_side *bs = &bk->sides[side];
+    uint64_t total = 0;
+
+    // Walk down from the best level for as long as the limit is reached
+    for (size_t i = bs->nlevels; i > 0 && total < want; i--) {
+        struct price_level *lvl = bs->levels[i - 1];
+        if (rank(side, lvl->price) < rank(side, limit)) {
+            break;
+        }
+        total += lvl->total;
+    }
+    return total;
+}
+
+struct order *book_find(struct book *bk, orderid_t order_id) {
+    struct order_index *idx = &bk->index;
+    for (size_t i = order_id & idx->mask; idx->slots[i]; i = (i + 1) & idx->mask) {
+        if (idx->slots[i]->order_id == order_id) {
+            return idx->slots[i];
+        }
+    }
+    return NULL;
+}
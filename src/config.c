@@ -0,0 +1,29 @@
+#include "config.h"
+
+/*
+ * Defaults, overridden by command-line options.
+ */
+struct bourse_config config = {
+    .order_pool_size = 8192,
+    .order_pool_chunk = 8192,
+    .order_limit = 1 << 20,
+    .order_pool_hugepages = false,
+    .match_inline = true,
+    .match_batch = 256,
+    .md_ring_size = 16384,
+    .journal_dir = NULL,
+    .journal_segment_size = 64 << 20,
+    .journal_interval_us = 2000,
+    .journal_batch = 4096,
+    .snapshot_interval = 300,
+    .cancel_on_disconnect = false,
+    .out_queue_size = 1 << 20,
+    .conflate_backlog = 0,
+    .conflate_levels = 10,
+    .max_traders = 1024,
+    .md_group = NULL,
+    .md_port = 0,
+    .md_interface = NULL,
+    .md_history = 65536,
+    .instruments = 1,
+};
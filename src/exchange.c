@@ -9,214 +9,979 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
 
 #include "exchange.h"
 #include "trader.h"
 #include "account.h"
+#include "account_ext.h"
+#include "trader_ext.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "book.h"
+#include "order_pool.h"
+#include "md_ring.h"
+#include "md_feed.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "exchange_ext.h"
+#include "config.h"
 #include "debug.h"
 
-#define MAX_ORDERS 4096
-
-struct order {
-    TRADER *trader;
-    funds_t price;
-    quantity_t quantity;
-    orderid_t order_id;
-};
-
-struct exchange {
+/*
+ * Most trades an incoming order makes inline before the rest of its
+ * sweep is left to the matchmaker thread.
+ */
+#define INLINE_FILLS_MAX 64
+
+/*
+ * How often the publisher looks for conflated traders whose clients have
+ * caught up, in nanoseconds.
+ */
+#define CONFLATE_CHECK_NS 10000000
+
+/*
+ * One instrument traded on the exchange.  Each instrument has its own book,
+ * order pool, lock and matchmaker thread, so that trading in one instrument
+ * never waits for another.
+ */
+struct instrument {
+    instrument_t id;
+    EXCHANGE *xchg;
     pthread_t match;
-    struct order *buy_orders[MAX_ORDERS];
-    struct order *sell_orders[MAX_ORDERS];
-    orderid_t next_order_id;
+    struct book book;
+    struct order_pool pool;
+    pthread_mutex_t grow_mutex;     // serializes growth of the pool; taken before mutex
     funds_t last_trade_price;
     bool last_trade_set;
+    struct {                        // bid, ask and last for exchange_get_status (0 = none)
+        atomic_uint seq;            // seqlock: odd while an update is in progress
+        _Atomic funds_t bid;
+        _Atomic funds_t ask;
+        _Atomic funds_t last;
+    } top __attribute__((aligned(64)));  // read without the mutex; keep off its line
+    struct {                        // best levels for conflated traders, published like top
+        atomic_uint seq;
+        _Atomic size_t pos;         // ring position of the first event not reflected
+        _Atomic uint32_t nlevels[2];    // levels given on each side
+        _Atomic uint32_t *words;    // price, quantity, orders of config.conflate_levels per side
+    } depth;                        // words is NULL unless conflation is enabled
+    struct md_ring ring;            // events for the publisher; pushed with mutex held
     pthread_mutex_t mutex;
-    sem_t sem;
+    sem_t sem;                      // posted to wake the matchmaker
+    atomic_bool stop;               // matchmaker is to exit when next woken
+} __attribute__((aligned(64)));     // keep instruments off each other's cache lines
+
+struct exchange {
+    atomic_uint next_order_id;      // order IDs are unique across instruments
+    size_t ninstruments;
+    struct instrument *instruments;
+    pthread_t publisher;
+    sem_t publisher_sem;            // posted to wake the publisher
+    atomic_bool publisher_idle;     // publisher is (about to be) waiting on publisher_sem
+    atomic_bool publisher_stop;
+    size_t nconflated;              // traders conflated at the last check (publisher only)
+    struct timespec conflate_checked;   // time of the last check (publisher only)
 };
 
-static funds_t get_price(EXCHANGE *xchg, funds_t sell, funds_t buy) {
+static funds_t get_price(struct instrument *inst, funds_t sell, funds_t buy) {
     /**
      * 1. No last trade price (this is the first trade) -> return the sell price
      * 2. There is a last trade price
      *      Case A: last price is within [sell min, buy max] -> return last trade price
      *      Case B: else -> return the endpoint (sell min or buy max) that is closest to the last trade price
      */
-    if (!xchg->last_trade_set) {
+    if (!inst->last_trade_set) {
         return sell;
     }
 
-    if (sell <= (xchg->last_trade_price) && (xchg->last_trade_price <= buy)) {
-        return xchg->last_trade_price;
+    if (sell <= (inst->last_trade_price) && (inst->last_trade_price <= buy)) {
+        return inst->last_trade_price;
     }
 
-    if (xchg->last_trade_price < sell) {
+    if (inst->last_trade_price < sell) {
         return sell;
     }
 
     return buy;
 }
 
+/*
+ * Publish the best levels of each side for conflated traders, together
+ * with the ring position of the first event they do not reflect, under a
+ * seqlock like the top of the book.  The publisher reads them from here
+ * rather than from the book, so that it never takes the instrument mutex:
+ * a thread holding the mutex may be waiting for the publisher to make room
+ * in the ring.  Must be called with the instrument mutex held, after any
+ * events for the changes made have been pushed.
+ */
+static void update_depth(struct instrument *inst) {
+    unsigned seq = atomic_load_explicit(&inst->depth.seq, memory_order_relaxed);
+
+    atomic_store_explicit(&inst->depth.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int side = BOOK_BUY; side <= BOOK_SELL; side++) {
+        _Atomic uint32_t *w = &inst->depth.words[side * 3 * config.conflate_levels];
+        struct price_level *lvl;
+        uint32_t n = 0;
+        while (n < config.conflate_levels && (lvl = book_level(&inst->book, side, n))) {
+            atomic_store_explicit(w++, lvl->price, memory_order_relaxed);
+            atomic_store_explicit(w++, lvl->total > UINT32_MAX ? UINT32_MAX : lvl->total, memory_order_relaxed);
+            atomic_store_explicit(w++, lvl->count, memory_order_relaxed);
+            n++;
+        }
+        atomic_store_explicit(&inst->depth.nlevels[side], n, memory_order_relaxed);
+    }
+    atomic_store_explicit(&inst->depth.pos, atomic_load_explicit(&inst->ring.head, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(&inst->depth.seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Read a consistent copy of the levels published by update_depth(), without
+ * taking the instrument mutex.
+ *
+ * @param infop  Where to put them, with room for 2 * config.conflate_levels levels.
+ * @param posp  Receives the ring position of the first event not reflected.
+ * @return  The size of the BRS_DEPTH_INFO filled in.
+ */
+static size_t read_depth(struct instrument *inst, BRS_DEPTH_INFO *infop, size_t *posp) {
+    unsigned before, after;
+    uint32_t n[2];
+    do {
+        while ((before = atomic_load_explicit(&inst->depth.seq, memory_order_acquire)) & 1) {
+            sched_yield();
+        }
+        BRS_DEPTH_LEVEL *out = infop->levels;
+        for (int side = BOOK_BUY; side <= BOOK_SELL; side++) {
+            _Atomic uint32_t *w = &inst->depth.words[side * 3 * config.conflate_levels];
+            n[side] = atomic_load_explicit(&inst->depth.nlevels[side], memory_order_relaxed);
+            if (n[side] > config.conflate_levels) {
+                n[side] = 0;        // torn; the check below sends us round again
+            }
+            for (uint32_t i = 0; i < n[side]; i++, out++) {
+                out->price = htonl(atomic_load_explicit(w++, memory_order_relaxed));
+                out->quantity = htonl(atomic_load_explicit(w++, memory_order_relaxed));
+                out->orders = htonl(atomic_load_explicit(w++, memory_order_relaxed));
+            }
+        }
+        *posp = atomic_load_explicit(&inst->depth.pos, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&inst->depth.seq, memory_order_relaxed);
+    } while (before != after);
+
+    infop->instrument = htons(inst->id);
+    infop->nbids = htons(n[BOOK_BUY]);
+    infop->nasks = htons(n[BOOK_SELL]);
+    infop->reserved = 0;
+    return sizeof(BRS_DEPTH_INFO) + (n[BOOK_BUY] + n[BOOK_SELL]) * sizeof(BRS_DEPTH_LEVEL);
+}
+
+/*
+ * Publish the best bid and ask and the last trade price after the book has
+ * changed.  The best levels are cached by the book, so this is constant time.
+ * The values are published under a seqlock: readers never take the mutex
+ * or write to the instrument, and retry if they overlap an update.
+ * Must be called with the instrument mutex held, which serializes updates.
+ */
+static void update_top(struct instrument *inst) {
+    struct price_level *bid = book_best_level(&inst->book, BOOK_BUY);
+    struct price_level *ask = book_best_level(&inst->book, BOOK_SELL);
+    unsigned seq = atomic_load_explicit(&inst->top.seq, memory_order_relaxed);
+
+    atomic_store_explicit(&inst->top.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);     // odd seq is seen before the values change
+    atomic_store_explicit(&inst->top.bid, bid ? bid->price : 0, memory_order_relaxed);
+    atomic_store_explicit(&inst->top.ask, ask ? ask->price : 0, memory_order_relaxed);
+    atomic_store_explicit(&inst->top.last, inst->last_trade_set ? inst->last_trade_price : 0,
+                          memory_order_relaxed);
+    atomic_store_explicit(&inst->top.seq, seq + 2, memory_order_release);
+
+    if (inst->depth.words) {
+        update_depth(inst);
+    }
+}
+
+/*
+ * Read a consistent copy of the values published by update_top(), without
+ * taking the instrument mutex.
+ */
+static void read_top(struct instrument *inst, funds_t *bid, funds_t *ask, funds_t *last) {
+    unsigned before, after;
+    do {
+        while ((before = atomic_load_explicit(&inst->top.seq, memory_order_acquire)) & 1) {
+            sched_yield();          // the writer holds the mutex, so may be descheduled
+        }
+        *bid = atomic_load_explicit(&inst->top.bid, memory_order_relaxed);
+        *ask = atomic_load_explicit(&inst->top.ask, memory_order_relaxed);
+        *last = atomic_load_explicit(&inst->top.last, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);  // values are read before seq is checked
+        after = atomic_load_explicit(&inst->top.seq, memory_order_relaxed);
+    } while (before != after);
+}
+
+/*
+ * Queue an order in the book and add it to its account's list of open orders.
+ * Must be called with the instrument mutex held.
+ *
+ * @return 0 if successful, -1 if the book could not allocate memory.
+ */
+static int insert_order(struct instrument *inst, struct order *ordp) {
+    if (book_insert(&inst->book, ordp) == -1) {
+        return -1;
+    }
+    struct order **head = account_open_orders(trader_get_account(ordp->trader), inst->id);
+    ordp->owner_prev = NULL;
+    ordp->owner_next = *head;
+    if (*head) {
+        (*head)->owner_prev = ordp;
+    }
+    *head = ordp;
+    return 0;
+}
+
+/*
+ * Remove an order from the book and from its account's list of open orders.
+ * Must be called with the instrument mutex held.
+ */
+static void remove_order(struct instrument *inst, struct order *ordp) {
+    book_remove(&inst->book, ordp);
+    if (ordp->owner_prev) {
+        ordp->owner_prev->owner_next = ordp->owner_next;
+    } else {
+        *account_open_orders(trader_get_account(ordp->trader), inst->id) = ordp->owner_next;
+    }
+    if (ordp->owner_next) {
+        ordp->owner_next->owner_prev = ordp->owner_prev;
+    }
+    ordp->owner_next = ordp->owner_prev = NULL;
+}
+
+/*
+ * Add a chunk to an instrument's order pool.  The chunk is allocated
+ * without holding the instrument mutex, so the matchmaker and other posters
+ * carry on while it is being set up; the mutex is only taken to splice it in.
+ *
+ * @param inst  The instrument, whose mutex must NOT be held by the caller.
+ * @param wait  Whether to wait if another thread is already growing the
+ * pool (in which case that thread's chunk is used instead).
+ */
+static void grow_pool(struct instrument *inst, bool wait) {
+    if (wait) {
+        pthread_mutex_lock(&inst->grow_mutex);
+    } else if (pthread_mutex_trylock(&inst->grow_mutex) != 0) {
+        return;
+    }
+
+    // Somebody else may have grown the pool while we were waiting
+    pthread_mutex_lock(&inst->mutex);
+    bool wanted = order_pool_wants_chunk(&inst->pool);
+    pthread_mutex_unlock(&inst->mutex);
+
+    if (wanted) {
+        struct order_pool_chunk *chunk = order_pool_chunk_alloc(&inst->pool);
+        if (chunk) {
+            pthread_mutex_lock(&inst->mutex);
+            order_pool_add_chunk(&inst->pool, chunk);
+            pthread_mutex_unlock(&inst->mutex);
+            debug("Order pool for instrument %u grown to %zu orders", inst->id, inst->pool.capacity);
+        }
+    }
+
+    pthread_mutex_unlock(&inst->grow_mutex);
+}
+
+/*
+ * Take an order from the pool, growing the pool if it has run dry.
+ * Called with the instrument mutex held, but the mutex is released and
+ * reacquired if the pool has to grow.
+ *
+ * @return  The new order, or NULL if the soft limit has been reached or
+ * no more memory could be obtained.
+ */
+static struct order *new_order(struct instrument *inst) {
+    struct order *ordp;
+    while (!(ordp = order_pool_get(&inst->pool))) {
+        if (!order_pool_wants_chunk(&inst->pool)) {
+            debug("Order limit reached for instrument %u (%zu orders)", inst->id, inst->pool.in_use);
+            return NULL;
+        }
+        size_t capacity = inst->pool.capacity;
+        pthread_mutex_unlock(&inst->mutex);
+        grow_pool(inst, true);
+        pthread_mutex_lock(&inst->mutex);
+        if (inst->pool.capacity == capacity && !inst->pool.free_list) {
+            return NULL;        // allocation failed
+        }
+    }
+    return ordp;
+}
+
 static quantity_t get_quantity(quantity_t sell, quantity_t buy) {
     return (sell < buy) ? sell : buy;
 }
 
-static void *matchmaker(void *arg) {
-    EXCHANGE *xchg = (EXCHANGE *) arg; // the exchange is supposed to be passed into this thread
+/*
+ * Wake the publisher thread, if it is waiting for events.
+ * Call after pushing events, preferably once the instrument mutex has been
+ * released.  Only costs a system call if the publisher was actually idle.
+ */
+static void wake_publisher(EXCHANGE *xchg) {
+    if (atomic_load(&xchg->publisher_idle) && atomic_exchange(&xchg->publisher_idle, false)) {
+        sem_post(&xchg->publisher_sem);
+    }
+}
 
-    for (;;) {
-        sem_wait(&xchg->sem);
-        
-        for (;;) {
-            pthread_mutex_lock(&xchg->mutex);
-            int i, j;
-            bool found = false;
-
-            // First, find a match
-            for (i = 0; i < MAX_ORDERS; i++) {
-                if (xchg->sell_orders[i]) {
-                    for (j = 0; j < MAX_ORDERS; j++) {
-                        // Check if the trade meets both party req
-                        if (xchg->buy_orders[j] && (xchg->buy_orders[j]->price >= xchg->sell_orders[i]->price)) {
-                            found = true;
-                            break;
-                        }
-                    }
-                }
-                if (found) break;
-            }
+/*
+ * Get a slot for a new event in an instrument's ring.
+ * Must be called with the instrument mutex held, which makes the caller
+ * the ring's only producer; the slot is published by md_ring_commit().
+ * If the ring is full, waits for the publisher to make room.
+ */
+static struct md_event *reserve_event(struct instrument *inst) {
+    struct md_event *ev;
+    while (!(ev = md_ring_reserve(&inst->ring))) {
+        // Publisher has fallen behind: make sure it is running and let it catch up
+        wake_publisher(inst->xchg);
+        sched_yield();
+    }
+    return ev;
+}
 
-            if (!found) {
-                pthread_mutex_unlock(&xchg->mutex);
-                break; // begin waiting again...
-            }
+/*
+ * Queue a POSTED or CANCELED event for an order.
+ * Must be called with the instrument mutex held.
+ */
+static void push_order_event(struct instrument *inst, uint8_t type, BOOK_SIDE side,
+                             orderid_t order_id, quantity_t quantity, funds_t price) {
+    struct md_event *ev = reserve_event(inst);
+    ev->type = type;
+    ev->buyer = ev->seller = NULL;
+    ev->buy_id = (side == BOOK_BUY) ? order_id : 0;
+    ev->sell_id = (side == BOOK_SELL) ? order_id : 0;
+    ev->quantity = quantity;
+    ev->price = price;
+    md_ring_commit(&inst->ring);
+}
 
-            // init vars and get the matched price
-            struct order *sell = xchg->sell_orders[i];
-            struct order *buy = xchg->buy_orders[j];
-            funds_t matched_price = get_price(xchg, sell->price, buy->price);
-            quantity_t matched_quantity = get_quantity(sell->quantity, buy->quantity);
-
-            // Conduct the trade
-            ACCOUNT *sell_acc = trader_get_account(sell->trader);
-            ACCOUNT *buy_acc = trader_get_account(buy->trader);
-            account_increase_inventory(buy_acc, matched_quantity);
-            account_increase_balance(sell_acc, matched_price * matched_quantity);
-
-            // Refund the buyer
-            if (matched_price < buy->price) {
-                account_increase_balance(
-                    buy_acc,
-                    (buy->price - matched_price) * matched_quantity
-                );
-            }
+/*
+ * Record a change to the book in the journal.
+ * Must be called with the instrument mutex held.
+ */
+static void journal_order(struct instrument *inst, JOURNAL_TYPE type, TRADER *trader, BOOK_SIDE side,
+                          orderid_t order_id, quantity_t quantity, funds_t price, int flags) {
+    struct journal_record rec = {
+        .size = sizeof(struct journal_record),
+        .type = type,
+        .side = side,
+        .instrument = inst->id,
+        .account = account_get_id(trader_get_account(trader)),
+        .flags = flags,
+        .order = order_id,
+        .quantity = quantity,
+        .price = price
+    };
+    journal_append(&rec);
+}
 
-            // set last trade
-            xchg->last_trade_set = true;
-            xchg->last_trade_price = matched_price;
+/*
+ * Determine whether the best bid and best ask cross.
+ */
+static bool book_crossed(struct instrument *inst) {
+    struct order *sell = book_best(&inst->book, BOOK_SELL);
+    struct order *buy = book_best(&inst->book, BOOK_BUY);
+    return sell && buy && (buy->price >= sell->price);
+}
 
-            // decrease quantities
-            buy->quantity -= matched_quantity;
-            sell->quantity -= matched_quantity;
+/*
+ * Carry out a trade between a matching buy and sell order.
+ * Must be called with the instrument mutex held.
+ *
+ * @param inst  The instrument.
+ * @param buy  The buy order.
+ * @param sell  The sell order, whose price must not exceed that of the buy order.
+ * One of the orders may be an immediate order that is not in the book.
+ */
+static void execute_trade(struct instrument *inst, struct order *buy, struct order *sell) {
+    // get the matched price
+    funds_t matched_price = get_price(inst, sell->price, buy->price);
+    quantity_t matched_quantity = get_quantity(sell->quantity, buy->quantity);
+
+    // Conduct the trade
+    ACCOUNT *sell_acc = trader_get_account(sell->trader);
+    ACCOUNT *buy_acc = trader_get_account(buy->trader);
+    account_increase_inventory_of(buy_acc, inst->id, matched_quantity);
+    account_increase_balance(sell_acc, matched_price * matched_quantity);
+
+    // Refund the buyer
+    if (matched_price < buy->price) {
+        account_increase_balance(
+            buy_acc,
+            (buy->price - matched_price) * matched_quantity
+        );
+    }
 
-            struct order *free_buy = NULL;
-            if (buy->quantity == 0) {
-                xchg->buy_orders[j] = NULL;
-                free_buy = buy;
-            }
+    // set last trade
+    inst->last_trade_set = true;
+    inst->last_trade_price = matched_price;
+
+    struct journal_record rec = {
+        .size = sizeof(struct journal_record),
+        .type = JOURNAL_TRADE,
+        .instrument = inst->id,
+        .account = account_get_id(buy_acc),
+        .account2 = account_get_id(sell_acc),
+        .order = buy->order_id,
+        .order2 = sell->order_id,
+        .quantity = matched_quantity,
+        .price = matched_price
+    };
+    journal_append(&rec);
+
+    // decrease quantities
+    book_reduce(buy, matched_quantity);
+    book_reduce(sell, matched_quantity);
+
+    struct md_event *ev = reserve_event(inst);
+    ev->type = BRS_TRADED_PKT;
+    ev->buy_id = buy->order_id;
+    ev->sell_id = sell->order_id;
+    ev->quantity = matched_quantity;
+    ev->price = matched_price;
+
+    // A completed order goes back to the pool, and the reference it held on
+    // its trader is handed over to the event.  Otherwise (or if the order
+    // never entered the book) the event takes its own.
+    if (buy->quantity == 0 && buy->level) {
+        ev->buyer = buy->trader;
+        remove_order(inst, buy);
+        order_pool_put(&inst->pool, buy);
+    } else {
+        ev->buyer = trader_ref(buy->trader, "fill");
+    }
 
-            struct order *free_sell = NULL;
-            if (sell->quantity == 0) {
-                xchg->sell_orders[i] = NULL;
-                free_sell = sell;
+    if (sell->quantity == 0 && sell->level) {
+        ev->seller = sell->trader;
+        remove_order(inst, sell);
+        order_pool_put(&inst->pool, sell);
+    } else {
+        ev->seller = trader_ref(sell->trader, "fill");
+    }
+
+    md_ring_commit(&inst->ring);
+}
+
+/*
+ * Trade the best bid against the best ask for as long as they cross,
+ * queueing a TRADED event for each trade.
+ * Must be called with the instrument mutex held.
+ *
+ * @param inst  The instrument.
+ * @param max  No more than this many trades are made.
+ * @return  The number of trades made.
+ */
+static size_t match_crosses(struct instrument *inst, size_t max) {
+    size_t n = 0;
+    while (n < max && book_crossed(inst)) {
+        execute_trade(inst, book_best(&inst->book, BOOK_BUY), book_best(&inst->book, BOOK_SELL));
+        n++;
+    }
+    if (n > 0) {
+        update_top(inst);
+    }
+    return n;
+}
+
+/*
+ * Fill in the header and payload of a notification.  Instrument 0 uses
+ * the original packet types; other instruments use the per-instrument
+ * variants, whose payload carries the instrument.  Types that exist only
+ * as per-instrument notifications (AMENDED_INST) are used as they are.
+ *
+ * @param inst  The instrument the notification is about.
+ * @param type  One of the original notification types (BOUGHT ... TRADED).
+ * @param ts  The timestamp for the header.
+ * @param hdr  The header to be filled in.
+ * @param data  Storage for the payload, large enough for either variant.
+ * @return  A pointer to the payload.
+ */
+static void *make_notify(struct instrument *inst, uint8_t type, struct timespec *ts,
+                         BRS_PACKET_HEADER *hdr, BRS_INST_NOTIFY_INFO *data,
+                         orderid_t buyer, orderid_t seller, quantity_t quantity, funds_t price) {
+    hdr->timestamp_sec = htonl((uint32_t)ts->tv_sec);
+    hdr->timestamp_nsec = htonl((uint32_t)ts->tv_nsec);
+
+    // Notifications with no original counterpart always name the instrument
+    bool extended = (type >= BRS_BOUGHT_INST_PKT);
+    if (inst->id == 0 && !extended) {
+        BRS_NOTIFY_INFO *info = (BRS_NOTIFY_INFO *)data;
+        info->buyer = htonl(buyer);
+        info->seller = htonl(seller);
+        info->quantity = htonl(quantity);
+        info->price = htonl(price);
+        hdr->type = type;
+        hdr->size = htons(sizeof(BRS_NOTIFY_INFO));
+        return info;
+    }
+
+    data->instrument = htons(inst->id);
+    data->reserved = 0;
+    data->buyer = htonl(buyer);
+    data->seller = htonl(seller);
+    data->quantity = htonl(quantity);
+    data->price = htonl(price);
+    hdr->type = extended ? type : BRS_INST_NOTIFY_TYPE(type);
+    hdr->size = htons(sizeof(BRS_INST_NOTIFY_INFO));
+    return data;
+}
+
+/*
+ * An event being broadcast, as seen by admit_event().
+ */
+struct md_broadcast {
+    EXCHANGE *xchg;
+    struct instrument *inst;
+    struct md_event *ev;
+    size_t pos;                     // position of the event in the ring
+};
+
+/*
+ * Add a trade to the summary kept for a conflated trader.
+ */
+static void add_trade(struct md_conflation *md, instrument_t id, struct md_event *ev) {
+    struct md_trades *tr = &md->trades[id];
+    funds_t price = ev->price;
+    if (!(md->traded & ((uint64_t)1 << id))) {
+        md->traded |= (uint64_t)1 << id;
+        memset(tr, 0, sizeof(*tr));
+        tr->first = tr->high = tr->low = price;
+    }
+    tr->count++;
+    tr->quantity += ev->quantity;
+    tr->high = (price > tr->high) ? price : tr->high;
+    tr->low = (price < tr->low) ? price : tr->low;
+    tr->last = price;
+}
+
+/*
+ * Decide whether a trader is sent an event in full, conflating it instead
+ * if the trader's client has fallen behind.
+ */
+static bool admit_event(TRADER *trader, void *arg) {
+    struct md_broadcast *mb = arg;
+    struct md_conflation *md = trader_conflation(trader);
+    instrument_t id = mb->inst->id;
+
+    if (!md->active) {
+        // Already part of the last book the trader was sent, and its trades
+        // of the TRADES_INST sent before it
+        if (mb->pos < md->resume[id]) {
+            return false;
+        }
+        if (trader_backlog(trader) < config.conflate_backlog) {
+            return true;
+        }
+        debug("Conflating market data for trader %p", trader);
+        md->active = true;
+        mb->xchg->nconflated++;
+    }
+
+    md->changed |= (uint64_t)1 << id;
+    if (mb->ev->type == BRS_TRADED_PKT) {
+        add_trade(md, id, mb->ev);
+    }
+    return false;
+}
+
+/*
+ * Send the notifications for one event.  A TRADED event sends BOUGHT to the
+ * buyer, SOLD to the seller and TRADED to everyone, and releases the trader
+ * references it holds; POSTED and CANCELED are broadcast.  Traders whose
+ * clients have fallen behind get only BOUGHT and SOLD (see admit_event()).
+ * With a multicast feed, what would be broadcast is published to it instead.
+ */
+static void publish_event(struct instrument *inst, struct md_event *ev, size_t pos, struct timespec *ts) {
+    BRS_PACKET_HEADER hdr;
+    BRS_INST_NOTIFY_INFO data;
+    void *payload;
+
+    if (ev->type == BRS_TRADED_PKT) {
+        payload = make_notify(inst, BRS_BOUGHT_PKT, ts, &hdr, &data, ev->buy_id, 0, ev->quantity, ev->price);
+        trader_send_packet(ev->buyer, &hdr, payload);
+
+        payload = make_notify(inst, BRS_SOLD_PKT, ts, &hdr, &data, 0, ev->sell_id, ev->quantity, ev->price);
+        trader_send_packet(ev->seller, &hdr, payload);
+    }
+
+    payload = make_notify(inst, ev->type, ts, &hdr, &data, ev->buy_id, ev->sell_id, ev->quantity, ev->price);
+    if (md_feed_enabled()) {
+        md_feed_publish(&hdr, payload);
+    } else if (config.conflate_backlog == 0) {
+        trader_broadcast_packet(&hdr, payload);
+    } else {
+        struct md_broadcast mb = { inst->xchg, inst, ev, pos };
+        trader_broadcast_packet_if(&hdr, payload, admit_event, &mb);
+    }
+
+    if (ev->type == BRS_TRADED_PKT) {
+        trader_unref(ev->buyer, "fill");
+        trader_unref(ev->seller, "fill");
+    }
+}
+
+/*
+ * Publish every event that is waiting in the instruments' rings.
+ *
+ * @return  The number of events published.
+ */
+static size_t drain_rings(EXCHANGE *xchg) {
+    // GET TIME FOR HEADERS
+    struct timespec ts;
+    // `man 2 clock_gettime`
+    // CLOCK_MONOTONIC is a system-wide clock (I tested demo_server and it seems to use this)
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        // perror is set in the Linux manual as such
+        perror("clock_gettime");
+        ts.tv_sec = ts.tv_nsec = 0;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < xchg->ninstruments; i++) {
+        struct instrument *inst = &xchg->instruments[i];
+        struct md_event *ev;
+        while ((ev = md_ring_peek(&inst->ring))) {
+            size_t pos = atomic_load_explicit(&inst->ring.tail, memory_order_relaxed);
+            publish_event(inst, ev, pos, &ts);
+            md_ring_consume(&inst->ring);
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Send a conflated trader what it has missed, if its client has caught up:
+ * a TRADES_INST for each instrument traded and a BOOK_INST for each book
+ * changed.  The books are those last published by update_depth(), which may
+ * already reflect events this thread has yet to send; the trades among
+ * those are counted in the TRADES_INST, and none of them is sent to the
+ * trader afterwards (see admit_event()).
+ */
+static void resume_trader(TRADER *trader, void *arg) {
+    EXCHANGE *xchg = arg;
+    struct md_conflation *md = trader_conflation(trader);
+
+    if (!md->active) {
+        return;
+    }
+    if (trader_backlog(trader) > config.conflate_backlog / 4) {
+        xchg->nconflated++;
+        return;
+    }
+
+    size_t book_size = sizeof(BRS_DEPTH_INFO) + 2 * config.conflate_levels * sizeof(BRS_DEPTH_LEVEL);
+    char *books = malloc(xchg->ninstruments * book_size);
+    if (!books) {
+        xchg->nconflated++;
+        return;
+    }
+    size_t sizes[MAX_INSTRUMENTS], pos[MAX_INSTRUMENTS];
+    for (instrument_t id = 0; id < xchg->ninstruments; id++) {
+        if (!(md->changed & ((uint64_t)1 << id))) {
+            continue;
+        }
+        struct instrument *inst = &xchg->instruments[id];
+        sizes[id] = read_depth(inst, (BRS_DEPTH_INFO *)(books + id * book_size), &pos[id]);
+        // A book older than events already sent cannot be used; try again later
+        if (pos[id] < atomic_load_explicit(&inst->ring.tail, memory_order_relaxed)) {
+            free(books);
+            xchg->nconflated++;
+            return;
+        }
+    }
+
+    // Count the trades a book reflects that are still waiting to be sent
+    for (instrument_t id = 0; id < xchg->ninstruments; id++) {
+        if (!(md->changed & ((uint64_t)1 << id))) {
+            continue;
+        }
+        struct md_ring *ring = &xchg->instruments[id].ring;
+        for (size_t p = atomic_load_explicit(&ring->tail, memory_order_relaxed); p < pos[id]; p++) {
+            struct md_event *ev = &ring->slots[p & ring->mask];
+            if (ev->type == BRS_TRADED_PKT) {
+                add_trade(md, id, ev);
             }
+        }
+    }
 
-            // GET TIME FOR HEADERS
-            struct timespec ts;
-            // `man 2 clock_gettime`
-            // CLOCK_MONOTONIC is a system-wide clock (I tested demo_server and it seems to use this)
-            if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-                // perror is set in the Linux manual as such
-                perror("clock_gettime");
-                pthread_mutex_unlock(&xchg->mutex);
-                if (free_buy) {
-                    trader_unref(free_buy->trader, "order complete");
-                    free(free_buy);
-                }
-                if (free_sell) {
-                    trader_unref(free_sell->trader, "order complete");
-                    free(free_sell);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    BRS_PACKET_HEADER hdr = {
+        .timestamp_sec = htonl((uint32_t)ts.tv_sec),
+        .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
+    };
+
+    for (instrument_t id = 0; id < xchg->ninstruments; id++) {
+        if (!(md->traded & ((uint64_t)1 << id))) {
+            continue;
+        }
+        struct md_trades *tr = &md->trades[id];
+        BRS_TRADES_INFO info = {
+            .instrument = htons(id),
+            .trades = htonl(tr->count),
+            .quantity = htonl(tr->quantity > UINT32_MAX ? UINT32_MAX : tr->quantity),
+            .first = htonl(tr->first),
+            .high = htonl(tr->high),
+            .low = htonl(tr->low),
+            .last = htonl(tr->last)
+        };
+        hdr.type = BRS_TRADES_INST_PKT;
+        hdr.size = htons(sizeof(info));
+        trader_send_packet(trader, &hdr, &info);
+    }
+
+    for (instrument_t id = 0; id < xchg->ninstruments; id++) {
+        if (!(md->changed & ((uint64_t)1 << id))) {
+            continue;
+        }
+        hdr.type = BRS_BOOK_INST_PKT;
+        hdr.size = htons(sizes[id]);
+        trader_send_packet(trader, &hdr, books + id * book_size);
+        md->resume[id] = pos[id];
+    }
+    free(books);
+
+    debug("Resuming full market data for trader %p", trader);
+    md->active = false;
+    md->changed = md->traded = 0;
+}
+
+/*
+ * Look for conflated traders whose clients have caught up, at most once
+ * every CONFLATE_CHECK_NS, and count those still conflated.
+ */
+static void resume_conflated(EXCHANGE *xchg) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (now.tv_sec - xchg->conflate_checked.tv_sec) * 1000000000LL
+                      + (now.tv_nsec - xchg->conflate_checked.tv_nsec);
+    if (elapsed < CONFLATE_CHECK_NS) {
+        return;
+    }
+    xchg->conflate_checked = now;
+    xchg->nconflated = 0;
+    trader_foreach(resume_trader, xchg);
+}
+
+/*
+ * Thread that sends all the market-data notifications, so that neither the
+ * matchmakers nor the threads posting orders ever block on a socket.
+ * Events from one instrument are sent in the order they were queued, so a
+ * POSTED always goes out before any TRADED the order took part in.
+ */
+static void *publisher(void *arg) {
+    EXCHANGE *xchg = arg;
+
+    for (;;) {
+        size_t n = drain_rings(xchg);
+        if (xchg->nconflated > 0) {
+            resume_conflated(xchg);
+        }
+        if (n > 0) {
+            continue;
+        }
+        if (atomic_load(&xchg->publisher_stop)) {
+            break;
+        }
+
+        // Announce that we are going to sleep, then look once more: an event
+        // queued before the announcement is seen here, and the producer of any
+        // later one sees the flag and posts the semaphore.
+        atomic_store(&xchg->publisher_idle, true);
+        if (drain_rings(xchg) == 0 && !atomic_load(&xchg->publisher_stop)) {
+            if (xchg->nconflated == 0) {
+                sem_wait(&xchg->publisher_sem);
+            } else {
+                // Wake up in time to see conflated clients catch up
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += CONFLATE_CHECK_NS;
+                if (until.tv_nsec >= 1000000000) {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
                 }
-                return NULL;
+                sem_timedwait(&xchg->publisher_sem, &until);
             }
+        }
+        atomic_store(&xchg->publisher_idle, false);
+    }
+
+    return NULL;
+}
+
+static void *matchmaker(void *arg) {
+    struct instrument *inst = (struct instrument *) arg; // the instrument is supposed to be passed into this thread
 
-            BRS_NOTIFY_INFO bought_data = {
-                .buyer = htonl(buy->order_id),
-                .seller = 0,
-                .quantity = htonl(matched_quantity),
-                .price = htonl(matched_price)
-            };
-
-            BRS_PACKET_HEADER bought_hdr = { 
-                .type = BRS_BOUGHT_PKT,
-                .size = htons(sizeof(BRS_NOTIFY_INFO)),
-                .timestamp_sec = htonl((uint32_t)ts.tv_sec),
-                .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
-            };
-
-            BRS_NOTIFY_INFO sold_data = {
-                .buyer = 0,
-                .seller = htonl(sell->order_id),
-                .quantity = htonl(matched_quantity),
-                .price = htonl(matched_price)
-            };
-
-            BRS_PACKET_HEADER sold_hdr = { 
-                .type = BRS_SOLD_PKT,
-                .size = htons(sizeof(BRS_NOTIFY_INFO)),
-                .timestamp_sec = htonl((uint32_t)ts.tv_sec),
-                .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
-            };
-
-            BRS_NOTIFY_INFO traded_data = {
-                .buyer = htonl(buy->order_id),
-                .seller = htonl(sell->order_id),
-                .quantity = htonl(matched_quantity),
-                .price = htonl(matched_price)
-            };
-
-            BRS_PACKET_HEADER traded_hdr = { 
-                .type = BRS_TRADED_PKT,
-                .size = htons(sizeof(BRS_NOTIFY_INFO)),
-                .timestamp_sec = htonl((uint32_t)ts.tv_sec),
-                .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
-            };
-
-            pthread_mutex_unlock(&xchg->mutex);
-
-            trader_ref(buy->trader, "matchmaker");
-            trader_ref(sell->trader, "matchmaker");
-
-            trader_send_packet(buy->trader, &bought_hdr, &bought_data);
-            trader_send_packet(sell->trader, &sold_hdr, &sold_data);
-            trader_broadcast_packet(&traded_hdr, &traded_data);
-
-            trader_unref(buy->trader, "matchmaker");
-            trader_unref(sell->trader, "matchmaker");
-
-            if (free_buy) {
-                trader_unref(free_buy->trader, "order complete");
-                free(free_buy);
+    for (;;) {
+        sem_wait(&inst->sem);
+        if (atomic_load(&inst->stop)) {
+            break;
+        }
+
+        // Execute every cross in one hold of the lock; the notifications are
+        // left to the publisher.  The batch is capped so that a long sweep
+        // does not lock out posters; if it fills up, go round again.
+        size_t n;
+        do {
+            pthread_mutex_lock(&inst->mutex);
+            n = match_crosses(inst, config.match_batch);
+            pthread_mutex_unlock(&inst->mutex);
+
+            if (n > 0) {
+                wake_publisher(inst->xchg);
             }
-            if (free_sell) {
-                trader_unref(free_sell->trader, "order complete");
-                free(free_sell);
+        } while (n == config.match_batch);
+    }
+
+    return NULL;
+}
+
+/*
+ * Set up one instrument.  Its matchmaker thread is started separately.
+ *
+ * @return 0 if successful, -1 otherwise (nothing is left to clean up).
+ */
+static int instrument_init(EXCHANGE *xchg, struct instrument *inst, instrument_t id) {
+    inst->id = id;
+    inst->xchg = xchg;
+    inst->last_trade_price = 0;
+    inst->last_trade_set = false;
+    atomic_init(&inst->top.seq, 0);
+    atomic_init(&inst->top.bid, 0);
+    atomic_init(&inst->top.ask, 0);
+    atomic_init(&inst->top.last, 0);
+    atomic_init(&inst->depth.seq, 0);
+    atomic_init(&inst->depth.pos, 0);
+    atomic_init(&inst->depth.nlevels[BOOK_BUY], 0);
+    atomic_init(&inst->depth.nlevels[BOOK_SELL], 0);
+    inst->depth.words = NULL;
+    atomic_init(&inst->stop, false);
+
+    if (md_ring_init(&inst->ring, config.md_ring_size) == -1) {
+        return -1;
+    }
+
+    if (book_init(&inst->book) == -1) {
+        md_ring_fini(&inst->ring);
+        return -1;
+    }
+
+    if (order_pool_init(&inst->pool, config.order_pool_size, config.order_pool_chunk,
+                        config.order_limit, config.order_pool_hugepages) == -1) {
+        book_fini(&inst->book);
+        md_ring_fini(&inst->ring);
+        return -1;
+    }
+
+    if ((sem_init(&inst->sem, 0, 0)) == -1) {
+        order_pool_fini(&inst->pool);
+        book_fini(&inst->book);
+        md_ring_fini(&inst->ring);
+        return -1;
+    }
+
+    if ((pthread_mutex_init(&inst->mutex, NULL)) != 0) {
+        sem_destroy(&inst->sem);
+        order_pool_fini(&inst->pool);
+        book_fini(&inst->book);
+        md_ring_fini(&inst->ring);
+        return -1;
+    }
+    if ((pthread_mutex_init(&inst->grow_mutex, NULL)) != 0) {
+        pthread_mutex_destroy(&inst->mutex);
+        sem_destroy(&inst->sem);
+        order_pool_fini(&inst->pool);
+        book_fini(&inst->book);
+        md_ring_fini(&inst->ring);
+        return -1;
+    }
+
+    // Only traders whose clients fall behind need the depth kept up to date
+    if (config.conflate_backlog > 0) {
+        inst->depth.words = calloc(2 * 3 * config.conflate_levels, sizeof(_Atomic uint32_t));
+        if (!inst->depth.words) {
+            pthread_mutex_destroy(&inst->grow_mutex);
+            pthread_mutex_destroy(&inst->mutex);
+            sem_destroy(&inst->sem);
+            order_pool_fini(&inst->pool);
+            book_fini(&inst->book);
+            md_ring_fini(&inst->ring);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Stop an instrument's matchmaker thread.  It is asked to, rather than
+ * canceled, so that it never stops while holding a lock.
+ */
+static void instrument_stop(struct instrument *inst) {
+    atomic_store(&inst->stop, true);
+    sem_post(&inst->sem);
+    pthread_join(inst->match, NULL);    // wait for thread termination
+}
+
+/*
+ * Release everything an instrument holds, including any orders still
+ * resting in its book.  Its matchmaker and the publisher must have stopped.
+ */
+static void instrument_fini(struct instrument *inst) {
+    pthread_mutex_lock(&inst->mutex);
+
+    info("Instrument %u order pool: %zu of %zu in use at shutdown, high water %zu, %zu chunks",
+         inst->id, inst->pool.in_use, inst->pool.capacity, inst->pool.high_water, inst->pool.nchunks);
+
+    for (int side = BOOK_BUY; side <= BOOK_SELL; side++) {
+        struct order *ordp;
+        while ((ordp = book_best(&inst->book, side))) {
+            remove_order(inst, ordp);
+            if (ordp->trader) {
+                trader_unref(ordp->trader, "exchange_fini");
             }
+            order_pool_put(&inst->pool, ordp);
         }
     }
 
-    return NULL;
+    pthread_mutex_unlock(&inst->mutex);
+
+    order_pool_fini(&inst->pool);
+    book_fini(&inst->book);
+    md_ring_fini(&inst->ring);
+    sem_destroy(&inst->sem);
+    pthread_mutex_destroy(&inst->mutex);
+    pthread_mutex_destroy(&inst->grow_mutex);
+    free((void *)inst->depth.words);
+}
+
+/*
+ * Stop the publisher thread, once it has sent every event still queued.
+ */
+static void publisher_stop(EXCHANGE *xchg) {
+    atomic_store(&xchg->publisher_stop, true);
+    sem_post(&xchg->publisher_sem);
+    pthread_join(xchg->publisher, NULL);
+}
+
+/*
+ * Look up an instrument by ID.
+ *
+ * @return  The instrument, or NULL if the exchange does not trade it.
+ */
+static struct instrument *get_instrument(EXCHANGE *xchg, instrument_t instrument) {
+    return (instrument < xchg->ninstruments) ? &xchg->instruments[instrument] : NULL;
 }
 
 EXCHANGE *exchange_init() {
@@ -224,364 +989,667 @@ EXCHANGE *exchange_init() {
     if (!xchg) {
         return NULL;
     }
-    xchg->last_trade_price = 0;
-    xchg->last_trade_set = false;
-    xchg->next_order_id = 1;
-    
-    memset(xchg->buy_orders, 0, sizeof(xchg->buy_orders));
-    memset(xchg->sell_orders, 0, sizeof(xchg->sell_orders));
-
-    if ((sem_init(&xchg->sem, 0, 0)) == -1) {
+    atomic_init(&xchg->next_order_id, 1);
+    atomic_init(&xchg->publisher_idle, false);
+    atomic_init(&xchg->publisher_stop, false);
+    xchg->nconflated = 0;
+    xchg->conflate_checked.tv_sec = xchg->conflate_checked.tv_nsec = 0;
+
+    xchg->ninstruments = config.instruments;
+    if (xchg->ninstruments == 0 || xchg->ninstruments > MAX_INSTRUMENTS) {
         free(xchg);
         return NULL;
     }
 
-    if ((pthread_mutex_init(&xchg->mutex, NULL)) != 0) {
-        sem_destroy(&xchg->sem);
+    if (sem_init(&xchg->publisher_sem, 0, 0) == -1) {
         free(xchg);
         return NULL;
     }
 
-    if ((pthread_create(&xchg->match, NULL, matchmaker, xchg)) != 0) {
-        sem_destroy(&xchg->sem);
-        pthread_mutex_destroy(&xchg->mutex);
+    void *mem;
+    if (posix_memalign(&mem, 64, xchg->ninstruments * sizeof(struct instrument)) != 0) {
+        sem_destroy(&xchg->publisher_sem);
         free(xchg);
         return NULL;
     }
+    xchg->instruments = mem;
 
-    return xchg;
-}
-
-void exchange_fini(EXCHANGE *xchg) {
-    pthread_cancel(xchg->match);
-    pthread_join(xchg->match, NULL);    // wait for thread termination
-
-    pthread_mutex_lock(&xchg->mutex);
-
-    for (int i = 0; i < MAX_ORDERS; i++) {
-        if (xchg->buy_orders[i]) {
-            if (xchg->buy_orders[i]->trader) {
-                trader_unref(xchg->buy_orders[i]->trader, "exchange_fini");
-            }
-            free(xchg->buy_orders[i]);
+    size_t ninit, nstarted = 0;
+    for (ninit = 0; ninit < xchg->ninstruments; ninit++) {
+        if (instrument_init(xchg, &xchg->instruments[ninit], ninit) == -1) {
+            goto fail;
         }
+    }
+
+    if (pthread_create(&xchg->publisher, NULL, publisher, xchg) != 0) {
+        goto fail;
+    }
 
-        if (xchg->sell_orders[i]) {
-            if (xchg->sell_orders[i]->trader) {
-                trader_unref(xchg->sell_orders[i]->trader, "exchange_fini");
+    for (nstarted = 0; nstarted < xchg->ninstruments; nstarted++) {
+        struct instrument *inst = &xchg->instruments[nstarted];
+        if (pthread_create(&inst->match, NULL, matchmaker, inst) != 0) {
+            while (nstarted-- > 0) {
+                instrument_stop(&xchg->instruments[nstarted]);
             }
-            free(xchg->sell_orders[i]);
+            publisher_stop(xchg);
+            goto fail;
         }
     }
 
-    pthread_mutex_unlock(&xchg->mutex);
+    return xchg;
 
-    sem_destroy(&xchg->sem);
-    pthread_mutex_destroy(&xchg->mutex);
+fail:
+    while (ninit-- > 0) {
+        instrument_fini(&xchg->instruments[ninit]);
+    }
+    free(xchg->instruments);
+    sem_destroy(&xchg->publisher_sem);
+    free(xchg);
+    return NULL;
+}
+
+void exchange_fini(EXCHANGE *xchg) {
+    // Stop matching first, so that the publisher can send everything that
+    // has been queued before it stops too
+    for (size_t i = 0; i < xchg->ninstruments; i++) {
+        instrument_stop(&xchg->instruments[i]);
+    }
+    publisher_stop(xchg);
 
+    for (size_t i = 0; i < xchg->ninstruments; i++) {
+        instrument_fini(&xchg->instruments[i]);
+    }
+    free(xchg->instruments);
+    sem_destroy(&xchg->publisher_sem);
     free(xchg);
 }
 
-void exchange_get_status(EXCHANGE *xchg, ACCOUNT *account, BRS_STATUS_INFO *infop) {
-    pthread_mutex_lock(&xchg->mutex);
+size_t exchange_instruments(EXCHANGE *xchg) {
+    return xchg->ninstruments;
+}
+
+int exchange_get_instrument_status(EXCHANGE *xchg, instrument_t instrument, ACCOUNT *account,
+                                   BRS_STATUS_INFO *infop) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return -1;
+    }
+
     if (account) {
-        account_get_status(account, infop);
+        account_get_status_of(account, instrument, infop);
     } else {
         infop->balance = 0;
         infop->inventory = 0;
     }
 
-    // If there is a last trade price, set that
-    if (xchg->last_trade_set) {
-        infop->last = htonl(xchg->last_trade_price);
-    } else {
-        infop->last = 0;
-    }
-
-    bool bid_set = false, ask_set = false;
-    // Find highest bid / lowest ask
-    for (int i = 0; i < MAX_ORDERS; i++) {
-        if (xchg->buy_orders[i] != NULL) {
-            if (!bid_set) { // bid not set yet
-                infop->bid = htonl(xchg->buy_orders[i]->price);
-                bid_set = true;
-            } 
-            else if (ntohl(infop->bid) < xchg->buy_orders[i]->price) { // bid set and we found a higher bid
-                infop->bid = htonl(xchg->buy_orders[i]->price);
-            }
-        }
-        if (xchg->sell_orders[i] != NULL) {
-            if (!ask_set) { // ask not set yet
-                infop->ask = htonl(xchg->sell_orders[i]->price);
-                ask_set = true;
-            }
-            else if (ntohl(infop->ask) > xchg->sell_orders[i]->price) { // ask set and we found a higher ask
-                infop->ask = htonl(xchg->sell_orders[i]->price);
-            }
+    // Bid, ask and last are published as the book changes
+    funds_t bid, ask, last;
+    read_top(inst, &bid, &ask, &last);
+    infop->bid = htonl(bid);
+    infop->ask = htonl(ask);
+    infop->last = htonl(last);
+    return 0;
+}
+
+void exchange_get_status(EXCHANGE *xchg, ACCOUNT *account, BRS_STATUS_INFO *infop) {
+    exchange_get_instrument_status(xchg, 0, account, infop);
+}
+
+/*
+ * Fill in the best levels of each side of an instrument's book.
+ *
+ * @param inst  The instrument.
+ * @param levels  Most levels to give on each side.
+ * @param infop  Where to put them, with room for 2 * levels levels.
+ * @return  The size of the BRS_DEPTH_INFO filled in.
+ */
+static size_t fill_depth(struct instrument *inst, size_t levels, BRS_DEPTH_INFO *infop) {
+    size_t n[2] = { 0, 0 };
+    BRS_DEPTH_LEVEL *out = infop->levels;
+    pthread_mutex_lock(&inst->mutex);
+    for (int side = BOOK_BUY; side <= BOOK_SELL; side++) {
+        struct price_level *lvl;
+        while (n[side] < levels && (lvl = book_level(&inst->book, side, n[side]))) {
+            out->price = htonl(lvl->price);
+            out->quantity = htonl(lvl->total > UINT32_MAX ? UINT32_MAX : lvl->total);
+            out->orders = htonl(lvl->count);
+            out++;
+            n[side]++;
         }
     }
+    pthread_mutex_unlock(&inst->mutex);
 
-    if (!bid_set) {
-        infop->bid = 0;
+    infop->instrument = htons(inst->id);
+    infop->nbids = htons(n[BOOK_BUY]);
+    infop->nasks = htons(n[BOOK_SELL]);
+    infop->reserved = 0;
+    return sizeof(BRS_DEPTH_INFO) + (n[BOOK_BUY] + n[BOOK_SELL]) * sizeof(BRS_DEPTH_LEVEL);
+}
+
+size_t exchange_get_depth(EXCHANGE *xchg, instrument_t instrument, size_t levels, BRS_DEPTH_INFO *infop) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return 0;
     }
-    if (!ask_set) {
-        infop->ask = 0;
+    return fill_depth(inst, levels, infop);
+}
+
+int exchange_get_pool_stats(EXCHANGE *xchg, instrument_t instrument, struct order_pool_stats *stats) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return -1;
     }
-    pthread_mutex_unlock(&xchg->mutex);
+
+    pthread_mutex_lock(&inst->mutex);
+    order_pool_get_stats(&inst->pool, stats);
+    pthread_mutex_unlock(&inst->mutex);
+    return 0;
 }
 
-orderid_t exchange_post_buy(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price) {
-    if (quantity == 0) {
+orderid_t exchange_post_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader,
+                              BOOK_SIDE side, quantity_t quantity, funds_t price) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst || quantity == 0) {
         return 0;
     }
 
-    pthread_mutex_lock(&xchg->mutex);
-    struct order *ordp = malloc(sizeof(struct order));
+    pthread_mutex_lock(&inst->mutex);
+    struct order *ordp = new_order(inst);
     if (!ordp) {
-        pthread_mutex_unlock(&xchg->mutex);
+        pthread_mutex_unlock(&inst->mutex);
         return 0;
     }
 
     ordp->trader = trader;
     ordp->quantity = quantity;
     ordp->price = price;
+    ordp->side = side;
 
-    trader_ref(trader, "buy order"); // increase ref count for this order
+    trader_ref(trader, "order"); // increase ref count for this order
 
     ACCOUNT *acc = trader_get_account(trader);
-    if ((account_decrease_balance(acc, quantity * price)) == -1) {
-        trader_unref(trader, "buy order error");
-        free(ordp);
-        pthread_mutex_unlock(&xchg->mutex);
+    int err = (side == BOOK_BUY) ? account_decrease_balance(acc, quantity * price)
+                                 : account_decrease_inventory_of(acc, instrument, quantity);
+    if (err == -1) {
+        trader_unref(trader, "order error");
+        order_pool_put(&inst->pool, ordp);
+        pthread_mutex_unlock(&inst->mutex);
         return 0;
     }
 
-    bool posted = false;
-    for (int i = 0; i < MAX_ORDERS; i++) {
-        if (!xchg->buy_orders[i]) {
-            xchg->buy_orders[i] = ordp;
-            ordp->order_id = xchg->next_order_id++;     // set order id then increment the xchg var
-            posted = true;
-            break;
+    ordp->order_id = atomic_fetch_add(&xchg->next_order_id, 1);
+    if (insert_order(inst, ordp) == -1) {
+        if (side == BOOK_BUY) {
+            account_increase_balance(acc, quantity * price);
+        } else {
+            account_increase_inventory_of(acc, instrument, quantity);
         }
-    }
-
-    if (!posted) {
-        account_increase_balance(acc, quantity * price);
-        trader_unref(trader, "buy order error");
-        free(ordp);
-        pthread_mutex_unlock(&xchg->mutex);
+        trader_unref(trader, "order error");
+        order_pool_put(&inst->pool, ordp);
+        pthread_mutex_unlock(&inst->mutex);
         return 0;
     }
 
+    // POSTED is queued before any TRADED the order takes part in
     orderid_t oid = ordp->order_id;
+    journal_order(inst, JOURNAL_POST, trader, side, oid, quantity, price, 0);
+    push_order_event(inst, BRS_POSTED_PKT, side, oid, quantity, price);
+
+    bool wake = true;
+    size_t trades = 0;
+    if (config.match_inline) {
+        // ordp may be completed and recycled here; only oid is used after this
+        trades = match_crosses(inst, INLINE_FILLS_MAX);
+        wake = book_crossed(inst);      // swept more levels than we were prepared to
+    }
+    if (trades == 0) {
+        update_top(inst);               // otherwise already done by match_crosses
+    }
+    bool low = order_pool_wants_chunk(&inst->pool);
 
-    pthread_mutex_unlock(&xchg->mutex);
-
-    sem_post(&xchg->sem);
-
-    BRS_NOTIFY_INFO data = {
-        .buyer = htonl(oid),
-        .seller = 0,
-        .quantity = htonl(quantity),
-        .price = htonl(price)
-    };
+    pthread_mutex_unlock(&inst->mutex);
 
-    // GET TIME FOR HEADER
-    struct timespec ts;
-    // `man 2 clock_gettime`
-    // CLOCK_MONOTONIC is a system-wide clock (I tested demo_server and it seems to use this)
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-        // perror is set in the Linux manual as such
-        perror("clock_gettime");
-        return oid;
+    wake_publisher(xchg);
+    if (wake) {
+        sem_post(&inst->sem);
     }
 
-    BRS_PACKET_HEADER hdr = { 
-        .type = BRS_POSTED_PKT,
-        .size = htons(sizeof(BRS_NOTIFY_INFO)),
-        .timestamp_sec = htonl((uint32_t)ts.tv_sec),
-        .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
-    };
+    // Top up the pool ahead of time, so later posts do not have to wait for it
+    if (low) {
+        grow_pool(inst, false);
+    }
 
-    trader_broadcast_packet(&hdr, &data);
-    
     return oid;
 }
 
-orderid_t exchange_post_sell(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price) {
-    if (quantity == 0) {
+orderid_t exchange_take_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader, BOOK_SIDE side,
+                              quantity_t quantity, funds_t price, int flags, quantity_t *remaining) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst || quantity == 0) {
         return 0;
     }
 
-    pthread_mutex_lock(&xchg->mutex);
-    struct order *ordp = malloc(sizeof(struct order));
-    if (!ordp) {
-        pthread_mutex_unlock(&xchg->mutex);
-        return 0;
-    }
-
-    ordp->trader = trader;
-    ordp->quantity = quantity;
-    ordp->price = price;
+    // The order lives here rather than in the pool, since it never rests
+    BOOK_SIDE other = (side == BOOK_BUY) ? BOOK_SELL : BOOK_BUY;
+    struct order taker = {
+        .trader = trader,
+        .price = price,
+        .quantity = quantity,
+        .side = side
+    };
+    ACCOUNT *acc = trader_get_account(trader);
 
-    trader_ref(trader, "sell order"); // increase ref count for this order
+    pthread_mutex_lock(&inst->mutex);
 
-    ACCOUNT *acc = trader_get_account(trader);
-    if ((account_decrease_inventory(acc, quantity)) == -1) {
-        trader_unref(trader, "sell order error");
-        free(ordp);
-        pthread_mutex_unlock(&xchg->mutex);
+    // Even an order that is killed must be covered, so that FOK and IOC are rejected alike
+    int err = (side == BOOK_BUY) ? account_decrease_balance(acc, quantity * price)
+                                 : account_decrease_inventory_of(acc, instrument, quantity);
+    if (err == -1) {
+        pthread_mutex_unlock(&inst->mutex);
         return 0;
     }
 
-    bool posted = false;
-    for (int i = 0; i < MAX_ORDERS; i++) {
-        if (!xchg->sell_orders[i]) {
-            xchg->sell_orders[i] = ordp;
-            ordp->order_id = xchg->next_order_id++;
-            posted = true;
-            break;
+    taker.order_id = atomic_fetch_add(&xchg->next_order_id, 1);
+    journal_order(inst, JOURNAL_POST, trader, side, taker.order_id, quantity, price, flags);
+
+    // A fill-or-kill order that cannot be filled in full is killed before
+    // anything changes, and recorded as canceled like any remainder below
+    bool kill = (flags & BRS_ORDER_FOK) && book_available(&inst->book, other, price, quantity) < quantity;
+
+    size_t n = 0;
+    struct order *best;
+    while (!kill && taker.quantity > 0 && (best = book_best(&inst->book, other))
+           && (side == BOOK_BUY ? price >= best->price : price <= best->price)) {
+        if (side == BOOK_BUY) {
+            execute_trade(inst, &taker, best);
+        } else {
+            execute_trade(inst, best, &taker);
         }
+        n++;
+    }
+    if (n > 0) {
+        update_top(inst);
     }
 
-    if (!posted) {
-        account_increase_inventory(acc, quantity);
-        trader_unref(trader, "sell order error");
-        free(ordp);
-        pthread_mutex_unlock(&xchg->mutex);
-        return 0;
+    // Return what was not filled, as a cancel would
+    if (taker.quantity > 0) {
+        if (side == BOOK_BUY) {
+            account_increase_balance(acc, taker.quantity * price);
+        } else {
+            account_increase_inventory_of(acc, instrument, taker.quantity);
+        }
+        journal_order(inst, JOURNAL_CANCEL, trader, side, taker.order_id, taker.quantity, price, 0);
     }
+    *remaining = taker.quantity;
 
-    orderid_t oid = ordp->order_id;
+    pthread_mutex_unlock(&inst->mutex);
 
-    pthread_mutex_unlock(&xchg->mutex);
+    if (n > 0) {
+        wake_publisher(xchg);
+    }
+    return taker.order_id;
+}
 
-    sem_post(&xchg->sem);
+orderid_t exchange_post_buy(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price) {
+    return exchange_post_order(xchg, 0, trader, BOOK_BUY, quantity, price);
+}
 
-    BRS_NOTIFY_INFO data = {
-        .buyer = 0,
-        .seller = htonl(oid),
-        .quantity = htonl(quantity),
-        .price = htonl(price)
-    };
+orderid_t exchange_post_sell(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price) {
+    return exchange_post_order(xchg, 0, trader, BOOK_SELL, quantity, price);
+}
 
-    struct timespec ts;
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-        perror("clock_gettime");
-        return oid;
+/*
+ * Cancel a resting order: return what it had encumbered to its account,
+ * take it out of the book, and record and publish the cancel.  The caller
+ * must update the top of the book.
+ * Must be called with the instrument mutex held.
+ *
+ * @param quantity  Pointer to a variable to receive the quantity canceled.
+ * @return  The owner of the order, whose reference (formerly held by the
+ * order) the caller must release.
+ */
+static TRADER *cancel_locked(struct instrument *inst, struct order *ordp, quantity_t *quantity) {
+    TRADER *owner = ordp->trader;
+    ACCOUNT *acc = trader_get_account(owner);
+    if (ordp->side == BOOK_BUY) {
+        // Restore encumbered funds
+        account_increase_balance(acc, ordp->price * ordp->quantity);
+    } else {
+        // Restore encumbered inventory
+        account_increase_inventory_of(acc, inst->id, ordp->quantity);
     }
 
-    BRS_PACKET_HEADER hdr = {
-        .type = BRS_POSTED_PKT,
-        .size = htons(sizeof(BRS_NOTIFY_INFO)),
-        .timestamp_sec = htonl((uint32_t)ts.tv_sec),
-        .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
-    };
+    BOOK_SIDE side = ordp->side;
+    funds_t price = ordp->price;
+    orderid_t order = ordp->order_id;
+    *quantity = ordp->quantity;
+    remove_order(inst, ordp);
+    order_pool_put(&inst->pool, ordp);
+    journal_order(inst, JOURNAL_CANCEL, owner, side, order, *quantity, price, 0);
+    push_order_event(inst, BRS_CANCELED_PKT, side, order, *quantity, price);
+    return owner;
+}
 
-    trader_broadcast_packet(&hdr, &data);
+int exchange_cancel_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader,
+                          orderid_t order, quantity_t *quantity) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return -1;
+    }
 
-    return oid;
+    pthread_mutex_lock(&inst->mutex);
+
+    struct order *ordp = book_find(&inst->book, order);
+    if (!ordp) {
+        pthread_mutex_unlock(&inst->mutex);
+        return -1; // order not found
+    }
+
+    // Is the correct trader trying to cancel the order?  Orders recovered
+    // after a restart are owned by a detached trader for the same account.
+    if (trader_get_account(ordp->trader) != trader_get_account(trader)) {
+        pthread_mutex_unlock(&inst->mutex);
+        return -1;
+    }
+
+    TRADER *owner = cancel_locked(inst, ordp, quantity);
+    update_top(inst);
+
+    pthread_mutex_unlock(&inst->mutex);
+
+    wake_publisher(xchg);
+    trader_unref(owner, "order cancel");
+
+    return 0;
 }
 
-int exchange_cancel(EXCHANGE *xchg, TRADER *trader, orderid_t order, quantity_t *quantity) {
-    pthread_mutex_lock(&xchg->mutex);
-
-    for (int i = 0; i < MAX_ORDERS; i++) {
-        // First, check if we found the order
-        if (xchg->buy_orders[i] && (xchg->buy_orders[i]->order_id == order)) {
-            struct order *ordp = xchg->buy_orders[i]; // for convenience
-            // Is the correct trader trying to cancel the order?
-            if (ordp->trader != trader) {
-                pthread_mutex_unlock(&xchg->mutex);
-                return -1;
-            }
+int exchange_cancel_all(EXCHANGE *xchg, instrument_t instrument, TRADER *trader, size_t *count) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return -1;
+    }
 
-            ACCOUNT *acc = trader_get_account(trader);
-            // Restore encumbered funds
-            account_increase_balance(acc, ordp->price * ordp->quantity);
-
-            BRS_NOTIFY_INFO data = {
-                .buyer = htonl(order),
-                .seller = 0,
-                .quantity = htonl(ordp->quantity),
-                .price = htonl(ordp->price)
-            };
-
-            // GET TIME FOR HEADER
-            struct timespec ts;
-            // `man 2 clock_gettime`
-            // CLOCK_MONOTONIC is a system-wide clock (I tested demo_server and it seems to use this)
-            if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-                pthread_mutex_unlock(&xchg->mutex);
-                // perror is set in the Linux manual as such
-                perror("clock_gettime");
-                return -1;
-            }
+    pthread_mutex_lock(&inst->mutex);
+
+    // Only the account's own orders are visited, never the rest of the book
+    struct order **head = account_open_orders(trader_get_account(trader), instrument);
+    size_t n = 0;
+    while (*head) {
+        quantity_t quantity;
+        // Dropping what may be the last reference frees the trader, which
+        // takes no lock and sends nothing, so it is safe under the mutex
+        trader_unref(cancel_locked(inst, *head, &quantity), "order cancel");
+        n++;
+    }
+    if (n > 0) {
+        update_top(inst);
+    }
 
-            BRS_PACKET_HEADER hdr = { 
-                .type = BRS_CANCELED_PKT,
-                .size = htons(sizeof(BRS_NOTIFY_INFO)),
-                .timestamp_sec = htonl((uint32_t)ts.tv_sec),
-                .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
-            };
+    pthread_mutex_unlock(&inst->mutex);
 
-            *quantity = ordp->quantity;
-            xchg->buy_orders[i] = NULL;
+    if (n > 0) {
+        wake_publisher(xchg);
+    }
+    *count = n;
+    return 0;
+}
+
+int exchange_amend_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader,
+                         orderid_t order, quantity_t quantity, funds_t price,
+                         quantity_t *remaining) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst || quantity == 0) {
+        return -1;
+    }
 
-            pthread_mutex_unlock(&xchg->mutex);
+    pthread_mutex_lock(&inst->mutex);
 
-            trader_unref(ordp->trader, "order cancel");
-            free(ordp);
-            trader_broadcast_packet(&hdr, &data);
+    struct order *ordp = book_find(&inst->book, order);
+    ACCOUNT *acc = trader_get_account(trader);
+    if (!ordp || trader_get_account(ordp->trader) != acc) {
+        pthread_mutex_unlock(&inst->mutex);
+        return -1;
+    }
 
-            return 0;
+    // Only the difference is encumbered or released.  An increase is
+    // encumbered before the book is touched and a decrease released after,
+    // so a failure never leaves anything to be undone that could itself fail.
+    BOOK_SIDE side = ordp->side;
+    funds_t before = (side == BOOK_BUY) ? ordp->price * ordp->quantity : ordp->quantity;
+    funds_t after = (side == BOOK_BUY) ? price * quantity : quantity;
+    if (after > before) {
+        int err = (side == BOOK_BUY) ? account_decrease_balance(acc, after - before)
+                                     : account_decrease_inventory_of(acc, instrument, after - before);
+        if (err == -1) {
+            pthread_mutex_unlock(&inst->mutex);
+            return -1;
         }
-        if (xchg->sell_orders[i] && (xchg->sell_orders[i]->order_id == order)) {
-            struct order *ordp = xchg->sell_orders[i];
+    }
 
-            if (ordp->trader != trader) {
-                pthread_mutex_unlock(&xchg->mutex);
-                return -1;
+    if (book_amend(&inst->book, ordp, quantity, price) == -1) {
+        if (after > before) {
+            if (side == BOOK_BUY) {
+                account_increase_balance(acc, after - before);
+            } else {
+                account_increase_inventory_of(acc, instrument, after - before);
             }
+        }
+        pthread_mutex_unlock(&inst->mutex);
+        return -1;
+    }
+
+    if (after < before) {
+        if (side == BOOK_BUY) {
+            account_increase_balance(acc, before - after);
+        } else {
+            account_increase_inventory_of(acc, instrument, before - after);
+        }
+    }
+
+    journal_order(inst, JOURNAL_AMEND, trader, side, order, quantity, price, 0);
+    push_order_event(inst, BRS_AMENDED_INST_PKT, side, order, quantity, price);
+
+    // A new price may cross the book, just as a new order's can
+    if (!config.match_inline || match_crosses(inst, INLINE_FILLS_MAX) == 0) {
+        update_top(inst);
+    }
+    bool wake = book_crossed(inst);
+
+    // Matching may have filled some or all of it, and freed it if all
+    ordp = book_find(&inst->book, order);
+    *remaining = ordp ? ordp->quantity : 0;
+
+    pthread_mutex_unlock(&inst->mutex);
 
-            ACCOUNT *acc = trader_get_account(trader);
-            account_increase_inventory(acc, ordp->quantity);
-
-            BRS_NOTIFY_INFO data = {
-                .buyer = 0,
-                .seller = htonl(order),
-                .quantity = htonl(ordp->quantity),
-                .price = htonl(ordp->price)
-            };
-
-            struct timespec ts;
-            if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-                pthread_mutex_unlock(&xchg->mutex);
-                perror("clock_gettime");
-                return -1;
+    wake_publisher(xchg);
+    if (wake) {
+        sem_post(&inst->sem);
+    }
+    return 0;
+}
+
+int exchange_cancel(EXCHANGE *xchg, TRADER *trader, orderid_t order, quantity_t *quantity) {
+    return exchange_cancel_order(xchg, 0, trader, order, quantity);
+}
+
+void exchange_lock_all(EXCHANGE *xchg) {
+    for (size_t i = 0; i < xchg->ninstruments; i++) {
+        pthread_mutex_lock(&xchg->instruments[i].mutex);
+    }
+}
+
+void exchange_unlock_all(EXCHANGE *xchg) {
+    for (size_t i = xchg->ninstruments; i-- > 0;) {
+        pthread_mutex_unlock(&xchg->instruments[i].mutex);
+    }
+}
+
+orderid_t exchange_next_order_id(EXCHANGE *xchg) {
+    return atomic_load(&xchg->next_order_id);
+}
+
+int exchange_write_snapshot(EXCHANGE *xchg, struct snapshot_writer *w) {
+    for (size_t i = 0; i < xchg->ninstruments; i++) {
+        struct instrument *inst = &xchg->instruments[i];
+        struct snapshot_instrument rec = {
+            .id = inst->id,
+            .last_trade_set = inst->last_trade_set,
+            .last_trade_price = inst->last_trade_price,
+            .norders = book_count(&inst->book, BOOK_BUY) + book_count(&inst->book, BOOK_SELL)
+        };
+        snapshot_write(w, &rec, sizeof(rec));
+
+        // Best level first, oldest order first, so that reinserting the
+        // orders in this order rebuilds the same queues
+        for (int side = BOOK_BUY; side <= BOOK_SELL; side++) {
+            struct book_side *bs = &inst->book.sides[side];
+            for (size_t l = bs->nlevels; l-- > 0;) {
+                for (struct order *ordp = bs->levels[l]->head; ordp; ordp = ordp->next) {
+                    struct snapshot_order ord = {
+                        .order_id = ordp->order_id,
+                        .account = account_get_id(trader_get_account(ordp->trader)),
+                        .quantity = ordp->quantity,
+                        .price = ordp->price,
+                        .side = side
+                    };
+                    snapshot_write(w, &ord, sizeof(ord));
+                }
             }
+        }
+    }
+    return w->err ? -1 : 0;
+}
+
+int exchange_restore_order(EXCHANGE *xchg, instrument_t instrument, TRADER *trader,
+                           BOOK_SIDE side, orderid_t order, quantity_t quantity, funds_t price) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&inst->mutex);
+    struct order *ordp = new_order(inst);
+    if (!ordp) {
+        pthread_mutex_unlock(&inst->mutex);
+        return -1;
+    }
+    ordp->trader = trader;
+    ordp->quantity = quantity;
+    ordp->price = price;
+    ordp->side = side;
+    ordp->order_id = order;
+    if (insert_order(inst, ordp) == -1) {
+        order_pool_put(&inst->pool, ordp);
+        pthread_mutex_unlock(&inst->mutex);
+        return -1;
+    }
+    trader_ref(trader, "order");
+    update_top(inst);
+    pthread_mutex_unlock(&inst->mutex);
+    return 0;
+}
 
-            BRS_PACKET_HEADER hdr = {
-                .type = BRS_CANCELED_PKT,
-                .size = htons(sizeof(BRS_NOTIFY_INFO)),
-                .timestamp_sec = htonl((uint32_t)ts.tv_sec),
-                .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
-            };
+int exchange_restore_cancel(EXCHANGE *xchg, instrument_t instrument, orderid_t order,
+                            quantity_t *quantity) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return -1;
+    }
 
-            *quantity = ordp->quantity;
-            xchg->sell_orders[i] = NULL;
+    pthread_mutex_lock(&inst->mutex);
+    struct order *ordp = book_find(&inst->book, order);
+    if (!ordp) {
+        pthread_mutex_unlock(&inst->mutex);
+        return -1;
+    }
+    TRADER *trader = ordp->trader;
+    *quantity = ordp->quantity;
+    remove_order(inst, ordp);
+    order_pool_put(&inst->pool, ordp);
+    update_top(inst);
+    pthread_mutex_unlock(&inst->mutex);
+
+    trader_unref(trader, "order cancel");
+    return 0;
+}
 
-            pthread_mutex_unlock(&xchg->mutex);
+int exchange_restore_amend(EXCHANGE *xchg, instrument_t instrument, orderid_t order,
+                           quantity_t quantity, funds_t price,
+                           quantity_t *old_quantity, funds_t *old_price) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return -1;
+    }
 
-            trader_unref(ordp->trader, "order cancel");
-            free(ordp);
-            trader_broadcast_packet(&hdr, &data);
+    pthread_mutex_lock(&inst->mutex);
+    struct order *ordp = book_find(&inst->book, order);
+    if (!ordp) {
+        pthread_mutex_unlock(&inst->mutex);
+        return -1;
+    }
+    *old_quantity = ordp->quantity;
+    *old_price = ordp->price;
+    int ret = book_amend(&inst->book, ordp, quantity, price);
+    update_top(inst);
+    pthread_mutex_unlock(&inst->mutex);
+    return ret;
+}
+
+int exchange_restore_trade(EXCHANGE *xchg, instrument_t instrument, orderid_t buy, orderid_t sell,
+                           quantity_t quantity, funds_t price, funds_t *buy_price) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return -1;
+    }
 
-            return 0;
+    pthread_mutex_lock(&inst->mutex);
+    struct order *orders[2] = { book_find(&inst->book, buy), book_find(&inst->book, sell) };
+    if (!orders[0] || !orders[1] || orders[0]->quantity < quantity || orders[1]->quantity < quantity) {
+        pthread_mutex_unlock(&inst->mutex);
+        return -1;
+    }
+    *buy_price = orders[0]->price;
+
+    TRADER *done[2] = { NULL, NULL };
+    for (int i = 0; i < 2; i++) {
+        book_reduce(orders[i], quantity);
+        if (orders[i]->quantity == 0) {
+            done[i] = orders[i]->trader;
+            remove_order(inst, orders[i]);
+            order_pool_put(&inst->pool, orders[i]);
+        }
+    }
+    inst->last_trade_set = true;
+    inst->last_trade_price = price;
+    update_top(inst);
+    pthread_mutex_unlock(&inst->mutex);
+
+    for (int i = 0; i < 2; i++) {
+        if (done[i]) {
+            trader_unref(done[i], "fill");
         }
     }
+    return 0;
+}
+
+void exchange_restore_last_trade(EXCHANGE *xchg, instrument_t instrument, funds_t price) {
+    struct instrument *inst = get_instrument(xchg, instrument);
+    if (!inst) {
+        return;
+    }
 
-    pthread_mutex_unlock(&xchg->mutex);
-    return -1; // order not found
-}
\ No newline at end of file
+    pthread_mutex_lock(&inst->mutex);
+    inst->last_trade_set = true;
+    inst->last_trade_price = price;
+    update_top(inst);
+    pthread_mutex_unlock(&inst->mutex);
+}
+
+void exchange_restore_done(EXCHANGE *xchg, orderid_t next_order_id) {
+    if (next_order_id > atomic_load(&xchg->next_order_id)) {
+        atomic_store(&xchg->next_order_id, next_order_id);
+    }
+    for (size_t i = 0; i < xchg->ninstruments; i++) {
+        sem_post(&xchg->instruments[i].sem);
+    }
+}
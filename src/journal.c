@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+#include "config.h"
+#include "debug.h"
+
+#define SPARE_NAME "journal-next.tmp"
+
+/*
+ * Longest time an append waits for the flusher to provide a new segment.
+ */
+#define SPARE_WAIT_NS 100000000
+
+/*
+ * One segment file, mapped in its entirety.
+ */
+struct segment {
+    struct segment *next;           // link in the list of retired segments
+    int fd;
+    char *base;
+    size_t size;
+    size_t used;                    // bytes appended, including the header
+    size_t synced;                  // bytes known to be on disk
+};
+
+static struct {
+    bool enabled;
+    pthread_mutex_t mutex;          // protects everything below
+    pthread_cond_t cond;            // wakes the flusher
+    pthread_cond_t spare_cond;      // signaled when a spare is ready or the segment changes
+    pthread_t flusher;
+    bool stop;
+    struct segment *cur;            // segment being appended to
+    struct segment *spare;          // created ahead of time by the flusher
+    bool spare_wanted;              // an append is waiting for the spare
+    struct segment *retired;        // full segments, still to be synced and closed
+    uint64_t next_seq;
+    uint64_t next_segment;
+    uint64_t pending;               // records appended since the last sync started
+    struct timespec start;
+    struct journal_stats stats;
+} journal;
+
+static uint64_t elapsed_ns(struct timespec *from, struct timespec *to) {
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000 + to->tv_nsec - from->tv_nsec;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c >> 1) ^ (0x82f63b78 & -(c & 1));     // CRC-32C (Castagnoli), reflected
+        }
+        crc_table[i] = c;
+    }
+}
+
+/*
+ * Compute the CRC of a record, as if its crc field were zero.
+ */
+static uint32_t record_crc(const struct journal_record *rec) {
+    const uint8_t *p = (const uint8_t *)rec;
+    size_t skip = offsetof(struct journal_record, crc);
+    uint32_t c = ~0u;
+    for (size_t i = 0; i < rec->size; i++) {
+        uint8_t b = (i >= skip && i < skip + sizeof(rec->crc)) ? 0 : p[i];
+        c = crc_table[(c ^ b) & 0xff] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+/*
+ * Sync the part of a segment between two offsets.
+ */
+static void segment_sync(struct segment *seg, size_t from, size_t to) {
+    static size_t page_size;
+    if (!page_size) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    if (to <= from) {
+        return;
+    }
+    size_t start = from & ~(page_size - 1);
+    if (msync(seg->base + start, to - start, MS_SYNC) == -1) {
+        error("msync of journal failed: %s", strerror(errno));
+    }
+}
+
+/*
+ * Create, preallocate and map a segment file.
+ *
+ * @param name  The name of the file, within config.journal_dir.
+ * @return  The segment, or NULL if it could not be created.
+ */
+static struct segment *segment_create(const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", config.journal_dir, name);
+
+    struct segment *seg = calloc(1, sizeof(struct segment));
+    if (!seg) {
+        return NULL;
+    }
+    seg->size = config.journal_segment_size;
+
+    if ((seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+        error("Cannot create journal segment %s: %s", path, strerror(errno));
+        free(seg);
+        return NULL;
+    }
+
+    // Allocate all the blocks now, so that appending never extends the file
+    int err;
+    if ((err = posix_fallocate(seg->fd, 0, seg->size)) != 0) {
+        error("Cannot preallocate journal segment %s: %s", path, strerror(err));
+        close(seg->fd);
+        unlink(path);
+        free(seg);
+        return NULL;
+    }
+
+    seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->base == MAP_FAILED) {
+        error("Cannot map journal segment %s: %s", path, strerror(errno));
+        close(seg->fd);
+        unlink(path);
+        free(seg);
+        return NULL;
+    }
+
+    seg->used = seg->synced = sizeof(struct journal_segment_header);
+    return seg;
+}
+
+/*
+ * Give a new segment its number and first sequence number, renaming it from
+ * the spare name if necessary.  Called with the journal mutex held.
+ */
+static void segment_activate(struct segment *seg, bool spare) {
+    uint64_t number = journal.next_segment++;
+    char name[64];
+    snprintf(name, sizeof(name), "journal-%06lu.log", (unsigned long)number);
+
+    if (spare) {
+        char from[PATH_MAX], to[PATH_MAX];
+        snprintf(from, sizeof(from), "%s/%s", config.journal_dir, SPARE_NAME);
+        snprintf(to, sizeof(to), "%s/%s", config.journal_dir, name);
+        if (rename(from, to) == -1) {
+            error("Cannot rename journal segment %s: %s", from, strerror(errno));
+        }
+    }
+
+    struct journal_segment_header *hdr = (struct journal_segment_header *)seg->base;
+    memcpy(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic));
+    hdr->segment = number;
+    hdr->first_seq = journal.next_seq;
+    hdr->size = seg->size;
+    seg->synced = 0;                // header has to be synced with the first records
+    journal.stats.segments++;
+}
+
+static void segment_close(struct segment *seg) {
+    munmap(seg->base, seg->size);
+    close(seg->fd);
+    free(seg);
+}
+
+/*
+ * Switch to the spare segment because the current one is full.  If the
+ * flusher has not got the spare ready, wait briefly for it: creating a
+ * segment here would hold up the caller, and every thread waiting on the
+ * caller's locks, while the file is allocated.  Only if the spare is not
+ * ready in time is a segment created here after all, since the change being
+ * recorded must not go ahead unrecorded.  Another thread may switch segments
+ * during the wait, so the caller must check for room again.
+ * Called with the journal mutex held.
+ *
+ * @return 0 if successful, -1 if no new segment could be had.
+ */
+static int segment_roll(void) {
+    struct segment *full = journal.cur;
+    if (!journal.spare) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SPARE_WAIT_NS;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        journal.spare_wanted = true;
+        pthread_cond_signal(&journal.cond);
+        while (!journal.spare && journal.cur == full) {
+            if (pthread_cond_timedwait(&journal.spare_cond, &journal.mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (journal.cur != full) {
+            return 0;
+        }
+    }
+    struct segment *seg = journal.spare;
+    bool spare = (seg != NULL);
+    if (spare) {
+        journal.spare = NULL;
+    } else {
+        warn("No spare journal segment was ready; creating one while appending");
+        char name[64];
+        snprintf(name, sizeof(name), "journal-%06lu.log", (unsigned long)journal.next_segment);
+        if (!(seg = segment_create(name))) {
+            return -1;
+        }
+    }
+    segment_activate(seg, spare);
+
+    // The flusher syncs and closes the old segment, and prepares another spare
+    full->next = journal.retired;
+    journal.retired = full;
+    journal.cur = seg;
+    pthread_cond_signal(&journal.cond);
+    pthread_cond_broadcast(&journal.spare_cond);
+    return 0;
+}
+
+/*
+ * Thread that makes appended records durable, a group at a time.
+ */
+static void *flusher(void *arg) {
+    pthread_mutex_lock(&journal.mutex);
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(config.journal_interval_us % 1000000) * 1000;
+        deadline.tv_sec += config.journal_interval_us / 1000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        while (!journal.stop && journal.pending < config.journal_batch && !journal.retired
+               && !journal.spare_wanted) {
+            if (pthread_cond_timedwait(&journal.cond, &journal.mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        // Take what has to be synced, then sync it without holding the mutex
+        struct segment *retired = journal.retired;
+        struct segment *cur = journal.cur;
+        size_t from = cur->synced, to = cur->used;
+        uint64_t seq = journal.stats.last_seq;
+        uint64_t group = journal.pending;
+        bool need_spare = !journal.spare;
+        bool stopping = journal.stop;
+        journal.retired = NULL;
+        journal.spare_wanted = false;
+        journal.pending = 0;
+        pthread_mutex_unlock(&journal.mutex);
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        while (retired) {
+            struct segment *seg = retired;
+            retired = seg->next;
+            segment_sync(seg, seg->synced, seg->used);
+            segment_close(seg);
+        }
+        segment_sync(cur, from, to);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        // Have the next segment ready before the current one fills up
+        struct segment *spare = NULL;
+        if (need_spare && !stopping) {
+            spare = segment_create(SPARE_NAME);
+        }
+
+        pthread_mutex_lock(&journal.mutex);
+        cur->synced = to;
+        if (group > 0) {
+            journal.stats.syncs++;
+            journal.stats.sync_ns += elapsed_ns(&t0, &t1);
+            if (group > journal.stats.max_group) {
+                journal.stats.max_group = group;
+            }
+        }
+        journal.stats.durable_seq = seq;
+        if (spare) {
+            journal.spare = spare;
+            pthread_cond_broadcast(&journal.spare_cond);
+        }
+        if (stopping) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&journal.mutex);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * List the numbers of the segment files in the journal directory.
+ *
+ * @param countp  Pointer to a variable to receive the number of segments.
+ * @return  The numbers in ascending order (to be freed by the caller),
+ * or NULL if there are none or the directory cannot be read.
+ */
+static uint64_t *list_segments(size_t *countp) {
+    *countp = 0;
+    DIR *dir = opendir(config.journal_dir);
+    if (!dir) {
+        return NULL;
+    }
+
+    uint64_t *numbers = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        unsigned long n;
+        char end;
+        if (sscanf(ent->d_name, "journal-%lu.lo%c", &n, &end) != 2 || end != 'g') {
+            continue;
+        }
+        if (count == cap) {
+            uint64_t *tmp = realloc(numbers, (cap = cap ? 2 * cap : 16) * sizeof(uint64_t));
+            if (!tmp) {
+                break;
+            }
+            numbers = tmp;
+        }
+        numbers[count++] = n;
+    }
+    closedir(dir);
+
+    if (count == 0) {
+        free(numbers);
+        return NULL;
+    }
+    qsort(numbers, count, sizeof(uint64_t), compare_u64);
+    *countp = count;
+    return numbers;
+}
+
+/*
+ * Read the header of a segment file.
+ *
+ * @return 0 if successful, -1 if the file cannot be read or is not a segment.
+ */
+static int read_segment_header(uint64_t number, struct journal_segment_header *hdr) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/journal-%06lu.log", config.journal_dir, (unsigned long)number);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, hdr, sizeof(*hdr));
+    close(fd);
+    if (n != sizeof(*hdr) || memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find the highest segment number among the files already in the journal
+ * directory, and remove any spare left over from an earlier run.
+ */
+static uint64_t last_segment_number(void) {
+    size_t count;
+    uint64_t *numbers = list_segments(&count);
+    uint64_t last = numbers ? numbers[count - 1] : 0;
+    free(numbers);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", config.journal_dir, SPARE_NAME);
+    unlink(path);
+    return last;
+}
+
+int journal_init(uint64_t first_seq) {
+    memset(&journal, 0, sizeof(journal));
+    if (!config.journal_dir) {
+        return 0;
+    }
+
+    pthread_once(&crc_once, crc_init);
+    pthread_mutex_init(&journal.mutex, NULL);
+    pthread_cond_init(&journal.cond, NULL);
+    pthread_cond_init(&journal.spare_cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &journal.start);
+    journal.next_seq = first_seq;
+    journal.stats.last_seq = journal.stats.durable_seq = first_seq - 1;
+    journal.next_segment = last_segment_number() + 1;
+
+    char name[64];
+    snprintf(name, sizeof(name), "journal-%06lu.log", (unsigned long)journal.next_segment);
+    if (!(journal.cur = segment_create(name))) {
+        pthread_mutex_destroy(&journal.mutex);
+        pthread_cond_destroy(&journal.cond);
+        pthread_cond_destroy(&journal.spare_cond);
+        return -1;
+    }
+    segment_activate(journal.cur, false);
+
+    if (pthread_create(&journal.flusher, NULL, flusher, NULL) != 0) {
+        segment_close(journal.cur);
+        pthread_mutex_destroy(&journal.mutex);
+        pthread_cond_destroy(&journal.cond);
+        pthread_cond_destroy(&journal.spare_cond);
+        return -1;
+    }
+
+    journal.enabled = true;
+    return 0;
+}
+
+void journal_fini(void) {
+    if (!journal.enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal.mutex);
+    journal.stop = true;
+    pthread_cond_signal(&journal.cond);
+    pthread_mutex_unlock(&journal.mutex);
+    pthread_join(journal.flusher, NULL);    // syncs everything before it returns
+
+    struct journal_stats stats;
+    journal_get_stats(&stats);
+    info("Journal: %lu records, %lu bytes in %.3fs (%.0f records/s), %lu syncs "
+         "(avg %.1f records, max %lu, avg %.1fus), %lu segments",
+         (unsigned long)stats.records, (unsigned long)stats.bytes, stats.elapsed_ns / 1e9,
+         stats.elapsed_ns ? stats.records * 1e9 / stats.elapsed_ns : 0.0, (unsigned long)stats.syncs,
+         stats.syncs ? (double)stats.records / stats.syncs : 0.0, (unsigned long)stats.max_group,
+         stats.syncs ? stats.sync_ns / 1e3 / stats.syncs : 0.0, (unsigned long)stats.segments);
+
+    segment_close(journal.cur);
+    if (journal.spare) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", config.journal_dir, SPARE_NAME);
+        segment_close(journal.spare);
+        unlink(path);
+    }
+    pthread_mutex_destroy(&journal.mutex);
+    pthread_cond_destroy(&journal.cond);
+    pthread_cond_destroy(&journal.spare_cond);
+    journal.enabled = false;
+}
+
+int journal_enabled(void) {
+    return journal.enabled;
+}
+
+uint64_t journal_append(struct journal_record *rec) {
+    if (!journal.enabled) {
+        return 0;
+    }
+
+    size_t size = rec->size;
+    if (sizeof(struct journal_segment_header) + size > config.journal_segment_size) {
+        error("Journal record of %zu bytes does not fit in a segment", size);
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal.mutex);
+    while (journal.cur->used + size > journal.cur->size) {
+        // The caller has made, or is about to make, the change this records;
+        // carrying on without it would leave the journal silently incomplete
+        if (segment_roll() == -1) {
+            error("Journal cannot be written; stopping");
+            abort();
+        }
+    }
+
+    uint64_t seq = journal.next_seq++;
+    rec->seq = seq;
+    rec->crc = record_crc(rec);
+    memcpy(journal.cur->base + journal.cur->used, rec, size);
+    journal.cur->used += size;
+
+    journal.stats.records++;
+    journal.stats.bytes += size;
+    journal.stats.last_seq = seq;
+
+    // Only wake the flusher early once a whole group is waiting
+    if (++journal.pending == config.journal_batch) {
+        pthread_cond_signal(&journal.cond);
+    }
+
+    pthread_mutex_unlock(&journal.mutex);
+    return seq;
+}
+
+int journal_replay(uint64_t after, journal_replay_fn fn, void *arg, uint64_t *last) {
+    *last = after;
+    pthread_once(&crc_once, crc_init);
+    size_t count;
+    uint64_t *numbers = list_segments(&count);
+    if (!numbers) {
+        return 0;
+    }
+
+    int ret = 0;
+    bool done = false;
+    for (size_t i = 0; i < count && !done && ret == 0; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/journal-%06lu.log", config.journal_dir, (unsigned long)numbers[i]);
+
+        struct journal_segment_header hdr;
+        if (read_segment_header(numbers[i], &hdr) == -1) {
+            error("Journal segment %s is damaged", path);
+            ret = -1;
+            break;
+        }
+        // Skip segments whose records all precede the snapshot
+        if (i + 1 < count) {
+            struct journal_segment_header next;
+            if (read_segment_header(numbers[i + 1], &next) == 0 && next.first_seq <= after + 1) {
+                continue;
+            }
+        }
+        if (hdr.first_seq > *last + 1) {
+            error("Journal records %lu to %lu are missing", (unsigned long)(*last + 1),
+                  (unsigned long)(hdr.first_seq - 1));
+            ret = -1;
+            break;
+        }
+
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            ret = -1;
+            break;
+        }
+        char *base = mmap(NULL, hdr.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            ret = -1;
+            break;
+        }
+
+        // Records are contiguous and numbered consecutively; the first one that
+        // is unused, out of sequence or fails its CRC marks where writing stopped
+        uint64_t expect = hdr.first_seq;
+        size_t off = sizeof(struct journal_segment_header);
+        for (;;) {
+            struct journal_record *rec = (struct journal_record *)(base + off);
+            if (off + sizeof(struct journal_record) > hdr.size || rec->size < sizeof(struct journal_record)
+                || off + rec->size > hdr.size || rec->seq != expect) {
+                // A segment that stopped short was the last one written to,
+                // unless a later run has started a new one after it
+                done = (i + 1 == count);
+                break;
+            }
+            if (rec->crc != record_crc(rec)) {
+                warn("Journal record %lu in %s is damaged; replay stops before it", (unsigned long)expect, path);
+                done = (i + 1 == count);
+                break;
+            }
+            if (rec->seq > after) {
+                if (fn(rec, arg) == -1) {
+                    ret = -1;
+                    break;
+                }
+                *last = rec->seq;
+            }
+            off += rec->size;
+            expect++;
+        }
+        munmap(base, hdr.size);
+    }
+
+    free(numbers);
+    return ret;
+}
+
+void journal_prune(uint64_t seq) {
+    size_t count;
+    uint64_t *numbers = list_segments(&count);
+    if (!numbers) {
+        return;
+    }
+
+    // A segment can go once the segment after it starts no later than seq + 1
+    for (size_t i = 0; i + 1 < count; i++) {
+        struct journal_segment_header next;
+        if (read_segment_header(numbers[i + 1], &next) == -1 || next.first_seq > seq + 1) {
+            break;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/journal-%06lu.log", config.journal_dir, (unsigned long)numbers[i]);
+        unlink(path);
+        debug("Pruned journal segment %s", path);
+    }
+    free(numbers);
+}
+
+void journal_get_stats(struct journal_stats *stats) {
+    if (!journal.enabled) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&journal.mutex);
+    *stats = journal.stats;
+    pthread_mutex_unlock(&journal.mutex);
+    stats->elapsed_ns = elapsed_ns(&journal.start, &now);
+}
@@ -13,6 +13,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "client_registry.h"
@@ -21,6 +22,11 @@
 #include "trader.h"
 #include "debug.h"
 #include "server.h"
+#include "config.h"
+#include "protocol_ext.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "md_feed.h"
 
 extern EXCHANGE *exchange;
 extern CLIENT_REGISTRY *client_registry;
@@ -36,7 +42,41 @@ void sighup_handler(int sig) {
 /*
  * "Bourse" exchange server.
  *
- * Usage: bourse <port>
+ * Usage: bourse -p <port> [-o <orders>] [-c <orders>] [-L <limit>] [-H] [-A] [-B <batch>] [-R <events>]
+ *               [-I <instruments>] [-J <dir>] [-G <usec>] [-g <records>] [-S <secs>] [-C]
+ *               [-W <bytes>] [-Q <bytes>] [-D <levels>] [-T <traders>]
+ *               [-M <group>:<port>] [-i <address>] [-K <datagrams>]
+ *
+ *   -o <orders>  Number of orders to preallocate in the exchange's order pool.
+ *   -c <orders>  Number of orders added each time the pool grows.
+ *   -L <limit>   Most orders that may rest on the exchange at once (0 = no limit).
+ *   -H           Back the order pool with huge pages, if available.
+ *   -A           Leave all matching to the matchmaker thread, instead of
+ *                matching incoming orders as they are posted.
+ *   -B <batch>   Most trades the matchmaker makes in one hold of the book lock.
+ *   -R <events>  Market-data events that may be queued for the publisher thread,
+ *                per instrument (a power of two).
+ *   -I <instruments>  Number of instruments to trade (1 to MAX_INSTRUMENTS).
+ *                Each has its own order pool, sized by -o and -L.
+ *   -J <dir>     Keep a journal of every change to the exchange in this directory.
+ *   -G <usec>    Longest time a journal record may wait to be synced to disk.
+ *   -g <records> Number of pending journal records that causes an early sync.
+ *   -S <secs>    Interval between snapshots of the exchange, taken with -J
+ *                (0 = only at shutdown).  On startup, the state is recovered
+ *                from the latest snapshot and the journal that follows it.
+ *   -C           Cancel all of a trader's open orders when it disconnects.
+ *   -W <bytes>   Most bytes that may be queued for a client whose socket
+ *                cannot take them; a client that falls further behind is cut off.
+ *   -Q <bytes>   Switch a client to conflated market data once this many bytes
+ *                are queued for it (0 = never, the default).
+ *   -D <levels>  Levels of each side of a book sent to a conflated client.
+ *   -T <traders> Most traders that may be logged in at once.
+ *   -M <group>:<port>  Publish market data as UDP multicast datagrams to this
+ *                group, instead of over each client's connection.
+ *   -i <address> Address of the interface to send the datagrams from, such
+ *                as 127.0.0.1 for subscribers on this host only.
+ *   -K <datagrams>  Datagrams kept for clients that ask for them again
+ *                (a power of two).
  */
 int main(int argc, char* argv[]) {
     // Signal Handling Installation
@@ -53,18 +93,148 @@ int main(int argc, char* argv[]) {
     bool pflag = false;
     int c;
 
-    while ((c = getopt(argc, argv, ":p:")) != -1) {
+    while ((c = getopt(argc, argv, ":p:o:c:L:HAB:R:I:J:G:g:S:CW:Q:D:T:M:i:K:")) != -1) {
         switch (c) {
         case 'p':
             pflag = true;
             port = atoi(optarg);
             break;
+        case 'o':
+            config.order_pool_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            config.order_pool_chunk = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            config.order_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'H':
+            config.order_pool_hugepages = true;
+            break;
+        case 'A':
+            config.match_inline = false;
+            break;
+        case 'B':
+            config.match_batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            config.md_ring_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'I':
+            config.instruments = strtoul(optarg, NULL, 10);
+            break;
+        case 'J':
+            config.journal_dir = optarg;
+            break;
+        case 'G':
+            config.journal_interval_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            config.journal_batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            config.snapshot_interval = strtoul(optarg, NULL, 10);
+            break;
+        case 'C':
+            config.cancel_on_disconnect = true;
+            break;
+        case 'W':
+            config.out_queue_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'Q':
+            config.conflate_backlog = strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            config.conflate_levels = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            config.max_traders = strtoul(optarg, NULL, 10);
+            break;
+        case 'M': {
+            char *colon = strrchr(optarg, ':');
+            if (colon) {
+                *colon = '\0';
+                config.md_port = strtoul(colon + 1, NULL, 10);
+            }
+            config.md_group = optarg;
+            break;
+        }
+        case 'i':
+            config.md_interface = optarg;
+            break;
+        case 'K':
+            config.md_history = strtoul(optarg, NULL, 10);
+            break;
         }
     }
 
     // -p is required
     if (!pflag) {
-        fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s -p <port> [-o <orders>] [-c <orders>] [-L <limit>] [-H] [-A] [-B <batch>] [-R <events>]\n"
+                        "       [-I <instruments>] [-J <dir>] [-G <usec>] [-g <records>] [-S <secs>] [-C]\n"
+                        "       [-W <bytes>] [-Q <bytes>] [-D <levels>] [-T <traders>]\n"
+                        "       [-M <group>:<port>] [-i <address>] [-K <datagrams>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.order_pool_size == 0) {
+        fprintf(stderr, "Invalid order pool size.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.order_pool_chunk == 0) {
+        fprintf(stderr, "Invalid order pool chunk size.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.match_batch == 0) {
+        fprintf(stderr, "Invalid match batch size.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.md_ring_size == 0 || (config.md_ring_size & (config.md_ring_size - 1)) != 0) {
+        fprintf(stderr, "Market-data ring size must be a power of two.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.instruments == 0 || config.instruments > MAX_INSTRUMENTS) {
+        fprintf(stderr, "Number of instruments must be between 1 and %d.\n", MAX_INSTRUMENTS);
+        exit(EXIT_FAILURE);
+    }
+
+    // The queue must hold at least the largest packet
+    if (config.out_queue_size < sizeof(BRS_PACKET_HEADER) + UINT16_MAX) {
+        fprintf(stderr, "Output queue size must be at least %zu bytes.\n", sizeof(BRS_PACKET_HEADER) + UINT16_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.conflate_backlog >= config.out_queue_size) {
+        fprintf(stderr, "Conflation backlog must be less than the output queue size.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.conflate_levels == 0 || config.conflate_levels > BRS_DEPTH_MAX_LEVELS) {
+        fprintf(stderr, "Conflated book levels must be between 1 and %d.\n", BRS_DEPTH_MAX_LEVELS);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.max_traders == 0) {
+        fprintf(stderr, "Invalid number of traders.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.md_group && (config.md_port == 0 || config.md_port > 65535)) {
+        fprintf(stderr, "Market-data group must be given as <group>:<port>.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.md_history == 0 || (config.md_history & (config.md_history - 1)) != 0) {
+        fprintf(stderr, "Market-data history must be a power of two.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.journal_batch == 0) {
+        fprintf(stderr, "Invalid journal batch size.\n");
         exit(EXIT_FAILURE);
     }
 
@@ -77,9 +247,37 @@ int main(int argc, char* argv[]) {
     // Perform required initializations of the client_registry,
     // maze, and player modules.
     client_registry = creg_init();
-    accounts_init();
-    traders_init();
-    exchange = exchange_init();
+    if (accounts_init() == -1) {
+        fprintf(stderr, "Failed to initialize the accounts.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (traders_init() == -1) {
+        fprintf(stderr, "Failed to initialize the traders for %zu sessions.\n", config.max_traders);
+        exit(EXIT_FAILURE);
+    }
+    if (md_feed_init() == -1) {
+        fprintf(stderr, "Failed to set up the market-data feed to %s.\n", config.md_group);
+        exit(EXIT_FAILURE);
+    }
+    if (!(exchange = exchange_init())) {
+        fprintf(stderr, "Failed to initialize the exchange for %zu instruments.\n", config.instruments);
+        exit(EXIT_FAILURE);
+    }
+
+    // Pick up where the last run left off, then carry on journaling after it
+    uint64_t last_seq;
+    if (snapshot_recover(exchange, &last_seq) == -1) {
+        fprintf(stderr, "Failed to recover state from %s.\n", config.journal_dir);
+        exit(EXIT_FAILURE);
+    }
+    if (journal_init(last_seq + 1) == -1) {
+        fprintf(stderr, "Failed to open journal in %s.\n", config.journal_dir);
+        exit(EXIT_FAILURE);
+    }
+    if (snapshot_init(exchange) == -1) {
+        fprintf(stderr, "Failed to start taking snapshots.\n");
+        exit(EXIT_FAILURE);
+    }
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -125,6 +323,11 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
+        // Every packet goes out in one write, so there is nothing for Nagle's
+        // algorithm to coalesce; it would only hold replies back
+        int one = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
         int *connptr = malloc(sizeof(int));
         *connptr = connfd;
 
@@ -155,9 +358,12 @@ static void terminate(int status) {
 
     // Finalize modules.
     creg_fini(client_registry);
+    snapshot_fini();
     exchange_fini(exchange);
+    md_feed_fini();
     traders_fini();
     accounts_fini();
+    journal_fini();
 
     debug("Bourse server terminating");
     exit(status);
@@ -0,0 +1,177 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "md_feed.h"
+#include "trader.h"
+#include "config.h"
+#include "debug.h"
+
+/*
+ * Largest datagram published: a per-instrument notification.
+ */
+#define MD_FEED_MAX_DATAGRAM (sizeof(BRS_MD_HEADER) + sizeof(BRS_PACKET_HEADER) + sizeof(BRS_INST_NOTIFY_INFO))
+
+/*
+ * A datagram as it was sent, kept for resending.
+ */
+struct md_datagram {
+    size_t len;
+    char data[MD_FEED_MAX_DATAGRAM];
+};
+
+static struct {
+    int fd;                         // -1 if the feed is disabled
+    pthread_mutex_t mutex;          // guards everything below, and orders the sends
+    uint64_t next_seq;              // sequence number of the next datagram
+    struct md_datagram *history;    // datagram seq is kept in slot (seq & mask)
+    size_t mask;
+    uint64_t sent;                  // datagrams taken by the socket
+    uint64_t dropped;               // datagrams the socket could not take
+    uint64_t resent;                // datagrams sent again to traders
+} feed = { .fd = -1 };
+
+int md_feed_init(void) {
+    if (!config.md_group) {
+        return 0;
+    }
+
+    struct sockaddr_in group = {0};
+    group.sin_family = AF_INET;
+    group.sin_port = htons(config.md_port);
+    if (inet_pton(AF_INET, config.md_group, &group.sin_addr) != 1 || !IN_MULTICAST(ntohl(group.sin_addr.s_addr))) {
+        error("Invalid multicast group %s", config.md_group);
+        return -1;
+    }
+    struct in_addr iface = { htonl(INADDR_ANY) };
+    if (config.md_interface && inet_pton(AF_INET, config.md_interface, &iface) != 1) {
+        error("Invalid interface address %s", config.md_interface);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // Subscribers on this host get the datagrams too, and they go no further than the local network
+    unsigned char loop = 1, ttl = 1;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) == -1
+        || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1
+        || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1
+        || connect(fd, (struct sockaddr *)&group, sizeof(group)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    feed.history = calloc(config.md_history, sizeof(struct md_datagram));
+    if (!feed.history) {
+        close(fd);
+        return -1;
+    }
+    feed.mask = config.md_history - 1;
+    feed.next_seq = 1;
+    feed.sent = feed.dropped = feed.resent = 0;
+    pthread_mutex_init(&feed.mutex, NULL);
+    feed.fd = fd;
+    info("Publishing market data to %s:%u", config.md_group, config.md_port);
+    return 0;
+}
+
+void md_feed_fini(void) {
+    if (feed.fd == -1) {
+        return;
+    }
+    info("Market data: %lu datagrams sent, %lu dropped, %lu resent", (unsigned long)feed.sent,
+         (unsigned long)feed.dropped, (unsigned long)feed.resent);
+    close(feed.fd);
+    feed.fd = -1;
+    free(feed.history);
+    pthread_mutex_destroy(&feed.mutex);
+}
+
+bool md_feed_enabled(void) {
+    return feed.fd != -1;
+}
+
+uint64_t md_feed_publish(BRS_PACKET_HEADER *hdr, void *payload) {
+    size_t size = ntohs(hdr->size);
+    if (sizeof(BRS_MD_HEADER) + sizeof(BRS_PACKET_HEADER) + size > MD_FEED_MAX_DATAGRAM) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&feed.mutex);
+    uint64_t seq = feed.next_seq++;
+    struct md_datagram *dg = &feed.history[seq & feed.mask];
+    BRS_MD_HEADER mdh = { .seq = htobe64(seq) };
+    memcpy(dg->data, &mdh, sizeof(mdh));
+    memcpy(dg->data + sizeof(mdh), hdr, sizeof(BRS_PACKET_HEADER));
+    if (size) {
+        memcpy(dg->data + sizeof(mdh) + sizeof(BRS_PACKET_HEADER), payload, size);
+    }
+    dg->len = sizeof(mdh) + sizeof(BRS_PACKET_HEADER) + size;
+
+    // Never wait for the socket: a client that misses a datagram asks for it again
+    if (send(feed.fd, dg->data, dg->len, MSG_DONTWAIT) == -1) {
+        feed.dropped++;
+    } else {
+        feed.sent++;
+    }
+    pthread_mutex_unlock(&feed.mutex);
+    return seq;
+}
+
+int md_feed_resend(TRADER *trader, BRS_RESEND_REQUEST *req) {
+    uint64_t first = be64toh(req->first);
+    size_t count = ntohl(req->count);
+    if (feed.fd == -1 || count == 0 || req->reserved != 0) {
+        return -1;
+    }
+    if (count > BRS_RESEND_MAX) {
+        count = BRS_RESEND_MAX;
+    }
+
+    // Copy them out, so that nothing is sent to the trader with the lock held
+    struct md_datagram *copy = malloc(count * sizeof(struct md_datagram));
+    if (!copy) {
+        return -1;
+    }
+    pthread_mutex_lock(&feed.mutex);
+    uint64_t oldest = (feed.next_seq > config.md_history) ? feed.next_seq - config.md_history : 1;
+    if (first < oldest || first >= feed.next_seq) {
+        pthread_mutex_unlock(&feed.mutex);
+        free(copy);
+        return -1;
+    }
+    if (count > feed.next_seq - first) {
+        count = feed.next_seq - first;
+    }
+    for (size_t i = 0; i < count; i++) {
+        copy[i] = feed.history[(first + i) & feed.mask];
+    }
+    feed.resent += count;
+    pthread_mutex_unlock(&feed.mutex);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    BRS_PACKET_HEADER hdr = {
+        .type = BRS_RESENT_PKT,
+        .timestamp_sec = htonl((uint32_t)ts.tv_sec),
+        .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
+    };
+    for (size_t i = 0; i < count; i++) {
+        hdr.size = htons(copy[i].len);
+        if (trader_send_packet(trader, &hdr, copy[i].data) == -1) {
+            break;
+        }
+    }
+    free(copy);
+    return count;
+}
@@ -0,0 +1,20 @@
+#include <stdlib.h>
+
+#include "md_ring.h"
+
+int md_ring_init(struct md_ring *ring, size_t size) {
+    void *mem;
+    if (posix_memalign(&mem, MD_RING_ALIGN, size * sizeof(struct md_event)) != 0) {
+        return -1;
+    }
+    ring->slots = mem;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void md_ring_fini(struct md_ring *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "order_pool.h"
+#include "debug.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static atomic_bool hugepages_warned;    // the fallback to normal pages has been reported
+
+/*
+ * Each slot is an order rounded up to a whole number of cache lines,
+ * so that no two orders share a line.
+ */
+#define SLOT_SIZE (((sizeof(struct order) + ORDER_POOL_ALIGN - 1) / ORDER_POOL_ALIGN) * ORDER_POOL_ALIGN)
+
+/*
+ * Header at the start of each chunk, padded to a cache line.
+ * The slots follow immediately after it.
+ */
+struct order_pool_chunk {
+    struct order_pool_chunk *next;
+    struct order *free_head;        // slots of this chunk, chained, until added to a pool
+    struct order *free_tail;
+    size_t nslots;
+    size_t size;                    // size of the mapping, including this header
+    bool hugepages;
+} __attribute__((aligned(ORDER_POOL_ALIGN)));
+
+/*
+ * Allocate a chunk with room for a given number of slots.
+ */
+static struct order_pool_chunk *chunk_alloc(size_t nslots, bool hugepages) {
+    size_t size = sizeof(struct order_pool_chunk) + nslots * SLOT_SIZE;
+    struct order_pool_chunk *chunk = MAP_FAILED;
+    bool huge = false;
+
+    if (hugepages) {
+        // Huge page mappings have to be a whole number of huge pages
+        size_t huge_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+        chunk = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk != MAP_FAILED) {
+            size = huge_size;
+            nslots = (size - sizeof(struct order_pool_chunk)) / SLOT_SIZE;   // use the whole mapping
+            huge = true;
+        } else if (!atomic_exchange(&hugepages_warned, true)) {
+            // Every chunk tries again, but only the first failure is reported
+            warn("No huge pages available for order pool, using normal pages");
+        }
+    }
+
+    if (chunk == MAP_FAILED) {
+        void *mem;
+        if (posix_memalign(&mem, ORDER_POOL_ALIGN, size) != 0) {
+            return NULL;
+        }
+        chunk = mem;
+    }
+
+    chunk->next = NULL;
+    chunk->nslots = nslots;
+    chunk->size = size;
+    chunk->hugepages = huge;
+
+    // Chain the slots together.  This also touches every page now, rather
+    // than faulting them in later on the posting path.
+    char *base = (char *)(chunk + 1);
+    chunk->free_head = NULL;
+    chunk->free_tail = (struct order *)(base + (nslots - 1) * SLOT_SIZE);
+    for (size_t i = nslots; i > 0; i--) {
+        struct order *ordp = (struct order *)(base + (i - 1) * SLOT_SIZE);
+        ordp->next = chunk->free_head;
+        chunk->free_head = ordp;
+    }
+
+    return chunk;
+}
+
+static void chunk_free(struct order_pool_chunk *chunk) {
+    if (chunk->hugepages) {
+        munmap(chunk, chunk->size);
+    } else {
+        free(chunk);
+    }
+}
+
+int order_pool_init(struct order_pool *pool, size_t initial, size_t chunk_size,
+                    size_t limit, bool hugepages) {
+    memset(pool, 0, sizeof(struct order_pool));
+    if (initial == 0 || chunk_size == 0) {
+        return -1;
+    }
+    pool->chunk_size = chunk_size;
+    pool->limit = limit;
+    pool->hugepages = hugepages;
+
+    struct order_pool_chunk *chunk = chunk_alloc(initial, hugepages);
+    if (!chunk) {
+        return -1;
+    }
+    order_pool_add_chunk(pool, chunk);
+
+    debug("Order pool: %zu slots of %zu bytes%s, growing by %zu, limit %zu", pool->capacity,
+          (size_t)SLOT_SIZE, chunk->hugepages ? " (huge pages)" : "", chunk_size, limit);
+    return 0;
+}
+
+void order_pool_fini(struct order_pool *pool) {
+    while (pool->chunks) {
+        struct order_pool_chunk *chunk = pool->chunks;
+        pool->chunks = chunk->next;
+        chunk_free(chunk);
+    }
+    pool->free_list = NULL;
+    pool->capacity = pool->nchunks = 0;
+}
+
+struct order_pool_chunk *order_pool_chunk_alloc(struct order_pool *pool) {
+    // chunk_size and hugepages never change after initialization,
+    // so reading them without the lock is safe
+    return chunk_alloc(pool->chunk_size, pool->hugepages);
+}
+
+void order_pool_add_chunk(struct order_pool *pool, struct order_pool_chunk *chunk) {
+    // Splice the whole chain of new slots onto the front of the free list
+    chunk->free_tail->next = pool->free_list;
+    pool->free_list = chunk->free_head;
+    chunk->free_head = chunk->free_tail = NULL;
+
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->nchunks++;
+    pool->capacity += chunk->nslots;
+}
+
+void order_pool_get_stats(struct order_pool *pool, struct order_pool_stats *stats) {
+    stats->capacity = pool->capacity;
+    stats->in_use = pool->in_use;
+    stats->high_water = pool->high_water;
+    stats->limit = pool->limit;
+    stats->nchunks = pool->nchunks;
+}
@@ -11,6 +11,11 @@
 #include "server.h"
 #include "protocol.h"
 #include "trader.h"
+#include "protocol_ext.h"
+#include "account_ext.h"
+#include "exchange_ext.h"
+#include "config.h"
+#include "md_feed.h"
 
 /* I am writing a NACK function since the trader 
    versions require a trader is initialized...          */
@@ -49,6 +54,47 @@ static int send_nack(int fd) {
     return 0;
 }
 
+/*
+ * Check the payload of one of the per-instrument requests: it must be at
+ * least as large as expected and name an instrument the exchange trades.
+ * The field following the instrument (reserved or flags) must not have any
+ * bits set other than those allowed.
+ *
+ * @param hdr  The header of the request.
+ * @param payload  The payload of the request, which begins with the instrument.
+ * @param size  The size of the payload structure for this type of request.
+ * @param flags  The bits that may be set in the field following the instrument.
+ * @return  The instrument, or -1 if the request is malformed.
+ */
+static int check_instrument(BRS_PACKET_HEADER *hdr, void *payload, size_t size, uint16_t flags) {
+    if (!payload || ntohs(hdr->size) < size) {
+        return -1;
+    }
+
+    BRS_INSTRUMENT_INFO *inst = payload;
+    instrument_t instrument = ntohs(inst->instrument);
+    if (instrument >= exchange_instruments(exchange) || (ntohs(inst->reserved) & ~flags) != 0) {
+        return -1;
+    }
+    return instrument;
+}
+
+/*
+ * Cancel all of a trader's pending orders for one instrument or for all.
+ *
+ * @return  The number of orders canceled.
+ */
+static size_t cancel_all(TRADER *trader, int instrument) {
+    size_t total = 0, count;
+    for (size_t i = 0; i < exchange_instruments(exchange); i++) {
+        if ((instrument == BRS_ALL_INSTRUMENTS || instrument == (int)i)
+            && exchange_cancel_all(exchange, i, trader, &count) == 0) {
+            total += count;
+        }
+    }
+    return total;
+}
+
 void *brs_client_service(void *arg) {
     int fd = *((int*) arg);
     free(arg);
@@ -115,7 +161,7 @@ void *brs_client_service(void *arg) {
             BRS_FUNDS_INFO *deposit = payload;
             funds_t amount = ntohl(deposit->amount);
             
-            account_increase_balance(acc, amount);
+            account_deposit(acc, amount);
 
             BRS_STATUS_INFO info = {0};
             exchange_get_status(exchange, acc, &info);
@@ -127,7 +173,7 @@ void *brs_client_service(void *arg) {
             BRS_FUNDS_INFO *withdraw = payload;
             funds_t amount = ntohl(withdraw->amount);
             
-            if (account_decrease_balance(acc, amount) == -1) {
+            if (account_withdraw(acc, amount) == -1) {
                 trader_send_nack(trader);
                 break;
             }
@@ -142,7 +188,7 @@ void *brs_client_service(void *arg) {
             BRS_ESCROW_INFO *escrow = payload;
             quantity_t quantity = ntohl(escrow->quantity);
 
-            account_increase_inventory(acc, quantity);
+            account_escrow(acc, 0, quantity);
 
             BRS_STATUS_INFO info = {0};
             exchange_get_status(exchange, acc, &info);
@@ -154,7 +200,7 @@ void *brs_client_service(void *arg) {
             BRS_ESCROW_INFO *release = payload;
             quantity_t quantity = ntohl(release->quantity);
 
-            if (account_decrease_inventory(acc, quantity) == -1) {
+            if (account_release(acc, 0, quantity) == -1) {
                 trader_send_nack(trader);
                 break;
             }
@@ -218,6 +264,187 @@ void *brs_client_service(void *arg) {
             trader_send_ack(trader, &info);            
             break;
         }
+        case BRS_STATUS_INST_PKT: {
+            int instrument = check_instrument(&hdr, payload, sizeof(BRS_INSTRUMENT_INFO), 0);
+            if (instrument == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            ACCOUNT *acc = trader_get_account(trader);
+            BRS_STATUS_INFO info = {0};
+            exchange_get_instrument_status(exchange, instrument, acc, &info);
+            trader_send_ack(trader, &info);
+            break;
+        }
+        case BRS_ESCROW_INST_PKT:
+        case BRS_RELEASE_INST_PKT: {
+            int instrument = check_instrument(&hdr, payload, sizeof(BRS_INST_ESCROW_INFO), 0);
+            if (instrument == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            ACCOUNT *acc = trader_get_account(trader);
+            BRS_INST_ESCROW_INFO *escrow = payload;
+            quantity_t quantity = ntohl(escrow->quantity);
+
+            if (hdr.type == BRS_ESCROW_INST_PKT) {
+                account_escrow(acc, instrument, quantity);
+            } else if (account_release(acc, instrument, quantity) == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            BRS_STATUS_INFO info = {0};
+            exchange_get_instrument_status(exchange, instrument, acc, &info);
+            trader_send_ack(trader, &info);
+            break;
+        }
+        case BRS_BUY_INST_PKT:
+        case BRS_SELL_INST_PKT: {
+            int instrument = check_instrument(&hdr, payload, sizeof(BRS_INST_ORDER_INFO),
+                                              BRS_ORDER_IOC | BRS_ORDER_FOK);
+            if (instrument == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            ACCOUNT *acc = trader_get_account(trader);
+            BRS_INST_ORDER_INFO *order = payload;
+            BOOK_SIDE side = (hdr.type == BRS_BUY_INST_PKT) ? BOOK_BUY : BOOK_SELL;
+            uint16_t flags = ntohs(order->flags);
+            quantity_t remaining = 0;
+            orderid_t order_id;
+
+            if (flags) {
+                order_id = exchange_take_order(exchange, instrument, trader, side, ntohl(order->quantity),
+                                               ntohl(order->price), flags, &remaining);
+            } else {
+                order_id = exchange_post_order(exchange, instrument, trader, side,
+                                               ntohl(order->quantity), ntohl(order->price));
+            }
+            if (order_id == 0) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            BRS_STATUS_INFO info = {0};
+            exchange_get_instrument_status(exchange, instrument, acc, &info);
+            info.orderid = htonl(order_id);
+            info.quantity = htonl(remaining);   // unfilled part of an immediate order
+            trader_send_ack(trader, &info);
+            break;
+        }
+        case BRS_CANCEL_INST_PKT: {
+            int instrument = check_instrument(&hdr, payload, sizeof(BRS_INST_CANCEL_INFO), 0);
+            if (instrument == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            ACCOUNT *acc = trader_get_account(trader);
+            BRS_INST_CANCEL_INFO *cancel = payload;
+            orderid_t order_id = ntohl(cancel->order);
+            quantity_t canceled_qty;
+
+            if (exchange_cancel_order(exchange, instrument, trader, order_id, &canceled_qty) == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            BRS_STATUS_INFO info = {0};
+            exchange_get_instrument_status(exchange, instrument, acc, &info);
+            info.orderid = htonl(order_id);
+            info.quantity = htonl(canceled_qty);
+            trader_send_ack(trader, &info);
+            break;
+        }
+        case BRS_CANCEL_ALL_INST_PKT: {
+            BRS_INSTRUMENT_INFO *which = payload;
+            int instrument;
+            if (payload && ntohs(hdr.size) >= sizeof(BRS_INSTRUMENT_INFO)
+                && ntohs(which->instrument) == BRS_ALL_INSTRUMENTS && which->reserved == 0) {
+                instrument = BRS_ALL_INSTRUMENTS;
+            } else if ((instrument = check_instrument(&hdr, payload, sizeof(BRS_INSTRUMENT_INFO), 0)) == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            size_t count = cancel_all(trader, instrument);
+
+            BRS_STATUS_INFO info = {0};
+            exchange_get_instrument_status(exchange, (instrument == BRS_ALL_INSTRUMENTS) ? 0 : instrument,
+                                           trader_get_account(trader), &info);
+            info.quantity = htonl(count);
+            trader_send_ack(trader, &info);
+            break;
+        }
+        case BRS_DEPTH_INST_PKT: {
+            BRS_DEPTH_REQUEST *req = payload;
+            if (!payload || ntohs(hdr.size) < sizeof(BRS_DEPTH_REQUEST) || ntohs(req->levels) == 0) {
+                trader_send_nack(trader);
+                break;
+            }
+            size_t levels = ntohs(req->levels);
+            if (levels > BRS_DEPTH_MAX_LEVELS) {
+                levels = BRS_DEPTH_MAX_LEVELS;
+            }
+
+            BRS_DEPTH_INFO *depth = malloc(sizeof(BRS_DEPTH_INFO) + 2 * levels * sizeof(BRS_DEPTH_LEVEL));
+            size_t size;
+            if (!depth || (size = exchange_get_depth(exchange, ntohs(req->instrument), levels, depth)) == 0) {
+                free(depth);
+                trader_send_nack(trader);
+                break;
+            }
+
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            BRS_PACKET_HEADER ack = {
+                .type = BRS_ACK_PKT,
+                .size = htons(size),
+                .timestamp_sec = htonl((uint32_t)ts.tv_sec),
+                .timestamp_nsec = htonl((uint32_t)ts.tv_nsec)
+            };
+            trader_send_packet(trader, &ack, depth);
+            free(depth);
+            break;
+        }
+        case BRS_RESEND_PKT: {
+            if (!payload || ntohs(hdr.size) < sizeof(BRS_RESEND_REQUEST)
+                || md_feed_resend(trader, payload) == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+            trader_send_ack(trader, NULL);
+            break;
+        }
+        case BRS_AMEND_INST_PKT: {
+            int instrument = check_instrument(&hdr, payload, sizeof(BRS_INST_AMEND_INFO), 0);
+            if (instrument == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            ACCOUNT *acc = trader_get_account(trader);
+            BRS_INST_AMEND_INFO *amend = payload;
+            orderid_t order_id = ntohl(amend->order);
+            quantity_t remaining = 0;
+
+            if (exchange_amend_order(exchange, instrument, trader, order_id, ntohl(amend->quantity),
+                                     ntohl(amend->price), &remaining) == -1) {
+                trader_send_nack(trader);
+                break;
+            }
+
+            BRS_STATUS_INFO info = {0};
+            exchange_get_instrument_status(exchange, instrument, acc, &info);
+            info.orderid = htonl(order_id);
+            info.quantity = htonl(remaining);   // still resting after any fills at the new price
+            trader_send_ack(trader, &info);
+            break;
+        }
         }
 
         if (payload) {
@@ -227,6 +454,9 @@ void *brs_client_service(void *arg) {
     }
 
     if (trader) {
+        if (config.cancel_on_disconnect) {
+            cancel_all(trader, BRS_ALL_INSTRUMENTS);
+        }
         trader_logout(trader);
     }
 
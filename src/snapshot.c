@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "snapshot.h"
+#include "journal.h"
+#include "account_ext.h"
+#include "exchange_ext.h"
+#include "trader_ext.h"
+#include "config.h"
+#include "debug.h"
+
+#define SNAPSHOT_TMP_NAME "snapshot.tmp"
+
+static struct {
+    EXCHANGE *xchg;
+    bool running;                   // periodic thread has been started
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t last_seq;              // journal position of the latest snapshot
+} snap;
+
+int snapshot_write(struct snapshot_writer *w, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0 && !w->err) {
+        size_t n = sizeof(w->buf) - w->len;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        size -= n;
+
+        if (w->len == sizeof(w->buf)) {
+            // write() only, so this stays safe in a forked child
+            size_t off = 0;
+            while (off < w->len) {
+                ssize_t k = write(w->fd, w->buf + off, w->len - off);
+                if (k <= 0) {
+                    w->err = 1;
+                    break;
+                }
+                off += k;
+            }
+            w->len = 0;
+        }
+    }
+    return w->err ? -1 : 0;
+}
+
+/*
+ * Write any data still buffered.
+ */
+static int snapshot_flush(struct snapshot_writer *w) {
+    size_t off = 0;
+    while (off < w->len && !w->err) {
+        ssize_t k = write(w->fd, w->buf + off, w->len - off);
+        if (k <= 0) {
+            w->err = 1;
+        } else {
+            off += k;
+        }
+    }
+    w->len = 0;
+    return w->err ? -1 : 0;
+}
+
+/*
+ * Write a snapshot file.  Runs in the child process forked by snapshot_take(),
+ * which has a frozen copy of the state; it does not take any locks or
+ * allocate any memory.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int write_snapshot(EXCHANGE *xchg, uint64_t seq) {
+    static struct snapshot_writer w;    // too large for the stack
+    char tmp[PATH_MAX], path[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/%s", config.journal_dir, SNAPSHOT_TMP_NAME);
+    snprintf(path, sizeof(path), "%s/snapshot-%020lu.snap", config.journal_dir, (unsigned long)seq);
+
+    if ((w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        return -1;
+    }
+    w.err = 0;
+    w.len = 0;
+
+    struct snapshot_header hdr = {
+        .seq = seq,
+        .naccounts = accounts_count(),
+        .ninstruments = exchange_instruments(xchg),
+        .next_order_id = exchange_next_order_id(xchg)
+    };
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    snapshot_write(&w, &hdr, sizeof(hdr));
+    accounts_write_snapshot(&w, hdr.ninstruments);
+    exchange_write_snapshot(xchg, &w);
+    snapshot_write(&w, SNAPSHOT_END_MAGIC, 8);
+
+    if (snapshot_flush(&w) == -1 || fsync(w.fd) == -1) {
+        close(w.fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(w.fd);
+
+    // Only a complete snapshot ever has the final name
+    if (rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    int dfd = open(config.journal_dir, O_RDONLY | O_DIRECTORY);
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return 0;
+}
+
+/*
+ * Find the latest snapshot in the journal directory, and delete those
+ * older than a given one.
+ *
+ * @param keep  Snapshots earlier than this one are deleted (0 to delete none).
+ * @return  The sequence number of the latest snapshot, or 0 if there is none.
+ */
+static uint64_t scan_snapshots(uint64_t keep) {
+    uint64_t latest = 0;
+    DIR *dir = opendir(config.journal_dir);
+    if (!dir) {
+        return 0;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        unsigned long seq;
+        char end;
+        if (sscanf(ent->d_name, "snapshot-%lu.sna%c", &seq, &end) != 2 || end != 'p') {
+            continue;
+        }
+        if (seq < keep) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", config.journal_dir, ent->d_name);
+            unlink(path);
+        } else if (seq > latest) {
+            latest = seq;
+        }
+    }
+    closedir(dir);
+    return latest;
+}
+
+int snapshot_take(EXCHANGE *xchg) {
+    if (!journal_enabled()) {
+        return 0;
+    }
+
+    struct timespec t0, t1, t2;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // With every book and account locked, no change is half-made and the
+    // journal position matches the state exactly.  The locks are only held
+    // for as long as it takes to fork.
+    exchange_lock_all(xchg);
+    accounts_lock_all();
+
+    struct journal_stats stats;
+    journal_get_stats(&stats);
+    uint64_t seq = stats.last_seq;
+    if (seq == snap.last_seq) {
+        accounts_unlock_all();
+        exchange_unlock_all(xchg);
+        return 0;               // nothing has changed
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(write_snapshot(xchg, seq) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    accounts_unlock_all();
+    exchange_unlock_all(xchg);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (pid == -1) {
+        error("Cannot fork snapshot writer: %s", strerror(errno));
+        return -1;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        error("Snapshot at journal record %lu could not be written", (unsigned long)seq);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    // Everything up to seq is in the snapshot now
+    scan_snapshots(seq);
+    journal_prune(seq);
+    snap.last_seq = seq;
+
+    info("Snapshot at journal record %lu: locks held %.3fms, written in %.3fms", (unsigned long)seq,
+         (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+         (t2.tv_sec - t1.tv_sec) * 1e3 + (t2.tv_nsec - t1.tv_nsec) / 1e6);
+    return 0;
+}
+
+/*
+ * State kept while recovering.
+ */
+struct recovery {
+    EXCHANGE *xchg;
+    TRADER **owners;                // detached trader for each account, made on demand
+    size_t nowners;
+    orderid_t next_order_id;
+    // Last immediate (IOC or FOK) order posted for each instrument.  Its fills
+    // and the cancel of its remainder follow it in one lock hold, so only the
+    // last of them can have been cut short.
+    struct journal_record immediate[MAX_INSTRUMENTS];
+};
+
+/*
+ * Complete the cancel of immediate orders whose fills were being recorded
+ * when the journal ended, returning their remainder to their owners.
+ */
+static void finish_immediate(struct recovery *r) {
+    for (size_t i = 0; i < MAX_INSTRUMENTS; i++) {
+        struct journal_record *rec = &r->immediate[i];
+        quantity_t qty;
+        if (!rec->order || exchange_restore_cancel(r->xchg, i, rec->order, &qty) == -1) {
+            continue;
+        }
+        ACCOUNT *account = account_get_by_id(rec->account);
+        if (rec->side == BOOK_BUY) {
+            account_adjust(account, i, (int64_t)qty * rec->price, 0);
+        } else {
+            account_adjust(account, i, 0, qty);
+        }
+        info("Canceled remaining %u of immediate order %u", qty, rec->order);
+    }
+}
+
+/*
+ * Get the trader that is to own recovered orders for an account.
+ */
+static TRADER *owner(struct recovery *r, uint32_t id) {
+    if (id >= r->nowners) {
+        size_t n = r->nowners ? r->nowners : 64;
+        while (n <= id) {
+            n *= 2;
+        }
+        TRADER **tmp = realloc(r->owners, n * sizeof(TRADER *));
+        if (!tmp) {
+            return NULL;
+        }
+        memset(tmp + r->nowners, 0, (n - r->nowners) * sizeof(TRADER *));
+        r->owners = tmp;
+        r->nowners = n;
+    }
+    if (!r->owners[id]) {
+        ACCOUNT *account = account_get_by_id(id);
+        if (!account) {
+            return NULL;
+        }
+        r->owners[id] = trader_detached(account);
+    }
+    return r->owners[id];
+}
+
+static void note_order_id(struct recovery *r, orderid_t id) {
+    if (id >= r->next_order_id) {
+        r->next_order_id = id + 1;
+    }
+}
+
+/*
+ * Load a snapshot file.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int load_snapshot(struct recovery *r, uint64_t seq) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/snapshot-%020lu.snap", config.journal_dir, (unsigned long)seq);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        error("Cannot open snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    int ret = -1;
+    char *name = NULL;
+    struct snapshot_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0) {
+        goto done;
+    }
+    if (hdr.ninstruments > exchange_instruments(r->xchg)) {
+        error("Snapshot %s has %u instruments, but only %zu are configured", path,
+              hdr.ninstruments, exchange_instruments(r->xchg));
+        goto done;
+    }
+    note_order_id(r, hdr.next_order_id - 1);
+
+    quantity_t inventory[MAX_INSTRUMENTS];
+    for (uint32_t i = 0; i < hdr.naccounts; i++) {
+        struct snapshot_account acc;
+        if (fread(&acc, sizeof(acc), 1, f) != 1
+            || fread(inventory, sizeof(quantity_t), hdr.ninstruments, f) != hdr.ninstruments
+            || !(name = realloc(name, acc.name_len + 1))
+            || fread(name, 1, acc.name_len, f) != acc.name_len) {
+            goto done;
+        }
+        name[acc.name_len] = '\0';
+        if (account_restore(acc.id, name, acc.balance, inventory, hdr.ninstruments) == -1) {
+            goto done;
+        }
+    }
+
+    for (uint16_t i = 0; i < hdr.ninstruments; i++) {
+        struct snapshot_instrument inst;
+        if (fread(&inst, sizeof(inst), 1, f) != 1) {
+            goto done;
+        }
+        if (inst.last_trade_set) {
+            exchange_restore_last_trade(r->xchg, inst.id, inst.last_trade_price);
+        }
+        for (uint32_t j = 0; j < inst.norders; j++) {
+            struct snapshot_order ord;
+            TRADER *trader;
+            if (fread(&ord, sizeof(ord), 1, f) != 1 || !(trader = owner(r, ord.account))
+                || exchange_restore_order(r->xchg, inst.id, trader, ord.side, ord.order_id,
+                                          ord.quantity, ord.price) == -1) {
+                goto done;
+            }
+            note_order_id(r, ord.order_id);
+        }
+    }
+
+    char end[8];
+    if (fread(end, sizeof(end), 1, f) == 1 && memcmp(end, SNAPSHOT_END_MAGIC, sizeof(end)) == 0) {
+        ret = 0;
+    }
+
+done:
+    if (ret == -1) {
+        error("Snapshot %s is damaged", path);
+    }
+    free(name);
+    fclose(f);
+    return ret;
+}
+
+/*
+ * Apply one journal record to the state being recovered.
+ */
+static int replay_record(const struct journal_record *rec, void *arg) {
+    struct recovery *r = arg;
+
+    if (rec->type == JOURNAL_ACCOUNT) {
+        ACCOUNT *account = account_lookup((char *)(rec + 1));
+        return (account && account_get_id(account) == rec->account) ? 0 : -1;
+    }
+
+    if (rec->instrument >= exchange_instruments(r->xchg)) {
+        error("Journal record %lu is for instrument %u, which is not configured",
+              (unsigned long)rec->seq, rec->instrument);
+        return -1;
+    }
+    ACCOUNT *account = account_get_by_id(rec->account);
+    if (!account) {
+        return -1;
+    }
+    int64_t qty = rec->quantity, price = rec->price;
+
+    switch (rec->type) {
+    case JOURNAL_DEPOSIT:
+        account_adjust(account, 0, price, 0);
+        break;
+    case JOURNAL_WITHDRAW:
+        account_adjust(account, 0, -price, 0);
+        break;
+    case JOURNAL_ESCROW:
+        account_adjust(account, rec->instrument, 0, qty);
+        break;
+    case JOURNAL_RELEASE:
+        account_adjust(account, rec->instrument, 0, -qty);
+        break;
+    case JOURNAL_POST: {
+        TRADER *trader = owner(r, rec->account);
+        if (!trader || exchange_restore_order(r->xchg, rec->instrument, trader, rec->side,
+                                              rec->order, rec->quantity, rec->price) == -1) {
+            return -1;
+        }
+        // Encumber, as exchange_post_order() did
+        if (rec->side == BOOK_BUY) {
+            account_adjust(account, rec->instrument, -qty * price, 0);
+        } else {
+            account_adjust(account, rec->instrument, 0, -qty);
+        }
+        note_order_id(r, rec->order);
+        if (rec->flags) {
+            r->immediate[rec->instrument] = *rec;
+        }
+        break;
+    }
+    case JOURNAL_CANCEL: {
+        quantity_t left;
+        if (exchange_restore_cancel(r->xchg, rec->instrument, rec->order, &left) == -1) {
+            return -1;
+        }
+        if (rec->side == BOOK_BUY) {
+            account_adjust(account, rec->instrument, qty * price, 0);
+        } else {
+            account_adjust(account, rec->instrument, 0, qty);
+        }
+        break;
+    }
+    case JOURNAL_AMEND: {
+        quantity_t old_qty;
+        funds_t old_price;
+        if (exchange_restore_amend(r->xchg, rec->instrument, rec->order, rec->quantity, rec->price,
+                                   &old_qty, &old_price) == -1) {
+            return -1;
+        }
+        // Encumber or release the difference, as exchange_amend_order() did
+        if (rec->side == BOOK_BUY) {
+            account_adjust(account, rec->instrument, (int64_t)old_qty * old_price - qty * price, 0);
+        } else {
+            account_adjust(account, rec->instrument, 0, (int64_t)old_qty - qty);
+        }
+        break;
+    }
+    case JOURNAL_TRADE: {
+        ACCOUNT *seller = account_get_by_id(rec->account2);
+        funds_t buy_price;
+        if (!seller || exchange_restore_trade(r->xchg, rec->instrument, rec->order, rec->order2,
+                                              rec->quantity, rec->price, &buy_price) == -1) {
+            return -1;
+        }
+        // Settle, as execute_trade() did, including the buyer's refund
+        account_adjust(account, rec->instrument, qty * ((int64_t)buy_price - price), qty);
+        account_adjust(seller, rec->instrument, qty * price, 0);
+        break;
+    }
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_recover(EXCHANGE *xchg, uint64_t *last_seq) {
+    *last_seq = 0;
+    if (!config.journal_dir) {
+        return 0;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    struct recovery r = { .xchg = xchg, .next_order_id = 1 };
+    uint64_t seq = scan_snapshots(0);
+    int ret = 0;
+    if (seq > 0 && load_snapshot(&r, seq) == -1) {
+        ret = -1;
+    }
+    if (ret == 0 && journal_replay(seq, replay_record, &r, last_seq) == -1) {
+        error("Journal could not be replayed after record %lu", (unsigned long)*last_seq);
+        ret = -1;
+    }
+    if (ret == 0) {
+        finish_immediate(&r);
+    }
+
+    // Recovered orders hold their own references to their owners
+    for (size_t i = 0; i < r.nowners; i++) {
+        if (r.owners[i]) {
+            trader_unref(r.owners[i], "recovered");
+        }
+    }
+    free(r.owners);
+
+    if (ret == 0) {
+        exchange_restore_done(xchg, r.next_order_id);
+        snap.last_seq = seq;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        info("Recovered snapshot %lu and journal up to record %lu in %.3fms", (unsigned long)seq,
+             (unsigned long)*last_seq, (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    }
+    return ret;
+}
+
+/*
+ * Thread that takes a snapshot every config.snapshot_interval seconds.
+ */
+static void *snapshotter(void *arg) {
+    pthread_mutex_lock(&snap.mutex);
+    while (!snap.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += config.snapshot_interval;
+        while (!snap.stop && pthread_cond_timedwait(&snap.cond, &snap.mutex, &deadline) != ETIMEDOUT)
+            ;
+        if (snap.stop) {
+            break;
+        }
+        pthread_mutex_unlock(&snap.mutex);
+        snapshot_take(snap.xchg);
+        pthread_mutex_lock(&snap.mutex);
+    }
+    pthread_mutex_unlock(&snap.mutex);
+    return NULL;
+}
+
+int snapshot_init(EXCHANGE *xchg) {
+    snap.xchg = xchg;
+    snap.stop = false;
+    snap.running = false;
+    if (!journal_enabled() || config.snapshot_interval == 0) {
+        return 0;
+    }
+
+    pthread_mutex_init(&snap.mutex, NULL);
+    pthread_cond_init(&snap.cond, NULL);
+    if (pthread_create(&snap.thread, NULL, snapshotter, NULL) != 0) {
+        pthread_mutex_destroy(&snap.mutex);
+        pthread_cond_destroy(&snap.cond);
+        return -1;
+    }
+    snap.running = true;
+    return 0;
+}
+
+void snapshot_fini(void) {
+    if (snap.running) {
+        pthread_mutex_lock(&snap.mutex);
+        snap.stop = true;
+        pthread_cond_signal(&snap.cond);
+        pthread_mutex_unlock(&snap.mutex);
+        pthread_join(snap.thread, NULL);
+        pthread_mutex_destroy(&snap.mutex);
+        pthread_cond_destroy(&snap.cond);
+        snap.running = false;
+    }
+
+    // A final snapshot makes the next start as quick as possible
+    if (snap.xchg) {
+        snapshot_take(snap.xchg);
+    }
+}
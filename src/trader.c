@@ -5,63 +5,425 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sched.h>
 
 #include "trader.h"
 #include "protocol.h"
 #include "account.h"
+#include "account_ext.h"
+#include "trader_ext.h"
+#include "md_ring.h"
+#include "config.h"
 #include "debug.h"
 
+/*
+ * Most segments written in one call to sendmsg().
+ */
+#define OUT_IOV_MAX 64
+
+/*
+ * A packet encoded once, header and payload together.  A broadcast packet
+ * is shared by the queues of every trader that could not take it at once,
+ * each of which holds a reference.
+ */
+struct pkt_buf {
+    atomic_uint refs;
+    size_t len;
+    char data[];
+};
+
+/*
+ * The unwritten part of a packet in a trader's queue.
+ */
+struct out_seg {
+    struct pkt_buf *buf;
+    size_t off;                     // bytes of buf already written
+};
+
+/*
+ * Packets waiting to be written to a trader's client, in a ring of segments
+ * allocated the first time anything has to wait.  The bytes waiting are
+ * bounded by config.out_queue_size.
+ */
+struct out_queue {
+    struct out_seg *segs;
+    size_t cap;                     // slots in segs
+    size_t head;                    // slot of the first segment
+    size_t count;                   // segments queued
+    size_t len;                     // bytes waiting
+};
+
 struct trader {
     char *name;
     ACCOUNT *acc;
     int fd;
-    int ref_count;
-    pthread_mutex_t mutex;
+    atomic_int ref_count;
+    pthread_mutex_t send_mutex;     // serializes sending; guards the fields below
+    struct out_queue out;
+    bool polling;                   // on the writer's pending list, which holds a reference
+    bool closed;                    // logged out or cut off: nothing more is sent
+    uint64_t hash;                  // of name, for the session table
+    size_t slot;                    // position in both trader sets while logged in
+    struct trader_stats stats;
+    struct md_conflation md;        // owned by the exchange's publisher thread
 };
 
-static TRADER *log_table[MAX_TRADERS];
 static pthread_mutex_t log_mutex;
 
+/*
+ * The logged-in traders by name, in an open-addressed table with linear
+ * probing, kept at most half full.  Guarded by log_mutex.
+ */
+static struct {
+    TRADER **slots;
+    size_t mask;                    // slots - 1, a power of two less one
+} sessions;
+
+/*
+ * The logged-in traders, as an array that is never changed while it is
+ * published, so that a broadcast can go through it without any lock or
+ * reference.  Login and logout change the spare set, publish it, and wait
+ * until every reader that might still see the old set has left; the same
+ * change is then made to the old set, which becomes the spare.  The two
+ * sets are therefore always alike, and each trader keeps its position in
+ * them, so that logout moves the last trader into the place it leaves
+ * rather than searching.  A trader that has logged out is only released
+ * after the wait.
+ *
+ * Readers are counted by the parity of the epoch they entered in.  Waiting
+ * for readers advances the epoch, so that new readers count against the
+ * other parity, and then waits for the count of the old one to reach zero.
+ * Readers never take log_mutex, which the writers hold while they wait.
+ */
+struct trader_set {
+    size_t count;
+    TRADER **traders;               // config.max_traders of them
+};
+
+static struct trader_set sets[2];
+static _Atomic(struct trader_set *) live_set;
+static atomic_uint set_epoch;
+static struct {
+    atomic_ulong count;
+} __attribute__((aligned(64))) set_readers[2];
+
+/*
+ * Start reading the live set.
+ *
+ * @return  The epoch to be passed to set_leave().
+ */
+static unsigned set_enter(void) {
+    for (;;) {
+        unsigned epoch = atomic_load(&set_epoch);
+        atomic_fetch_add(&set_readers[epoch & 1].count, 1);
+        // If the epoch moved on meanwhile, a writer may not have seen us
+        if (atomic_load(&set_epoch) == epoch) {
+            return epoch;
+        }
+        atomic_fetch_sub(&set_readers[epoch & 1].count, 1);
+    }
+}
+
+static void set_leave(unsigned epoch) {
+    atomic_fetch_sub_explicit(&set_readers[epoch & 1].count, 1, memory_order_release);
+}
+
+/*
+ * Add a trader to, or remove it from, a set.
+ */
+static void set_add(struct trader_set *set, TRADER *trader) {
+    set->traders[set->count++] = trader;
+}
+
+static void set_remove(struct trader_set *set, TRADER *trader) {
+    set->traders[trader->slot] = set->traders[--set->count];
+}
+
+/*
+ * Publish the spare set once changed, and wait for the readers of the old one.
+ * log_mutex must be held.
+ *
+ * @param add  Trader to add, or NULL.
+ * @param remove  Trader to remove, or NULL.
+ */
+static void set_change(TRADER *add, TRADER *remove) {
+    struct trader_set *old = atomic_load(&live_set);
+    struct trader_set *set = (old == &sets[0]) ? &sets[1] : &sets[0];
+
+    if (add) {
+        add->slot = set->count;
+        set_add(set, add);
+    }
+    if (remove) {
+        set_remove(set, remove);
+    }
+    atomic_store_explicit(&live_set, set, memory_order_release);
+
+    unsigned epoch = atomic_fetch_add(&set_epoch, 1);
+    while (atomic_load_explicit(&set_readers[epoch & 1].count, memory_order_acquire) != 0) {
+        sched_yield();
+    }
+
+    if (add) {
+        set_add(old, add);
+    }
+    if (remove) {
+        set_remove(old, remove);
+        if (remove->slot < set->count) {
+            set->traders[remove->slot]->slot = remove->slot;    // moved into its place
+        }
+    }
+}
+
+/*
+ * FNV-1a hash of a trader's name.
+ */
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Find the logged-in trader with a name.  log_mutex must be held.
+ *
+ * @return  The trader, or NULL if there is none.
+ */
+static TRADER *session_find(const char *name, uint64_t hash) {
+    for (size_t i = hash & sessions.mask; sessions.slots[i]; i = (i + 1) & sessions.mask) {
+        TRADER *trader = sessions.slots[i];
+        if (trader->hash == hash && strcmp(trader->name, name) == 0) {
+            return trader;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Enter a trader in the session table, which has room for it.
+ */
+static void session_insert(TRADER *trader) {
+    size_t i = trader->hash & sessions.mask;
+    while (sessions.slots[i]) {
+        i = (i + 1) & sessions.mask;
+    }
+    sessions.slots[i] = trader;
+}
+
+/*
+ * Remove a trader from the session table, moving back any that follow it
+ * in its run so that no search stops short of them.
+ */
+static void session_delete(TRADER *trader) {
+    size_t i = trader->hash & sessions.mask;
+    while (sessions.slots[i] != trader) {
+        i = (i + 1) & sessions.mask;
+    }
+    for (size_t j = (i + 1) & sessions.mask; sessions.slots[j]; j = (j + 1) & sessions.mask) {
+        size_t home = sessions.slots[j]->hash & sessions.mask;
+        // Move it into the hole unless its home lies between the hole and it
+        if (((j - home) & sessions.mask) >= ((j - i) & sessions.mask)) {
+            sessions.slots[i] = sessions.slots[j];
+            i = j;
+        }
+    }
+    sessions.slots[i] = NULL;
+}
+
+/*
+ * The writer thread, which drains the queues of traders whose sockets
+ * could not take everything sent to them at once.
+ */
+static struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;          // guards pending and stop; taken after a trader's send_mutex
+    TRADER **pending;               // traders with bytes queued, one reference each
+    size_t npending;
+    size_t cap;
+    int wake[2];                    // pipe written to wake the thread
+    bool stop;
+} writer;
+
+static void *writer_thread(void *arg);
+
+/*
+ * Encode a packet into a new buffer, with one reference.
+ *
+ * @param iov  The header and payload.
+ * @param iovcnt  1 or 2.
+ * @param skip  Leading bytes to leave out.
+ * @return  The buffer, or NULL if memory could not be allocated.
+ */
+static struct pkt_buf *pkt_buf_new(struct iovec *iov, int iovcnt, size_t skip) {
+    size_t len = iov[0].iov_len + ((iovcnt > 1) ? iov[1].iov_len : 0) - skip;
+    struct pkt_buf *buf = malloc(sizeof(struct pkt_buf) + len);
+    if (!buf) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+
+    char *dst = buf->data;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t n = iov[i].iov_len;
+        if (skip >= n) {
+            skip -= n;
+            continue;
+        }
+        memcpy(dst, (char *)iov[i].iov_base + skip, n - skip);
+        dst += n - skip;
+        skip = 0;
+    }
+    return buf;
+}
+
+static void pkt_buf_unref(struct pkt_buf *buf) {
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+        free(buf);
+    }
+}
+
+/*
+ * Drop everything in a queue.
+ */
+static void out_clear(struct out_queue *q) {
+    for (size_t i = 0; i < q->count; i++) {
+        pkt_buf_unref(q->segs[(q->head + i) % q->cap].buf);
+    }
+    q->head = q->count = q->len = 0;
+}
+
 int traders_init() {
     if (pthread_mutex_init(&log_mutex, NULL) != 0) {
         return -1;
     }
-    memset(log_table, 0, sizeof(log_table));
+    size_t nslots = 2;
+    while (nslots < 2 * config.max_traders) {
+        nslots <<= 1;
+    }
+    sessions.mask = nslots - 1;
+    sessions.slots = calloc(nslots, sizeof(TRADER *));
+    sets[0].count = sets[1].count = 0;
+    sets[0].traders = malloc(config.max_traders * sizeof(TRADER *));
+    sets[1].traders = malloc(config.max_traders * sizeof(TRADER *));
+    atomic_init(&live_set, &sets[0]);
+    atomic_init(&set_epoch, 0);
+    atomic_init(&set_readers[0].count, 0);
+    atomic_init(&set_readers[1].count, 0);
+
+    writer.npending = 0;
+    writer.cap = config.max_traders;
+    writer.stop = false;
+    writer.pending = malloc(writer.cap * sizeof(TRADER *));
+    if (!sessions.slots || !sets[0].traders || !sets[1].traders || !writer.pending) {
+        goto fail;
+    }
+    if (pipe(writer.wake) == -1) {
+        goto fail;
+    }
+    fcntl(writer.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(writer.wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&writer.mutex, NULL);
+    if (pthread_create(&writer.thread, NULL, writer_thread, NULL) != 0) {
+        pthread_mutex_destroy(&writer.mutex);
+        close(writer.wake[0]);
+        close(writer.wake[1]);
+        goto fail;
+    }
     return 0;
+
+fail:
+    free(writer.pending);
+    free(sets[0].traders);
+    free(sets[1].traders);
+    free(sessions.slots);
+    pthread_mutex_destroy(&log_mutex);
+    return -1;
+}
+
+static void writer_wake(void) {
+    char c = 0;
+    // A full pipe already wakes the thread, so a failed write needs no retry
+    if (write(writer.wake[1], &c, 1) == -1) {
+        return;
+    }
 }
 
 void traders_fini() {
+    pthread_mutex_lock(&writer.mutex);
+    writer.stop = true;
+    pthread_mutex_unlock(&writer.mutex);
+    writer_wake();
+    pthread_join(writer.thread, NULL);
+    for (size_t i = 0; i < writer.npending; i++) {
+        trader_unref(writer.pending[i], "writer");
+    }
+    free(writer.pending);
+    close(writer.wake[0]);
+    close(writer.wake[1]);
+    pthread_mutex_destroy(&writer.mutex);
+
     pthread_mutex_lock(&log_mutex);
-    for (int i = 0; i < MAX_TRADERS; i++) {
-        if (log_table[i]) {
-            TRADER *tmp = log_table[i];
-            log_table[i] = NULL;
-            trader_unref(tmp, "traders_fini");
-        }
+    struct trader_set *set = atomic_load(&live_set);
+    while (set->count > 0) {
+        TRADER *trader = set->traders[set->count - 1];
+        session_delete(trader);
+        set_change(NULL, trader);
+        trader_unref(trader, "traders_fini");
     }
     pthread_mutex_unlock(&log_mutex);
     pthread_mutex_destroy(&log_mutex);
+    free(sets[0].traders);
+    free(sets[1].traders);
+    free(sessions.slots);
+}
+
+/*
+ * Create a trader with a reference count of one.
+ *
+ * @return  The trader, or NULL if memory could not be allocated.
+ */
+static TRADER *trader_new(ACCOUNT *acc, int fd, const char *name) {
+    TRADER *trader = malloc(sizeof(struct trader));
+    if (!trader) {
+        return NULL;
+    }
+    trader->acc = acc;
+    trader->fd = fd;
+    trader->name = strdup(name);
+    if (!trader->name) {
+        free(trader);
+        return NULL;
+    }
+    atomic_init(&trader->ref_count, 1);
+    pthread_mutex_init(&trader->send_mutex, NULL);
+    memset(&trader->out, 0, sizeof(trader->out));
+    trader->polling = trader->closed = false;
+    trader->hash = 0;
+    trader->slot = 0;
+    memset(&trader->stats, 0, sizeof(trader->stats));
+    memset(&trader->md, 0, sizeof(trader->md));
+    return trader;
 }
 
 TRADER *trader_login(int fd, char *name) {
+    uint64_t hash = name_hash(name);
     pthread_mutex_lock(&log_mutex);
-    int free_slot = -1;
-    for (int i = 0; i < MAX_TRADERS; i++) {
-        // Account already logged in
-        if (log_table[i]) {
-            if (strcmp(log_table[i]->name, name) == 0) {
-                pthread_mutex_unlock(&log_mutex);
-                return NULL;
-            }
-        }
-        // Found a free slot
-        if ((free_slot == -1) && !log_table[i]) {
-            free_slot = i;
-        }
+    // Account already logged in
+    if (session_find(name, hash)) {
+        pthread_mutex_unlock(&log_mutex);
+        return NULL;
     }
 
-    // No free slots could be found
-    if (free_slot == -1) {
+    // No room for another
+    if (atomic_load(&live_set)->count >= config.max_traders) {
         pthread_mutex_unlock(&log_mutex);
         return NULL;
     }
@@ -71,132 +433,448 @@ TRADER *trader_login(int fd, char *name) {
         pthread_mutex_unlock(&log_mutex);
         return NULL;
     }
-    TRADER *trader = malloc(sizeof(struct trader));
+    TRADER *trader = trader_new(acc, fd, name);
     if (!trader) {
         pthread_mutex_unlock(&log_mutex);
         return NULL;
     }
-    trader->acc = acc;
-    trader->fd = fd;
-    trader->name = strdup(name);
-    if (!trader->name) {
-        free(trader);
-        pthread_mutex_unlock(&log_mutex);
-        return NULL;
-    }
-    trader->ref_count = 1;
 
-    pthread_mutexattr_t recursiveMutexAttr;
-    pthread_mutexattr_init(&recursiveMutexAttr);
-    pthread_mutexattr_settype(&recursiveMutexAttr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&trader->mutex, &recursiveMutexAttr);
-
-    log_table[free_slot] = trader;
+    trader->hash = hash;
+    session_insert(trader);
+    set_change(trader, NULL);
     pthread_mutex_unlock(&log_mutex);
     return trader;
 }
 
 void trader_logout(TRADER *trader) {
     pthread_mutex_lock(&log_mutex);
-    int trader_index = -1;
-    for (int i = 0; i < MAX_TRADERS; i++) {
-        if (log_table[i]) {
-            if (strcmp(log_table[i]->name, trader->name) == 0) {
-                trader_index = i;
-                break;
-            }
-        }
-    }
-
     // shouldn't happen... caller won't know error since void return value
     // error check anyway
-    if (trader_index == -1) {
+    if (session_find(trader->name, trader->hash) != trader) {
         pthread_mutex_unlock(&log_mutex);
         return;
     }
 
-    log_table[trader_index] = NULL;
+    session_delete(trader);
+
+    // Whatever is still queued is for a client that has gone, and nothing
+    // more is sent to it by anyone who has yet to see it gone from the set
+    pthread_mutex_lock(&trader->send_mutex);
+    info("Trader %s: %lu packets, %lu bytes sent in %lu writes, high-water mark %zu bytes", trader->name,
+         (unsigned long)trader->stats.packets, (unsigned long)trader->stats.bytes,
+         (unsigned long)trader->stats.writes, trader->stats.high_water);
+    trader->closed = true;
+    out_clear(&trader->out);
+    if (trader->polling) {
+        writer_wake();              // so that the writer lets go of it
+    }
+    pthread_mutex_unlock(&trader->send_mutex);
+
+    // Broadcasts hold no reference, so this must wait until none can reach it
+    set_change(NULL, trader);
     trader_unref(trader, "logout");
 
     pthread_mutex_unlock(&log_mutex);
 }
 
+/*
+ * Reference counts are atomic, so that taking or dropping a reference never
+ * waits, least of all for a send.  The reasons are only traced in debug builds.
+ */
 TRADER *trader_ref(TRADER *trader, char *why) {
-    pthread_mutex_lock(&trader->mutex);
-    (trader->ref_count)++;
-    pthread_mutex_unlock(&trader->mutex);
+    atomic_fetch_add_explicit(&trader->ref_count, 1, memory_order_relaxed);
+    debug("Reference trader %s for %s (count now %d)", trader->name, why, atomic_load(&trader->ref_count));
     return trader;
 }
 
 void trader_unref(TRADER *trader, char *why) {
-    pthread_mutex_lock(&trader->mutex);
-    // Ref count of trader before decrement == 0: abort
-    if (trader->ref_count == 0) {
-        pthread_mutex_unlock(&trader->mutex);
-        // Don't destroy mutex, immediately abort
+    // Release our writes to the trader to whoever frees it, and acquire theirs
+    int count = atomic_fetch_sub_explicit(&trader->ref_count, 1, memory_order_acq_rel);
+    debug("Release trader %s for %s (count now %d)", trader->name, why, count - 1);
+    if (count <= 0) {
         abort();
     }
-    (trader->ref_count)--;
-    // Ref count of trader after decrement == 0: free resources
-    if (trader->ref_count == 0) {
-        pthread_mutex_unlock(&trader->mutex);
-        pthread_mutex_destroy(&trader->mutex);
+    if (count == 1) {
+        pthread_mutex_destroy(&trader->send_mutex);
+        out_clear(&trader->out);
+        free(trader->out.segs);
         free(trader->name);
         free(trader);
-        return;
     }
-    pthread_mutex_unlock(&trader->mutex);
 }
 
 ACCOUNT *trader_get_account(TRADER *trader) {
     return trader->acc;
 }
 
-int trader_send_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
-    pthread_mutex_lock(&trader->mutex);
-    if ((proto_send_packet(trader->fd, pkt, data)) == -1) {
-        pthread_mutex_unlock(&trader->mutex);
+TRADER *trader_detached(ACCOUNT *account) {
+    return trader_new(account, -1, account_get_name(account));     // not connected
+}
+
+/*
+ * Find the trader logged in to an account.
+ *
+ * @return  The trader, with a reference held, or NULL if nobody is logged in to it.
+ */
+static TRADER *find_logged_in(ACCOUNT *account) {
+    TRADER *trader = NULL;
+    unsigned epoch = set_enter();
+    struct trader_set *set = atomic_load_explicit(&live_set, memory_order_acquire);
+    for (size_t i = 0; i < set->count; i++) {
+        if (set->traders[i]->acc == account) {
+            trader = trader_ref(set->traders[i], "detached send");
+            break;
+        }
+    }
+    set_leave(epoch);
+    return trader;
+}
+
+/*
+ * Stop sending to a trader whose client cannot keep up or has gone, and
+ * shut its socket down so that the thread serving it logs it out.
+ * The trader's send_mutex must be held.
+ */
+static void cut_off(TRADER *trader) {
+    if (trader->closed) {
+        return;
+    }
+    warn("Cutting off trader %s (%zu bytes queued)", trader->name, trader->out.len);
+    trader->closed = true;
+    out_clear(&trader->out);
+    shutdown(trader->fd, SHUT_RDWR);
+}
+
+/*
+ * Write as much of the queue to the socket as it takes without blocking,
+ * up to OUT_IOV_MAX packets per system call.  The trader's send_mutex must be held.
+ *
+ * @return 0 if successful (even if bytes remain queued), -1 if the socket failed.
+ */
+static int out_flush(TRADER *trader) {
+    struct out_queue *q = &trader->out;
+
+    while (q->count > 0) {
+        struct iovec iov[OUT_IOV_MAX];
+        size_t n = (q->count < OUT_IOV_MAX) ? q->count : OUT_IOV_MAX;
+        for (size_t i = 0; i < n; i++) {
+            struct out_seg *seg = &q->segs[(q->head + i) % q->cap];
+            iov[i].iov_base = seg->buf->data + seg->off;
+            iov[i].iov_len = seg->buf->len - seg->off;
+        }
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t sent = sendmsg(trader->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        trader->stats.writes++;
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        // Release the packets written in full, and note how far into the next one
+        q->len -= sent;
+        while (sent > 0) {
+            struct out_seg *seg = &q->segs[q->head];
+            size_t left = seg->buf->len - seg->off;
+            if ((size_t)sent < left) {
+                seg->off += sent;
+                break;
+            }
+            sent -= left;
+            pkt_buf_unref(seg->buf);
+            q->head = (q->head + 1) % q->cap;
+            q->count--;
+        }
+    }
+    q->head = 0;
+    return 0;
+}
+
+/*
+ * Add a packet, or the part of it the socket did not take, to a trader's
+ * queue, and have the writer thread send it.  The trader's send_mutex must be held.
+ *
+ * @param buf  The packet, of which the queue takes over one reference.
+ * @param off  Leading bytes of it already written.
+ * @return 0 if successful, -1 if the queue is full (the reference is dropped).
+ */
+static int out_queue(TRADER *trader, struct pkt_buf *buf, size_t off) {
+    struct out_queue *q = &trader->out;
+
+    if (q->len + (buf->len - off) > config.out_queue_size) {
+        pkt_buf_unref(buf);
         return -1;
     }
-    pthread_mutex_unlock(&trader->mutex);
+    if (q->count == q->cap) {
+        // Double the ring, moving the segments to the front of the new one
+        size_t cap = q->cap ? 2 * q->cap : OUT_IOV_MAX;
+        struct out_seg *segs = malloc(cap * sizeof(struct out_seg));
+        if (!segs) {
+            pkt_buf_unref(buf);
+            return -1;
+        }
+        for (size_t i = 0; i < q->count; i++) {
+            segs[i] = q->segs[(q->head + i) % q->cap];
+        }
+        free(q->segs);
+        q->segs = segs;
+        q->cap = cap;
+        q->head = 0;
+    }
+    q->segs[(q->head + q->count) % q->cap] = (struct out_seg){ buf, off };
+    q->count++;
+    q->len += buf->len - off;
+    if (q->len > trader->stats.high_water) {
+        trader->stats.high_water = q->len;
+    }
+
+    if (!trader->polling) {
+        pthread_mutex_lock(&writer.mutex);
+        if (writer.npending == writer.cap) {
+            TRADER **tmp = realloc(writer.pending, 2 * writer.cap * sizeof(TRADER *));
+            if (!tmp) {
+                pthread_mutex_unlock(&writer.mutex);
+                return -1;
+            }
+            writer.pending = tmp;
+            writer.cap *= 2;
+        }
+        writer.pending[writer.npending++] = trader_ref(trader, "writer");
+        pthread_mutex_unlock(&writer.mutex);
+        trader->polling = true;
+        writer_wake();
+    }
     return 0;
 }
 
-static void copy_table(TRADER **log) {
-    pthread_mutex_lock(&log_mutex);
-    for (int i = 0; i < MAX_TRADERS; i++) {
-        if (log_table[i]) {
-            log[i] = trader_ref(log_table[i], "broadcast");
+/*
+ * Send a packet to a connected trader: straight to the socket if nothing is
+ * queued ahead of it, with whatever the socket cannot take now queued, never
+ * waited for.
+ *
+ * @param iov  The header and payload.
+ * @param iovcnt  1 or 2.
+ * @param shared  A buffer already holding the packet, or NULL to copy the
+ * part to be queued into a new one.
+ * @return 0 if successful, -1 if the trader is closed or has been cut off.
+ */
+static int send_iov(TRADER *trader, struct iovec *iov, int iovcnt, struct pkt_buf *shared) {
+    size_t size = iov[0].iov_len + ((iovcnt > 1) ? iov[1].iov_len : 0);
+
+    pthread_mutex_lock(&trader->send_mutex);
+    if (trader->closed) {
+        pthread_mutex_unlock(&trader->send_mutex);
+        return -1;
+    }
+
+    ssize_t sent = 0;
+    if (trader->out.count == 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        while ((sent = sendmsg(trader->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+            continue;
+        }
+        trader->stats.writes++;
+        if (sent == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                cut_off(trader);
+                pthread_mutex_unlock(&trader->send_mutex);
+                return -1;
+            }
+            sent = 0;
+        }
+    }
+    if ((size_t)sent < size) {
+        struct pkt_buf *buf = shared;
+        if (buf) {
+            atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
         } else {
-            log[i] = NULL;
+            buf = pkt_buf_new(iov, iovcnt, sent);
+            sent = 0;
+        }
+        if (!buf || out_queue(trader, buf, sent) == -1) {
+            cut_off(trader);
+            pthread_mutex_unlock(&trader->send_mutex);
+            return -1;
         }
     }
-    pthread_mutex_unlock(&log_mutex);
+    trader->stats.packets++;
+    trader->stats.bytes += size;
+    pthread_mutex_unlock(&trader->send_mutex);
+    return 0;
+}
+
+int trader_send_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
+    // A detached trader passes packets on to whoever is logged in to its account
+    if (trader->fd == -1) {
+        TRADER *current = find_logged_in(trader->acc);
+        if (!current) {
+            return -1;
+        }
+        int ret = trader_send_packet(current, pkt, data);
+        trader_unref(current, "detached send");
+        return ret;
+    }
+
+    if (data == NULL) {
+        pkt->size = 0;
+    }
+    struct iovec iov[2] = {
+        { pkt, sizeof(BRS_PACKET_HEADER) },
+        { data, ntohs(pkt->size) }
+    };
+    return send_iov(trader, iov, (iov[1].iov_len > 0) ? 2 : 1, NULL);
+}
+
+/*
+ * Thread that writes out the queues of the traders on the pending list as
+ * their sockets become writable, and drops them from the list once their
+ * queues are empty or they have been closed.
+ */
+static void *writer_thread(void *arg) {
+    struct pollfd *fds = NULL;
+    TRADER **traders = NULL;
+    size_t cap = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&writer.mutex);
+        if (writer.stop) {
+            pthread_mutex_unlock(&writer.mutex);
+            break;
+        }
+        // Only this thread removes traders, so the copies stay referenced
+        if (cap < writer.npending + 1) {
+            cap = writer.cap + 1;
+            free(fds);
+            free(traders);
+            fds = malloc(cap * sizeof(struct pollfd));
+            traders = malloc(cap * sizeof(TRADER *));
+            if (!fds || !traders) {
+                pthread_mutex_unlock(&writer.mutex);
+                error("Writer thread out of memory");
+                abort();
+            }
+        }
+        size_t n = writer.npending;
+        memcpy(traders, writer.pending, n * sizeof(TRADER *));
+        pthread_mutex_unlock(&writer.mutex);
+
+        fds[0] = (struct pollfd){ .fd = writer.wake[0], .events = POLLIN };
+        for (size_t i = 0; i < n; i++) {
+            fds[i + 1] = (struct pollfd){ .fd = traders[i]->fd, .events = POLLOUT };
+        }
+        if (poll(fds, n + 1, -1) == -1 && errno != EINTR) {
+            error("poll: %s", strerror(errno));
+            abort();
+        }
+        if (fds[0].revents & POLLIN) {
+            char buf[64];
+            while (read(writer.wake[0], buf, sizeof(buf)) > 0) {
+                continue;
+            }
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            TRADER *trader = traders[i];
+            if (fds[i + 1].revents == 0) {
+                continue;
+            }
+            pthread_mutex_lock(&trader->send_mutex);
+            if (!trader->closed && out_flush(trader) == -1) {
+                cut_off(trader);
+            }
+            bool done = trader->closed || trader->out.count == 0;
+            if (done) {
+                trader->polling = false;
+            }
+            pthread_mutex_unlock(&trader->send_mutex);
+            if (!done) {
+                continue;
+            }
+
+            pthread_mutex_lock(&writer.mutex);
+            for (size_t j = 0; j < writer.npending; j++) {
+                if (writer.pending[j] == trader) {
+                    writer.pending[j] = writer.pending[--writer.npending];
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&writer.mutex);
+            trader_unref(trader, "writer");
+        }
+    }
+
+    free(fds);
+    free(traders);
+    return NULL;
 }
 
 int trader_broadcast_packet(BRS_PACKET_HEADER *pkt, void *data) {
-    // We can't directly access the log_table entries (or a deadlock will occur)
-    TRADER *tmp[MAX_TRADERS];            // let's store pointers in a tmp array
-    copy_table(tmp);                     // call helper
+    return trader_broadcast_packet_if(pkt, data, NULL, NULL);
+}
+
+int trader_broadcast_packet_if(BRS_PACKET_HEADER *pkt, void *data,
+                               bool (*admit)(TRADER *trader, void *arg), void *arg) {
+    // Encode the packet once; every trader is sent the same bytes, and a
+    // trader that cannot take them at once queues a reference to them
+    if (data == NULL) {
+        pkt->size = 0;
+    }
+    struct iovec iov[2] = {
+        { pkt, sizeof(BRS_PACKET_HEADER) },
+        { data, ntohs(pkt->size) }
+    };
+    struct pkt_buf *buf = pkt_buf_new(iov, (iov[1].iov_len > 0) ? 2 : 1, 0);
+    if (!buf) {
+        return -1;
+    }
+    struct iovec whole = { buf->data, buf->len };
 
     int err = 0;
-    for (int i = 0; i < MAX_TRADERS; i++) {
-        TRADER *trader = tmp[i];
-        if (!trader) {
-            continue;
-        }
-        if (err == -1) {
-            trader_unref(trader, "broadcast");
+    unsigned epoch = set_enter();
+    struct trader_set *set = atomic_load_explicit(&live_set, memory_order_acquire);
+    for (size_t i = 0; i < set->count; i++) {
+        TRADER *trader = set->traders[i];
+        if (admit && !admit(trader, arg)) {
             continue;
         }
-        if ((trader_send_packet(trader, pkt, data)) == -1) {
+        // A trader that has been cut off must not keep the rest from being sent to
+        if (send_iov(trader, &whole, 1, buf) == -1) {
             err = -1;
         }
-        trader_unref(trader, "broadcast");
     }
+    set_leave(epoch);
+    pkt_buf_unref(buf);
     return err;
 }
 
+void trader_foreach(void (*fn)(TRADER *trader, void *arg), void *arg) {
+    unsigned epoch = set_enter();
+    struct trader_set *set = atomic_load_explicit(&live_set, memory_order_acquire);
+    for (size_t i = 0; i < set->count; i++) {
+        fn(set->traders[i], arg);
+    }
+    set_leave(epoch);
+}
+
+size_t trader_backlog(TRADER *trader) {
+    pthread_mutex_lock(&trader->send_mutex);
+    size_t queued = trader->out.len;
+    pthread_mutex_unlock(&trader->send_mutex);
+    return queued;
+}
+
+void trader_get_stats(TRADER *trader, struct trader_stats *stats) {
+    pthread_mutex_lock(&trader->send_mutex);
+    *stats = trader->stats;
+    stats->queued = trader->out.len;
+    pthread_mutex_unlock(&trader->send_mutex);
+}
+
+struct md_conflation *trader_conflation(TRADER *trader) {
+    return &trader->md;
+}
+
 // functions taken from server.c (same formatting, except trader_send_packet over proto_send_packet) 
 
 int trader_send_ack(TRADER *trader, BRS_STATUS_INFO *info) {
@@ -1,10 +1,33 @@
 #include <criterion/criterion.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include <poll.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "book.h"
+#include "account.h"
+#include "account_ext.h"
+#include "trader.h"
+#include "trader_ext.h"
+#include "exchange.h"
+#include "exchange_ext.h"
+#include "journal.h"
+#include "md_feed.h"
+#include "snapshot.h"
+#include "config.h"
+#include "stubs.h"
 
 static void init() {
 #ifndef NO_SERVER
@@ -71,3 +94,997 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/client -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * Initialize a book and insert the given orders into it, in order.
+ */
+static void book_with(struct book *bk, struct order *ords, size_t n) {
+    cr_assert_eq(book_init(bk), 0, "book_init failed");
+    for (size_t i = 0; i < n; i++) {
+        cr_assert_eq(book_insert(bk, &ords[i]), 0, "book_insert of order %zu failed", i);
+    }
+}
+
+#define BOOK_WITH(bk, ords) book_with((bk), (ords), sizeof(ords) / sizeof((ords)[0]))
+
+Test(student_suite, 02_book_price_time_priority, .timeout = 5) {
+    struct book bk;
+    struct order ords[] = {
+        { .order_id = 1, .side = BOOK_BUY, .price = 50, .quantity = 10 },
+        { .order_id = 2, .side = BOOK_BUY, .price = 55, .quantity = 5 },
+        { .order_id = 3, .side = BOOK_BUY, .price = 50, .quantity = 7 },
+        { .order_id = 4, .side = BOOK_SELL, .price = 60, .quantity = 3 },
+    };
+    BOOK_WITH(&bk, ords);
+
+    // Best bid is the highest price, regardless of arrival order
+    cr_assert_eq(book_best(&bk, BOOK_BUY)->order_id, 2, "Expected order 2 at best bid");
+    cr_assert_eq(book_best(&bk, BOOK_SELL)->order_id, 4, "Expected order 4 at best ask");
+    book_remove(&bk, &ords[1]);
+
+    // Within a level, the oldest order comes first
+    struct price_level *lvl = book_best_level(&bk, BOOK_BUY);
+    cr_assert_eq(lvl->price, 50, "Expected best bid 50, was %u", lvl->price);
+    cr_assert_eq(lvl->count, 2, "Expected 2 orders at 50, was %zu", lvl->count);
+    cr_assert_eq(lvl->total, 17, "Expected total 17 at 50, was %lu", lvl->total);
+    cr_assert_eq(lvl->head->order_id, 1, "Expected order 1 at head of level");
+    cr_assert_eq(book_find(&bk, 3), &ords[2], "book_find did not return order 3");
+
+    book_fini(&bk);
+}
+
+Test(student_suite, 03_book_fifo_within_level, .timeout = 5) {
+    struct book bk;
+    struct order ords[] = {
+        { .order_id = 1, .side = BOOK_SELL, .price = 70, .quantity = 4 },
+        { .order_id = 2, .side = BOOK_SELL, .price = 65, .quantity = 6 },
+        { .order_id = 3, .side = BOOK_SELL, .price = 65, .quantity = 2 },
+        { .order_id = 4, .side = BOOK_SELL, .price = 68, .quantity = 1 },
+        { .order_id = 5, .side = BOOK_SELL, .price = 65, .quantity = 3 },
+    };
+    BOOK_WITH(&bk, ords);
+
+    // A partial fill leaves the order at the head of its level
+    book_reduce(&ords[1], 5);
+    cr_assert_eq(book_best(&bk, BOOK_SELL)->order_id, 2, "Expected order 2 at best ask");
+    cr_assert_eq(book_best_level(&bk, BOOK_SELL)->total, 6, "Expected total 6 at 65");
+
+    // Orders at the best price are matched in order of arrival,
+    // then the next best level takes over
+    orderid_t expect[] = { 2, 3, 5, 4, 1 };
+    for (int i = 0; i < 5; i++) {
+        struct order *ordp = book_best(&bk, BOOK_SELL);
+        cr_assert_not_null(ordp, "Book emptied early");
+        cr_assert_eq(ordp->order_id, expect[i], "Expected order %lu, was %lu",
+                     (unsigned long)expect[i], (unsigned long)ordp->order_id);
+        book_remove(&bk, ordp);
+    }
+    cr_assert_null(book_best_level(&bk, BOOK_SELL), "Expected empty ask side");
+
+    book_fini(&bk);
+}
+
+Test(student_suite, 04_book_available, .timeout = 5) {
+    struct book bk;
+    struct order ords[] = {
+        { .order_id = 1, .side = BOOK_SELL, .price = 10, .quantity = 5 },
+        { .order_id = 2, .side = BOOK_SELL, .price = 12, .quantity = 5 },
+        { .order_id = 3, .side = BOOK_SELL, .price = 15, .quantity = 5 },
+    };
+    BOOK_WITH(&bk, ords);
+
+    // Only the levels a buyer at the limit price could reach are counted
+    cr_assert_eq(book_available(&bk, BOOK_SELL, 9, 100), 0, "Expected nothing at 9");
+    cr_assert_eq(book_available(&bk, BOOK_SELL, 12, 100), 10, "Expected 10 up to 12");
+    cr_assert_eq(book_available(&bk, BOOK_SELL, 20, 100), 15, "Expected 15 up to 20");
+    cr_assert_geq(book_available(&bk, BOOK_SELL, 20, 3), 3, "Expected at least 3");
+    cr_assert_eq(book_available(&bk, BOOK_BUY, 1, 100), 0, "Expected no bids");
+
+    book_fini(&bk);
+}
+
+Test(student_suite, 05_book_amend_queue_position, .timeout = 5) {
+    struct book bk;
+    struct order ords[] = {
+        { .order_id = 1, .side = BOOK_BUY, .price = 40, .quantity = 8 },
+        { .order_id = 2, .side = BOOK_BUY, .price = 40, .quantity = 3 },
+        { .order_id = 3, .side = BOOK_BUY, .price = 39, .quantity = 2 },
+    };
+    BOOK_WITH(&bk, ords);
+
+    // Reducing the quantity keeps the order at the head of its level
+    cr_assert_eq(book_amend(&bk, &ords[0], 5, 40), 0, "book_amend failed");
+    cr_assert_eq(book_best(&bk, BOOK_BUY)->order_id, 1, "Expected order 1 to keep its place");
+    cr_assert_eq(book_best_level(&bk, BOOK_BUY)->total, 8, "Expected total 8 at 40");
+
+    // Increasing it sends the order to the back of the queue
+    cr_assert_eq(book_amend(&bk, &ords[0], 6, 40), 0, "book_amend failed");
+    cr_assert_eq(book_best(&bk, BOOK_BUY)->order_id, 2, "Expected order 2 at head after increase");
+
+    // A new price moves it behind the orders already at that price
+    cr_assert_eq(book_amend(&bk, &ords[1], 3, 39), 0, "book_amend failed");
+    struct price_level *lvl = book_best_level(&bk, BOOK_BUY);
+    cr_assert_eq(lvl->count, 1, "Expected one order left at 40");
+    book_remove(&bk, &ords[0]);
+    lvl = book_best_level(&bk, BOOK_BUY);
+    cr_assert_eq(lvl->price, 39, "Expected best bid 39");
+    cr_assert_eq(lvl->head->order_id, 3, "Expected order 3 ahead of amended order 2");
+    cr_assert_eq(lvl->tail->order_id, 2, "Expected order 2 at tail");
+    cr_assert_eq(lvl->total, 5, "Expected total 5 at 39");
+
+    book_fini(&bk);
+}
+
+Test(student_suite, 06_book_level_aggregates, .timeout = 5) {
+    struct book bk;
+    struct order ords[] = {
+        { .order_id = 1, .side = BOOK_BUY, .price = 30, .quantity = 4 },
+        { .order_id = 2, .side = BOOK_BUY, .price = 32, .quantity = 1 },
+        { .order_id = 3, .side = BOOK_BUY, .price = 30, .quantity = 6 },
+        { .order_id = 4, .side = BOOK_BUY, .price = 31, .quantity = 2 },
+    };
+    BOOK_WITH(&bk, ords);
+
+    // Levels are ranked from the best, with their aggregates kept current
+    funds_t prices[] = { 32, 31, 30 };
+    for (int i = 0; i < 3; i++) {
+        cr_assert_eq(book_level(&bk, BOOK_BUY, i)->price, prices[i], "Wrong price at rank %d", i);
+    }
+    cr_assert_null(book_level(&bk, BOOK_BUY, 3), "Expected only three levels");
+    book_reduce(&ords[2], 5);
+    struct price_level *lvl = book_level(&bk, BOOK_BUY, 2);
+    cr_assert_eq(lvl->total, 5, "Expected total 5 at 30, was %lu", lvl->total);
+    cr_assert_eq(lvl->count, 2, "Expected 2 orders at 30, was %zu", lvl->count);
+    book_remove(&bk, &ords[1]);
+    cr_assert_eq(book_level(&bk, BOOK_BUY, 0)->price, 31, "Expected best bid 31");
+
+    book_fini(&bk);
+}
+
+/*
+ * Check that every order in an array can be found in a book by its ID if
+ * it is marked live, and cannot be if it is not.
+ */
+static void check_index(struct book *bk, struct order *ords, bool *live, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct order *ordp = book_find(bk, ords[i].order_id);
+        cr_assert_eq(ordp, live[i] ? &ords[i] : NULL, "book_find(%lu) returned %p, expected %p",
+                     (unsigned long)ords[i].order_id, (void *)ordp, live[i] ? (void *)&ords[i] : NULL);
+        count += live[i];
+    }
+    cr_assert_eq(bk->index.count, count, "Expected %zu orders indexed, was %zu", count, bk->index.count);
+}
+
+#define CHURN_ORDERS 2000
+
+Test(student_suite, 07_book_index_churn, .timeout = 30) {
+    static struct order ords[CHURN_ORDERS];
+    static bool live[CHURN_ORDERS];
+    struct book bk;
+    cr_assert_eq(book_init(&bk), 0, "book_init failed");
+    size_t initial = bk.index.mask + 1;
+
+    // Mostly sequential IDs, as the exchange hands out, but every eighth one
+    // shares its home slot with a low ID, in the initial table and every
+    // larger one, so that probe runs form and have to be repaired on deletion
+    for (size_t i = 0; i < CHURN_ORDERS; i++) {
+        ords[i].order_id = (i % 8 == 7) ? (orderid_t)(i / 8 + 1) + (orderid_t)(i + 1) * 0x10000 : i + 1;
+        ords[i].side = (i % 2) ? BOOK_SELL : BOOK_BUY;
+        ords[i].price = (i % 2) ? 200 + i % 13 : 100 - i % 11;
+        ords[i].quantity = 1;
+    }
+
+    // Insert them all, growing the index several times
+    for (size_t i = 0; i < CHURN_ORDERS; i++) {
+        cr_assert_eq(book_insert(&bk, &ords[i]), 0, "book_insert of order %zu failed", i);
+        live[i] = true;
+        check_index(&bk, ords, live, CHURN_ORDERS);
+    }
+    cr_assert_gt(bk.index.mask + 1, 2 * initial, "Expected the index to have grown");
+
+    // Remove from the middle of the probe runs: the low IDs whose slots the
+    // colliding IDs had to probe past, and then every third order
+    for (size_t i = 0; i < CHURN_ORDERS / 8; i++) {
+        if (live[i]) {
+            book_remove(&bk, &ords[i]);
+            live[i] = false;
+            check_index(&bk, ords, live, CHURN_ORDERS);
+        }
+    }
+    for (size_t i = 0; i < CHURN_ORDERS; i += 3) {
+        if (live[i]) {
+            book_remove(&bk, &ords[i]);
+            live[i] = false;
+            check_index(&bk, ords, live, CHURN_ORDERS);
+        }
+    }
+
+    // Put them back, then empty the book in a scrambled order
+    for (size_t i = 0; i < CHURN_ORDERS; i++) {
+        if (!live[i]) {
+            cr_assert_eq(book_insert(&bk, &ords[i]), 0, "book_insert of order %zu failed", i);
+            live[i] = true;
+            check_index(&bk, ords, live, CHURN_ORDERS);
+        }
+    }
+    for (size_t k = 0; k < CHURN_ORDERS; k++) {
+        size_t i = (k * 1237) % CHURN_ORDERS;
+        book_remove(&bk, &ords[i]);
+        live[i] = false;
+        check_index(&bk, ords, live, CHURN_ORDERS);
+    }
+    cr_assert_null(book_best_level(&bk, BOOK_BUY), "Expected empty bid side");
+    cr_assert_null(book_best_level(&bk, BOOK_SELL), "Expected empty ask side");
+
+    book_fini(&bk);
+}
+
+/*
+ * The exchange and session tests run in the test process, with the
+ * benchmark's stubs in place of the sockets.  The packets written to each
+ * trader are counted by type.
+ */
+#define TEST_TRADERS 200
+
+static atomic_uint packets[TEST_TRADERS][256];
+static EXCHANGE *xchg;
+static TRADER *seller, *buyer;
+
+static void count_packet(int fd, const BRS_PACKET_HEADER *hdr, size_t len) {
+    atomic_fetch_add(&packets[fd - BENCH_FAKE_FD][hdr->type], 1);
+}
+
+static void exchange_setup(void) {
+    bench_capture = count_packet;
+    cr_assert_eq(accounts_init(), 0, "accounts_init failed");
+    cr_assert_eq(traders_init(), 0, "traders_init failed");
+    cr_assert_not_null(xchg = exchange_init(), "exchange_init failed");
+    cr_assert_not_null(seller = trader_login(BENCH_FAKE_FD, "seller"), "Login of seller failed");
+    cr_assert_not_null(buyer = trader_login(BENCH_FAKE_FD + 1, "buyer"), "Login of buyer failed");
+    account_increase_inventory(trader_get_account(seller), 100);
+    account_increase_balance(trader_get_account(buyer), 1000);
+}
+
+/*
+ * Stop the exchange, so that every notification has been written.
+ */
+static void exchange_stop(void) {
+    if (xchg) {
+        exchange_fini(xchg);
+        xchg = NULL;
+    }
+}
+
+static void exchange_teardown(void) {
+    exchange_stop();
+    trader_logout(seller);
+    trader_logout(buyer);
+    traders_fini();
+    accounts_fini();
+}
+
+static void expect_account(TRADER *trader, funds_t balance, quantity_t inventory) {
+    BRS_STATUS_INFO info;
+    account_get_status(trader_get_account(trader), &info);
+    cr_assert_eq(ntohl(info.balance), balance, "Expected balance %u, was %u", balance, ntohl(info.balance));
+    cr_assert_eq(ntohl(info.inventory), inventory, "Expected inventory %u, was %u",
+                 inventory, ntohl(info.inventory));
+}
+
+static void expect_packets(TRADER *trader, BRS_PACKET_TYPE type, unsigned count) {
+    unsigned n = atomic_load(&packets[trader == buyer][type]);
+    cr_assert_eq(n, count, "Expected %u packets of type %d, was %u", count, type, n);
+}
+
+Test(student_suite, 08_take_fok_killed, .init = exchange_setup, .fini = exchange_teardown, .timeout = 5) {
+    cr_assert_neq(exchange_post_sell(xchg, seller, 5, 10), 0, "Sell order was not posted");
+
+    // Not enough on offer: nothing is filled and every cent comes back,
+    // but the order is accepted and its ID is used up
+    quantity_t remaining;
+    orderid_t id = exchange_take_order(xchg, 0, buyer, BOOK_BUY, 8, 12, BRS_ORDER_FOK, &remaining);
+    cr_assert_neq(id, 0, "Killed order was not accepted");
+    cr_assert_eq(remaining, 8, "Expected 8 remaining, was %u", remaining);
+    cr_assert_gt(exchange_next_order_id(xchg), id, "ID of killed order was not used up");
+    expect_account(buyer, 1000, 0);
+    expect_account(seller, 0, 95);
+
+    BRS_STATUS_INFO info;
+    exchange_get_status(xchg, NULL, &info);
+    cr_assert_eq(ntohl(info.ask), 10, "Expected the sell order to be left alone");
+
+    exchange_stop();
+    expect_packets(buyer, BRS_POSTED_PKT, 1);
+    expect_packets(buyer, BRS_BOUGHT_PKT, 0);
+    expect_packets(buyer, BRS_TRADED_PKT, 0);
+    expect_packets(buyer, BRS_CANCELED_PKT, 0);
+}
+
+Test(student_suite, 09_take_fok_filled, .init = exchange_setup, .fini = exchange_teardown, .timeout = 5) {
+    cr_assert_neq(exchange_post_sell(xchg, seller, 5, 10), 0, "Sell order was not posted");
+    cr_assert_neq(exchange_post_sell(xchg, seller, 5, 11), 0, "Sell order was not posted");
+
+    // Filled across two levels, each at the resting order's price
+    quantity_t remaining;
+    orderid_t id = exchange_take_order(xchg, 0, buyer, BOOK_BUY, 8, 12, BRS_ORDER_FOK, &remaining);
+    cr_assert_neq(id, 0, "Order was not accepted");
+    cr_assert_eq(remaining, 0, "Expected nothing remaining, was %u", remaining);
+    expect_account(buyer, 1000 - 5 * 10 - 3 * 11, 8);
+    expect_account(seller, 5 * 10 + 3 * 11, 90);
+
+    // Its fills are published, but the order itself never is
+    exchange_stop();
+    expect_packets(buyer, BRS_POSTED_PKT, 2);
+    expect_packets(buyer, BRS_BOUGHT_PKT, 2);
+    expect_packets(buyer, BRS_TRADED_PKT, 2);
+    expect_packets(seller, BRS_SOLD_PKT, 2);
+    expect_packets(buyer, BRS_CANCELED_PKT, 0);
+}
+
+Test(student_suite, 10_take_ioc_remainder, .init = exchange_setup, .fini = exchange_teardown, .timeout = 5) {
+    cr_assert_neq(exchange_post_sell(xchg, seller, 3, 10), 0, "Sell order was not posted");
+
+    // What can be filled is, and the funds for the rest are returned
+    quantity_t remaining;
+    orderid_t id = exchange_take_order(xchg, 0, buyer, BOOK_BUY, 5, 11, BRS_ORDER_IOC, &remaining);
+    cr_assert_neq(id, 0, "Order was not accepted");
+    cr_assert_eq(remaining, 2, "Expected 2 remaining, was %u", remaining);
+    expect_account(buyer, 1000 - 3 * 10, 3);
+
+    BRS_STATUS_INFO info;
+    exchange_get_status(xchg, NULL, &info);
+    cr_assert_eq(ntohl(info.bid), 0, "Expected the remainder not to rest in the book");
+
+    exchange_stop();
+    expect_packets(buyer, BRS_POSTED_PKT, 1);
+    expect_packets(buyer, BRS_BOUGHT_PKT, 1);
+    expect_packets(buyer, BRS_CANCELED_PKT, 0);
+}
+
+Test(student_suite, 11_take_insufficient_funds, .init = exchange_setup, .fini = exchange_teardown, .timeout = 5) {
+    cr_assert_neq(exchange_post_sell(xchg, seller, 100, 10), 0, "Sell order was not posted");
+
+    // An order the trader cannot cover is refused before anything else,
+    // even one that would be killed, and uses up no order ID
+    quantity_t remaining;
+    orderid_t next = exchange_next_order_id(xchg);
+    cr_assert_eq(exchange_take_order(xchg, 0, buyer, BOOK_BUY, 84, 12, BRS_ORDER_FOK, &remaining), 0,
+                 "Expected an order the buyer cannot cover to be refused");
+    cr_assert_eq(exchange_take_order(xchg, 0, buyer, BOOK_BUY, 200, 12, BRS_ORDER_FOK, &remaining), 0,
+                 "Expected an order the buyer cannot cover to be refused rather than killed");
+    cr_assert_eq(exchange_take_order(xchg, 0, buyer, BOOK_BUY, 84, 12, BRS_ORDER_IOC, &remaining), 0,
+                 "Expected an order the buyer cannot cover to be refused");
+    cr_assert_eq(exchange_take_order(xchg, 0, buyer, BOOK_SELL, 1, 5, BRS_ORDER_IOC, &remaining), 0,
+                 "Expected a sale without inventory to be refused");
+    cr_assert_eq(exchange_next_order_id(xchg), next, "Refused orders used up order IDs");
+    expect_account(buyer, 1000, 0);
+    expect_account(seller, 0, 0);
+
+    exchange_stop();
+    expect_packets(buyer, BRS_POSTED_PKT, 1);
+    expect_packets(buyer, BRS_BOUGHT_PKT, 0);
+}
+
+static TRADER *sessions[TEST_TRADERS];
+
+static void session_name(size_t i, char *name, size_t size) {
+    snprintf(name, size, "trader%zu", i);
+}
+
+static TRADER *session_login(size_t i) {
+    char name[32];
+    session_name(i, name, sizeof(name));
+    return trader_login(BENCH_FAKE_FD + i, name);
+}
+
+static void sessions_start(size_t max_traders) {
+    bench_capture = count_packet;
+    config.max_traders = max_traders;
+    cr_assert_eq(accounts_init(), 0, "accounts_init failed");
+    cr_assert_eq(traders_init(), 0, "traders_init failed");
+}
+
+static void sessions_teardown(void) {
+    for (size_t i = 0; i < TEST_TRADERS; i++) {
+        if (sessions[i]) {
+            trader_logout(sessions[i]);
+        }
+    }
+    traders_fini();
+    accounts_fini();
+}
+
+static void count_trader(TRADER *trader, void *arg) {
+    (*(size_t *)arg)++;
+}
+
+static size_t live_traders(void) {
+    size_t n = 0;
+    trader_foreach(count_trader, &n);
+    return n;
+}
+
+/*
+ * FNV-1a, as the session table hashes names.
+ */
+static uint64_t test_name_hash(const char *name) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+Test(student_suite, 12_sessions_beyond_64, .fini = sessions_teardown, .timeout = 10) {
+    sessions_start(TEST_TRADERS);
+
+    // Far more than the 64 traders there used to be room for
+    for (size_t i = 0; i < TEST_TRADERS; i++) {
+        cr_assert_not_null(sessions[i] = session_login(i), "Login of trader %zu failed", i);
+    }
+    cr_assert_eq(live_traders(), TEST_TRADERS, "Expected %d traders, was %zu", TEST_TRADERS, live_traders());
+
+    // Each of them can be found, so cannot log in twice, and is broadcast to
+    for (size_t i = 0; i < TEST_TRADERS; i++) {
+        cr_assert_null(session_login(i), "Trader %zu logged in twice", i);
+    }
+    BRS_PACKET_HEADER hdr = { .type = BRS_TRADED_PKT };
+    cr_assert_eq(trader_broadcast_packet(&hdr, NULL), 0, "Broadcast failed");
+    for (size_t i = 0; i < TEST_TRADERS; i++) {
+        cr_assert_eq(atomic_load(&packets[i][BRS_TRADED_PKT]), 1, "Trader %zu missed the broadcast", i);
+    }
+}
+
+Test(student_suite, 13_sessions_logout_mid_chain, .fini = sessions_teardown, .timeout = 5) {
+    sessions_start(8);
+
+    // Pick three names whose hashes agree in their low four bits, so that
+    // they share a home slot in the table (which has 16 slots for 8 traders)
+    // and form a probe run in the order they log in
+    size_t chain[3], found = 0;
+    char name[32];
+    session_name(0, name, sizeof(name));
+    uint64_t home = test_name_hash(name) & 0xf;
+    for (size_t i = 0; i < TEST_TRADERS && found < 3; i++) {
+        session_name(i, name, sizeof(name));
+        if ((test_name_hash(name) & 0xf) == home) {
+            chain[found++] = i;
+        }
+    }
+    cr_assert_eq(found, 3, "Could not find three colliding names");
+    for (size_t k = 0; k < 3; k++) {
+        cr_assert_not_null(sessions[chain[k]] = session_login(chain[k]), "Login of trader %zu failed", chain[k]);
+    }
+
+    // The ones either side of the middle can still be found once it has gone
+    trader_logout(sessions[chain[1]]);
+    sessions[chain[1]] = NULL;
+    cr_assert_eq(live_traders(), 2, "Expected 2 traders, was %zu", live_traders());
+    cr_assert_null(session_login(chain[0]), "Head of the chain was lost");
+    cr_assert_null(session_login(chain[2]), "Tail of the chain was lost");
+
+    // And the one that left can come back
+    cr_assert_not_null(sessions[chain[1]] = session_login(chain[1]), "Trader could not log in again");
+    cr_assert_null(session_login(chain[1]), "Trader logged in twice");
+}
+
+Test(student_suite, 14_sessions_max_traders, .fini = sessions_teardown, .timeout = 5) {
+    sessions_start(8);
+    for (size_t i = 0; i < 8; i++) {
+        cr_assert_not_null(sessions[i] = session_login(i), "Login of trader %zu failed", i);
+    }
+
+    // No room for a ninth until one of the eight leaves
+    cr_assert_null(session_login(8), "Expected login beyond config.max_traders to be refused");
+    trader_logout(sessions[3]);
+    sessions[3] = NULL;
+    cr_assert_not_null(sessions[8] = session_login(8), "Login after a logout was refused");
+    cr_assert_null(session_login(9), "Expected login beyond config.max_traders to be refused");
+    cr_assert_eq(live_traders(), 8, "Expected 8 traders, was %zu", live_traders());
+}
+
+/*
+ * The recovery test has a child process trade with the journal on, taking
+ * a snapshot part of the way through, then stop dead.  The parent recovers
+ * from what the child left in a temporary directory and compares the result
+ * with the state the child recorded before it stopped.
+ */
+static char journal_dir[] = "/tmp/bourse_tests.XXXXXX";
+
+/*
+ * What the child reports besides its state.
+ */
+struct recovery_report {
+    uint64_t last_seq;              // of the last journal record
+    uint64_t bytes;                 // appended to the only segment
+    orderid_t carol_order;          // resting order of a trader that has logged out
+    size_t len;                     // of the state that follows
+};
+
+static void recovery_setup(void) {
+    cr_assert_not_null(mkdtemp(journal_dir), "Cannot create a temporary directory");
+    config.journal_dir = journal_dir;
+    config.instruments = 2;
+    config.snapshot_interval = 0;
+}
+
+static void recovery_teardown(void) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", journal_dir);
+    system(cmd);
+}
+
+/*
+ * Set up the accounts, traders and exchange, and recover their state.
+ *
+ * @return  The exchange, or NULL if the state could not be recovered.
+ */
+static EXCHANGE *recovery_start(uint64_t *last_seq) {
+    if (accounts_init() == -1 || traders_init() == -1) {
+        return NULL;
+    }
+    EXCHANGE *x = exchange_init();
+    if (!x || snapshot_recover(x, last_seq) == -1) {
+        return NULL;
+    }
+    return x;
+}
+
+/*
+ * Record the state of an exchange as a snapshot would: the next order ID,
+ * every account, and the resting orders of every instrument in priority
+ * order with the accounts that own them.
+ *
+ * @return 0 if successful, -1 if the state does not fit in the writer's buffer.
+ */
+static int record_state(EXCHANGE *x, struct snapshot_writer *w) {
+    w->fd = -1;                     // everything has to fit in the buffer
+    w->err = 0;
+    w->len = 0;
+    exchange_lock_all(x);
+    accounts_lock_all();
+    orderid_t next = exchange_next_order_id(x);
+    snapshot_write(w, &next, sizeof(next));
+    accounts_write_snapshot(w, exchange_instruments(x));
+    exchange_write_snapshot(x, w);
+    accounts_unlock_all();
+    exchange_unlock_all(x);
+    return w->err ? -1 : 0;
+}
+
+/*
+ * Check a condition in the child, which reports failure by its exit status.
+ */
+#define CHILD_CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #cond); \
+            _exit(1); \
+        } \
+    } while (0)
+
+/*
+ * Trade, then write a report and the state to a file and stop without
+ * shutting anything down, as if the server had been killed.
+ */
+static void recovery_child(void) {
+    static struct snapshot_writer w;
+    uint64_t last_seq;
+    EXCHANGE *x = recovery_start(&last_seq);
+    CHILD_CHECK(x && journal_init(last_seq + 1) == 0);
+
+    TRADER *alice = trader_login(BENCH_FAKE_FD, "alice");
+    TRADER *bob = trader_login(BENCH_FAKE_FD + 1, "bob");
+    TRADER *carol = trader_login(BENCH_FAKE_FD + 2, "carol");
+    CHILD_CHECK(alice && bob && carol);
+    account_deposit(trader_get_account(alice), 10000);
+    account_deposit(trader_get_account(carol), 1000);
+    account_escrow(trader_get_account(bob), 0, 100);
+    account_escrow(trader_get_account(bob), 1, 50);
+
+    // Before the snapshot: resting orders, a trade, an amendment and a cancel
+    CHILD_CHECK(exchange_post_order(x, 0, bob, BOOK_SELL, 10, 20) != 0);
+    CHILD_CHECK(exchange_post_order(x, 0, bob, BOOK_SELL, 10, 21) != 0);
+    CHILD_CHECK(exchange_post_order(x, 0, alice, BOOK_BUY, 4, 22) != 0);
+    quantity_t qty;
+    orderid_t id = exchange_post_order(x, 1, alice, BOOK_BUY, 5, 30);
+    CHILD_CHECK(id != 0 && exchange_amend_order(x, 1, alice, id, 3, 31, &qty) == 0 && qty == 3);
+    id = exchange_post_order(x, 1, alice, BOOK_BUY, 2, 29);
+    CHILD_CHECK(id != 0 && exchange_cancel_order(x, 1, alice, id, &qty) == 0);
+    CHILD_CHECK(snapshot_take(x) == 0);
+
+    // After it, in the journal only: an order left behind by a trader that
+    // has logged out, and immediate orders, one of them killed
+    struct recovery_report rep = { 0 };
+    CHILD_CHECK((rep.carol_order = exchange_post_order(x, 0, carol, BOOK_BUY, 5, 15)) != 0);
+    trader_logout(carol);
+    CHILD_CHECK(exchange_post_order(x, 1, bob, BOOK_SELL, 7, 35) != 0);
+    CHILD_CHECK(exchange_take_order(x, 1, alice, BOOK_BUY, 20, 40, BRS_ORDER_FOK, &qty) != 0 && qty == 20);
+    CHILD_CHECK(exchange_post_order(x, 0, bob, BOOK_SELL, 2, 18) != 0);
+
+    // Last of all, an order whose remainder is canceled by the last record
+    CHILD_CHECK(exchange_take_order(x, 0, alice, BOOK_BUY, 9, 20, BRS_ORDER_IOC, &qty) != 0 && qty == 1);
+
+    struct journal_stats stats;
+    journal_get_stats(&stats);
+    rep.last_seq = stats.last_seq;
+    rep.bytes = stats.bytes;
+    CHILD_CHECK(record_state(x, &w) == 0);
+    rep.len = w.len;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/expected", journal_dir);
+    FILE *f = fopen(path, "w");
+    CHILD_CHECK(f && fwrite(&rep, sizeof(rep), 1, f) == 1 && fwrite(w.buf, 1, w.len, f) == w.len);
+    fclose(f);
+    _exit(0);
+}
+
+Test(student_suite, 15_recovery_round_trip, .init = recovery_setup, .fini = recovery_teardown, .timeout = 10) {
+    static struct snapshot_writer expected, recovered;
+    pid_t pid = fork();
+    if (pid == 0) {
+        recovery_child();
+    }
+    int status;
+    cr_assert_eq(waitpid(pid, &status, 0), pid, "waitpid failed");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Trading before the restart failed");
+
+    struct recovery_report rep;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/expected", journal_dir);
+    FILE *f = fopen(path, "r");
+    cr_assert_not_null(f, "Cannot read %s", path);
+    cr_assert_eq(fread(&rep, sizeof(rep), 1, f), 1, "Cannot read %s", path);
+    cr_assert_eq(fread(expected.buf, 1, rep.len, f), rep.len, "Cannot read %s", path);
+    fclose(f);
+    unlink(path);
+
+    // Damage the last record, so that the cancel of the remainder is lost
+    // as if the server had stopped before it was written
+    snprintf(path, sizeof(path), "%s/journal-000001.log", journal_dir);
+    int fd = open(path, O_RDWR);
+    cr_assert_neq(fd, -1, "Cannot open %s", path);
+    off_t off = sizeof(struct journal_segment_header) + rep.bytes - sizeof(struct journal_record)
+                + offsetof(struct journal_record, quantity);
+    quantity_t qty;
+    cr_assert_eq(pread(fd, &qty, sizeof(qty), off), sizeof(qty), "Cannot read %s", path);
+    cr_assert_eq(qty, 1, "Expected the last record to cancel 1, was %u", qty);
+    qty = 0;
+    cr_assert_eq(pwrite(fd, &qty, sizeof(qty), off), sizeof(qty), "Cannot write %s", path);
+    close(fd);
+
+    // Recovery stops short of it, finishes the order and comes to the same state
+    uint64_t last_seq;
+    EXCHANGE *x = recovery_start(&last_seq);
+    cr_assert_not_null(x, "Recovery failed");
+    cr_assert_eq(last_seq, rep.last_seq - 1, "Expected recovery up to %lu, was %lu",
+                 (unsigned long)rep.last_seq - 1, (unsigned long)last_seq);
+    cr_assert_eq(record_state(x, &recovered), 0, "State is too large to be compared");
+    cr_assert_eq(recovered.len, rep.len, "Recovered state has %zu bytes, expected %zu", recovered.len, rep.len);
+    cr_assert_eq(memcmp(recovered.buf, expected.buf, rep.len), 0, "Recovered state differs");
+
+    // The order left behind is owned for its account, which can cancel it
+    TRADER *carol = trader_login(BENCH_FAKE_FD + 2, "carol");
+    cr_assert_not_null(carol, "Login failed");
+    cr_assert_eq(exchange_cancel_order(x, 0, carol, rep.carol_order, &qty), 0, "Cancel of recovered order failed");
+    cr_assert_eq(qty, 5, "Expected 5 canceled, was %u", qty);
+
+    exchange_fini(x);
+    trader_logout(carol);
+    traders_fini();
+    accounts_fini();
+}
+
+Test(student_suite, 16_amend_fills, .init = exchange_setup, .fini = exchange_teardown, .timeout = 5) {
+    cr_assert_neq(exchange_post_sell(xchg, seller, 3, 10), 0, "Sell order was not posted");
+    orderid_t id = exchange_post_buy(xchg, buyer, 5, 9);
+    cr_assert_neq(id, 0, "Buy order was not posted");
+
+    // Raised to cross the book, the order is partly filled at once, and
+    // only what is left rests
+    quantity_t remaining;
+    cr_assert_eq(exchange_amend_order(xchg, 0, buyer, id, 5, 10, &remaining), 0, "Amendment failed");
+    cr_assert_eq(remaining, 2, "Expected 2 remaining, was %u", remaining);
+    expect_account(buyer, 1000 - 5 * 10, 3);
+
+    // Wholly filled, it no longer rests at all
+    cr_assert_neq(exchange_post_sell(xchg, seller, 6, 12), 0, "Sell order was not posted");
+    cr_assert_eq(exchange_amend_order(xchg, 0, buyer, id, 4, 12, &remaining), 0, "Amendment failed");
+    cr_assert_eq(remaining, 0, "Expected nothing remaining, was %u", remaining);
+    expect_account(buyer, 1000 - 3 * 10 - 4 * 12, 7);
+
+    BRS_STATUS_INFO info;
+    exchange_get_status(xchg, NULL, &info);
+    cr_assert_eq(ntohl(info.bid), 0, "Expected no buy order left in the book");
+    cr_assert_eq(ntohl(info.ask), 12, "Expected the rest of the sell order to be left alone");
+}
+
+/*
+ * The market-data tests log a trader in on one end of a socket pair and read
+ * what it is sent from the other, as its client would.
+ */
+static int client_fd[2] = { -1, -1 };
+
+static void client_connect(void) {
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, client_fd), 0, "socketpair failed");
+}
+
+static void client_close(void) {
+    for (int i = 0; i < 2; i++) {
+        if (client_fd[i] != -1) {
+            close(client_fd[i]);
+            client_fd[i] = -1;
+        }
+    }
+}
+
+/*
+ * Read exactly len bytes from the client's end, waiting at most timeout_ms
+ * for each part of them.
+ *
+ * @return 0 if successful, -1 if they did not all arrive in time.
+ */
+static int client_read(void *buf, size_t len, int timeout_ms) {
+    struct pollfd pfd = { .fd = client_fd[1], .events = POLLIN };
+    while (len > 0) {
+        if (poll(&pfd, 1, timeout_ms) != 1) {
+            return -1;
+        }
+        ssize_t n = read(client_fd[1], buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Read the next packet sent to the client.
+ *
+ * @param payload  Where to put the payload, with room for size bytes.
+ * @return 0 if successful, -1 if none arrived in time or its payload
+ * would not fit.
+ */
+static int client_recv(BRS_PACKET_HEADER *hdr, void *payload, size_t size, int timeout_ms) {
+    if (client_read(hdr, sizeof(*hdr), timeout_ms) == -1 || ntohs(hdr->size) > size) {
+        return -1;
+    }
+    return client_read(payload, ntohs(hdr->size), timeout_ms);
+}
+
+#define FEED_HISTORY 8
+
+static TRADER *feed_trader;
+
+static void feed_setup(void) {
+    config.md_group = "239.255.42.99";
+    config.md_port = 14299;
+    config.md_interface = "127.0.0.1";
+    config.md_history = FEED_HISTORY;
+    cr_assert_eq(accounts_init(), 0, "accounts_init failed");
+    cr_assert_eq(traders_init(), 0, "traders_init failed");
+    cr_assert_eq(md_feed_init(), 0, "md_feed_init failed");
+    client_connect();
+    cr_assert_not_null(feed_trader = trader_login(client_fd[0], "watcher"), "Login of watcher failed");
+}
+
+static void feed_teardown(void) {
+    if (feed_trader) {
+        trader_logout(feed_trader);
+    }
+    md_feed_fini();
+    traders_fini();
+    accounts_fini();
+    client_close();
+}
+
+/*
+ * Ask for datagrams again and check that exactly those from first to last
+ * are resent, in order, each just as it was published.
+ */
+static void expect_resent(uint64_t first, uint32_t count, uint64_t last) {
+    BRS_RESEND_REQUEST req = { .first = htobe64(first), .count = htonl(count) };
+    int n = md_feed_resend(feed_trader, &req);
+    cr_assert_eq(n, last - first + 1, "Expected %lu datagrams resent from %lu, was %d",
+                 (unsigned long)(last - first + 1), (unsigned long)first, n);
+
+    for (uint64_t seq = first; seq <= last; seq++) {
+        BRS_PACKET_HEADER hdr;
+        char dg[sizeof(BRS_MD_HEADER) + sizeof(BRS_PACKET_HEADER) + sizeof(BRS_NOTIFY_INFO)];
+        cr_assert_eq(client_recv(&hdr, dg, sizeof(dg), 1000), 0, "RESENT of datagram %lu did not arrive",
+                     (unsigned long)seq);
+        cr_assert_eq(hdr.type, BRS_RESENT_PKT, "Expected a RESENT packet, was type %d", hdr.type);
+        cr_assert_eq(ntohs(hdr.size), sizeof(dg), "Expected the whole datagram to be resent");
+
+        BRS_MD_HEADER md;
+        BRS_NOTIFY_INFO info;
+        memcpy(&md, dg, sizeof(md));
+        memcpy(&info, dg + sizeof(md) + sizeof(BRS_PACKET_HEADER), sizeof(info));
+        cr_assert_eq(be64toh(md.seq), seq, "Expected datagram %lu, was %lu", (unsigned long)seq,
+                     (unsigned long)be64toh(md.seq));
+        cr_assert_eq(ntohl(info.buyer), seq, "Datagram %lu does not hold what was published",
+                     (unsigned long)seq);
+    }
+    BRS_PACKET_HEADER hdr;
+    char extra[64];
+    cr_assert_eq(client_recv(&hdr, extra, sizeof(extra), 100), -1, "Expected nothing after datagram %lu",
+                 (unsigned long)last);
+}
+
+Test(student_suite, 17_md_feed_resend_wrapped, .init = feed_setup, .fini = feed_teardown, .timeout = 5) {
+    // Publish enough to go round the history twice and a half; the last
+    // FEED_HISTORY datagrams are kept
+    const uint64_t published = 2 * FEED_HISTORY + FEED_HISTORY / 2;
+    for (uint64_t seq = 1; seq <= published; seq++) {
+        BRS_NOTIFY_INFO info = { .buyer = htonl(seq), .quantity = htonl(1), .price = htonl(10) };
+        BRS_PACKET_HEADER hdr = { .type = BRS_POSTED_PKT, .size = htons(sizeof(info)) };
+        cr_assert_eq(md_feed_publish(&hdr, &info), seq, "Expected datagram %lu to be published",
+                     (unsigned long)seq);
+    }
+    const uint64_t oldest = published - FEED_HISTORY + 1;
+
+    // Only the kept datagrams can be asked for
+    BRS_RESEND_REQUEST req = { .first = htobe64(oldest - 1), .count = htonl(2) };
+    cr_assert_eq(md_feed_resend(feed_trader, &req), -1, "Expected an overwritten datagram to be refused");
+    req.first = htobe64(published + 1);
+    cr_assert_eq(md_feed_resend(feed_trader, &req), -1, "Expected a datagram not yet sent to be refused");
+
+    // A range running past the newest is cut short there
+    expect_resent(oldest + 3, 100, published);
+    expect_resent(oldest, FEED_HISTORY, published);
+    expect_resent(oldest, 2, oldest + 1);
+}
+
+#define CONFLATE_TRADES 1000        // made before the watcher's client reads anything
+#define CONFLATE_PENDING 100        // waiting to be published when it resumes
+
+static TRADER *watcher;
+
+/*
+ * The publisher can be held while it sends a POSTED_INST to one of the
+ * other traders: once the gate is shut, the next one stops it until the
+ * gate is opened.
+ */
+static atomic_bool gate_shut, gate_holding;
+
+static void gate_packet(int fd, const BRS_PACKET_HEADER *hdr, size_t len) {
+    count_packet(fd, hdr, len);
+    if (hdr->type == BRS_POSTED_INST_PKT && atomic_load(&gate_shut)) {
+        atomic_store(&gate_holding, true);
+        while (atomic_load(&gate_shut)) {
+            usleep(1000);
+        }
+    }
+}
+
+static void conflate_setup(void) {
+    config.conflate_backlog = 4096;
+    config.instruments = 2;
+    exchange_setup();
+    bench_capture = gate_packet;
+    account_increase_inventory(trader_get_account(seller), CONFLATE_TRADES + CONFLATE_PENDING);
+    account_increase_balance(trader_get_account(buyer), (CONFLATE_TRADES + CONFLATE_PENDING) * 10);
+
+    // A small socket buffer, so that the watcher's backlog builds up quickly
+    client_connect();
+    int size = 4096;
+    cr_assert_eq(setsockopt(client_fd[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)), 0, "setsockopt failed");
+    cr_assert_not_null(watcher = trader_login(client_fd[0], "watcher"), "Login of watcher failed");
+}
+
+static void conflate_teardown(void) {
+    atomic_store(&gate_shut, false);
+    exchange_stop();
+    if (watcher) {
+        trader_logout(watcher);
+    }
+    exchange_teardown();
+    client_close();
+}
+
+/*
+ * What the watcher's client has been told, gathered by its reader thread.
+ */
+static struct {
+    atomic_bool stop;
+    atomic_uint traded;             // trades reported one by one or summed up
+    atomic_uint traded_after;       // TRADEDs after the first BOOK_INST
+    atomic_uint books;              // BOOK_INSTs
+    atomic_uint bad;                // summaries or books not as expected
+} seen;
+
+static void *watcher_reader(void *arg) {
+    BRS_PACKET_HEADER hdr;
+    char payload[sizeof(BRS_DEPTH_INFO) + 2 * BRS_DEPTH_MAX_LEVELS * sizeof(BRS_DEPTH_LEVEL)];
+
+    while (!atomic_load(&seen.stop)) {
+        if (client_recv(&hdr, payload, sizeof(payload), 100) == -1) {
+            continue;
+        }
+        if (hdr.type == BRS_TRADED_PKT) {
+            atomic_fetch_add(&seen.traded, 1);
+            if (atomic_load(&seen.books) > 0) {
+                atomic_fetch_add(&seen.traded_after, 1);
+            }
+        } else if (hdr.type == BRS_TRADES_INST_PKT) {
+            BRS_TRADES_INFO info;
+            memcpy(&info, payload, sizeof(info));
+            atomic_fetch_add(&seen.traded, ntohl(info.trades));
+            if (ntohs(info.instrument) != 0 || ntohl(info.quantity) != ntohl(info.trades)
+                || ntohl(info.low) != 10 || ntohl(info.high) != 10) {
+                atomic_fetch_add(&seen.bad, 1);
+            }
+        } else if (hdr.type == BRS_BOOK_INST_PKT) {
+            // Every sell has been bought, and the one bid for instrument 1 rests
+            BRS_DEPTH_INFO info;
+            BRS_DEPTH_LEVEL level;
+            memcpy(&info, payload, sizeof(info));
+            memcpy(&level, payload + sizeof(info), sizeof(level));
+            bool ok = (ntohs(info.instrument) == 0) ? info.nbids == 0 && info.nasks == 0
+                    : ntohs(info.nbids) == 1 && info.nasks == 0 && ntohl(level.price) == 5;
+            if (!ok) {
+                atomic_fetch_add(&seen.bad, 1);
+            }
+            atomic_fetch_add(&seen.books, 1);
+        }
+    }
+    return NULL;
+}
+
+static void trade_once(void) {
+    cr_assert_neq(exchange_post_sell(xchg, seller, 1, 10), 0, "Sell order was not posted");
+    cr_assert_neq(exchange_post_buy(xchg, buyer, 1, 10), 0, "Buy order was not posted");
+}
+
+static void wait_for(atomic_uint *counter, unsigned count) {
+    for (int i = 0; i < 1000 && atomic_load(counter) < count; i++) {
+        usleep(10000);
+    }
+}
+
+Test(student_suite, 18_conflated_resume, .init = conflate_setup, .fini = conflate_teardown, .timeout = 30) {
+    // Unread, the watcher falls behind and is conflated
+    for (size_t i = 0; i < CONFLATE_TRADES; i++) {
+        trade_once();
+    }
+    wait_for(&packets[0][BRS_SOLD_PKT], CONFLATE_TRADES);
+
+    // Hold the publisher on instrument 1, and trade on instrument 0 behind
+    // it: the depth copy then reflects events it has yet to send
+    atomic_store(&gate_shut, true);
+    cr_assert_neq(exchange_post_order(xchg, 1, buyer, BOOK_BUY, 1, 5), 0, "Buy order was not posted");
+    for (int i = 0; i < 1000 && !atomic_load(&gate_holding); i++) {
+        usleep(1000);
+    }
+    cr_assert(atomic_load(&gate_holding), "Expected the publisher to be held");
+    for (size_t i = 0; i < CONFLATE_PENDING; i++) {
+        trade_once();
+    }
+
+    // The client catches up while the publisher is held, so the watcher
+    // resumes as soon as it is let go
+    pthread_t reader;
+    cr_assert_eq(pthread_create(&reader, NULL, watcher_reader, NULL), 0, "pthread_create failed");
+    for (int i = 0; i < 1000 && trader_backlog(watcher) > 0; i++) {
+        usleep(1000);
+    }
+    usleep(20000);
+    atomic_store(&gate_shut, false);
+
+    wait_for(&seen.books, 2);
+    exchange_stop();
+    usleep(100000);
+    atomic_store(&seen.stop, true);
+    pthread_join(reader, NULL);
+
+    cr_assert_eq(atomic_load(&seen.books), 2, "Expected one book for each instrument, was %u",
+                 atomic_load(&seen.books));
+    cr_assert_eq(atomic_load(&seen.bad), 0, "Expected every summary and book to be as traded");
+    cr_assert_eq(atomic_load(&seen.traded_after), 0, "Expected no TRADED the books already reflect");
+    unsigned traded = atomic_load(&seen.traded);
+    cr_assert_eq(traded, CONFLATE_TRADES + CONFLATE_PENDING, "Expected each of %u trades reported once, was %u",
+                 CONFLATE_TRADES + CONFLATE_PENDING, traded);
+}